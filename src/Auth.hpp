@@ -88,4 +88,17 @@ typedef AuthPlugin *authcreate_t(ConfigVar &);
 // Return an instance of the plugin defined in the given configuration file
 AuthPlugin *auth_plugin_load(const char *pluginConfigPath);
 
+#ifdef PRT_DNSAUTH
+// dnsauth lookup cache counters, kept by the children in shared memory
+struct dnsauth_stats {
+    unsigned long hits; // users found in the cache
+    unsigned long negative_hits; // IPs the cache knows have no user
+    unsigned long stale_hits; // expired entries used while being refreshed
+    unsigned long misses; // lookups the child had to wait for
+};
+
+// read the counters since the last call (all 0 if the cache isn't in use)
+void takeDnsAuthStats(dnsauth_stats *stats);
+#endif
+
 #endif
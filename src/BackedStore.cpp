@@ -26,14 +26,15 @@
 #include <sys/time.h>
 
 #include "BackedStore.hpp"
+#include "FDFuncs.hpp"
 
 #ifdef DGDEBUG
 #include <iostream>
 #endif
 // IMPLEMENTATION
 
-BackedStore::BackedStore(size_t _ramsize, size_t _disksize, const char *_tempdir)
-    : fd(-1), length(0), filename(NULL), ramsize(_ramsize), disksize(_disksize), tempdir(_tempdir), map(MAP_FAILED)
+BackedStore::BackedStore(size_t _ramsize, size_t _disksize, const char *_tempdir, int _tempmode)
+    : fd(-1), length(0), filename(NULL), ramsize(_ramsize), disksize(_disksize), tempdir(_tempdir), tempmode(_tempmode), map(MAP_FAILED)
 {
 }
 
@@ -44,7 +45,7 @@ BackedStore::~BackedStore()
 
     if (fd >= 0) {
 #ifdef DGDEBUG
-        std::cout << "BackedStore: closing & deleting temp file " << filename << " BADGERS!" << std::endl;
+        std::cout << "BackedStore: closing & deleting temp file " << (filename ? filename : "(unnamed)") << " BADGERS!" << std::endl;
 #endif
         int rc = 0;
         do {
@@ -54,12 +55,15 @@ BackedStore::~BackedStore()
         if (rc < 0)
             std::cout << "BackedStore: cannot close temp file fd: " << strerror(errno) << std::endl;
 #endif
-        rc = unlink(filename);
+        // unnamed temp files vanish on close
+        if (filename != NULL) {
+            rc = unlink(filename);
 #ifdef DGDEBUG
-        if (rc < 0)
-            std::cout << "BackedStore: cannot delete temp file: " << strerror(errno) << std::endl;
+            if (rc < 0)
+                std::cout << "BackedStore: cannot delete temp file: " << strerror(errno) << std::endl;
 #endif
-        free(filename);
+            free(filename);
+        }
     }
 }
 
@@ -88,23 +92,30 @@ bool BackedStore::append(const char *data, size_t len)
             // Open temp file, dump current data in there,
             // leave code below this if{} to write current
             // data to the file as well
-            std::string filename_str = tempdir + "/__dgbsXXXXXX";
-            filename = const_cast<char *>(filename_str.c_str());
-#ifdef DGDEBUG
-            std::cout << "BackedStore: filename template: " << filename << std::endl;
-#endif
             //	mode_t mask = umask(S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP); // this mask is reversed
             umask(0007); // only allow access to e2g user and group
-            if ((fd = mkstemp(filename)) < 0) {
-                std::ostringstream ss;
-                ss << "BackedStore could not create temp file: " << strerror(errno);
-                free(filename);
-                throw std::runtime_error(ss.str().c_str());
+            // try for an unnamed memfd/O_TMPFILE first, if so configured
+            if ((fd = createAnonTempFile(tempdir.c_str(), tempmode)) < 0) {
+                std::string filename_str = tempdir + "/__dgbsXXXXXX";
+                filename = strdup(filename_str.c_str());
+#ifdef DGDEBUG
+                std::cout << "BackedStore: filename template: " << filename << std::endl;
+#endif
+                if ((fd = mkstemp(filename)) < 0) {
+                    std::ostringstream ss;
+                    ss << "BackedStore could not create temp file: " << strerror(errno);
+                    free(filename);
+                    filename = NULL;
+                    throw std::runtime_error(ss.str().c_str());
+                }
+#ifdef DGDEBUG
+                std::cout << "BackedStore: filename: " << filename << std::endl;
+#endif
             }
 #ifdef DGDEBUG
-            std::cout << "BackedStore: filename: " << filename << std::endl;
+            else
+                std::cout << "BackedStore: using unnamed temp file" << std::endl;
 #endif
-            free(filename);
 
             size_t bytes_written = 0;
             ssize_t rc = 0;
@@ -180,6 +191,12 @@ void BackedStore::finalise()
         ss << "BackedStore could not mmap() temp file: " << strerror(errno);
         throw std::runtime_error(ss.str().c_str());
     }
+#ifdef MADV_HUGEPAGE
+    // large stores are scanned straight through - huge pages cut TLB misses
+    // where the temp file lives on tmpfs/memfd with huge pages enabled
+    if (length >= 2 * 1024 * 1024)
+        madvise(map, length, MADV_HUGEPAGE);
+#endif
 }
 
 const char *BackedStore::getData() const
@@ -201,8 +218,8 @@ const char *BackedStore::getData() const
 
 std::string BackedStore::store(const char *prefix)
 {
-    if (fd >= 0) {
-        // We already have a temp file on disk
+    if (fd >= 0 && filename != NULL) {
+        // We already have a named temp file on disk
         // Try creating a hardlink with the new name and see what happens
         std::ostringstream storedname;
         storedname << prefix;
@@ -213,12 +230,11 @@ std::string BackedStore::store(const char *prefix)
         gettimeofday(&tv, NULL);
         storedname << '-' << tv.tv_sec << tv.tv_usec << std::flush;
 
-        char *name = strrchr(filename, '/');
 #ifdef DGDEBUG
-        std::cout << "BackedStore: creating hard link: " << storedname << std::endl;
+        std::cout << "BackedStore: creating hard link: " << storedname.str() << std::endl;
 #endif
         std::string storedname_str(storedname.str());
-        int rc = link(name, storedname_str.c_str());
+        int rc = link(filename, storedname_str.c_str());
         if (rc >= 0)
             // Success!  Return new filename
             return storedname_str;
@@ -231,7 +247,7 @@ std::string BackedStore::store(const char *prefix)
         }
     }
 
-    // We don't already have a temp file,
+    // We don't already have a named temp file,
     // or a simple link wasn't sufficient (EXDEV)
     // Generate a new filename in the given directory, with the given name prefix
     // Include timestamp in the name for added uniqueness
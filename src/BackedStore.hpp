@@ -11,10 +11,11 @@
 class BackedStore
 {
     public:
-    // Constructor - pass in RAM & disk thresholds
-    // and a directory path for temp files
+    // Constructor - pass in RAM & disk thresholds,
+    // a directory path for temp files and how to
+    // create them (DG_TEMPFILE_* from FDFuncs.hpp)
     BackedStore(size_t _ramsize, size_t _disksize,
-        const char *_tempdir = "/tmp");
+        const char *_tempdir = "/tmp", int _tempmode = 0);
     ~BackedStore();
 
     // Add data to the store - returns false if
@@ -46,7 +47,7 @@ class BackedStore
     // Size of buffer/file
     size_t length;
 
-    // Temp file name
+    // Temp file name - NULL if the temp file is unnamed
     char *filename;
 
     // Thresholds
@@ -56,6 +57,9 @@ class BackedStore
     // Temp directory path
     std::string tempdir;
 
+    // Temp file creation mode
+    int tempmode;
+
     // Pointer to mmapped file contents
     void *map;
 };
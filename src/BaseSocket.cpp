@@ -19,12 +19,16 @@
 #include <stdexcept>
 #include <syslog.h>
 #include <sys/select.h>
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 
 #ifdef DGDEBUG
 #include <iostream>
 #endif
 
 #include "BaseSocket.hpp"
+#include "FDFuncs.hpp"
 
 // GLOBALS
 extern bool reloadconfig;
@@ -177,6 +181,23 @@ void BaseSocket::close()
     bufflen = 0;
 }
 
+// detach the FD from this socket without closing it
+int BaseSocket::releaseFD()
+{
+    int fd = sck;
+    sck = -1;
+    buffstart = 0;
+    bufflen = 0;
+    return fd;
+}
+
+// close the current FD and take over the given one
+void BaseSocket::adoptFD(int fd)
+{
+    close();
+    sck = fd;
+}
+
 // set the socket-wide timeout
 void BaseSocket::setTimeout(int t)
 {
@@ -391,6 +412,65 @@ bool BaseSocket::writeToSocket(const char *buff, int len, unsigned int flags, in
     return true;
 }
 
+// send part of a file to the socket. sendfile() lets the kernel move the data
+// straight from the page cache, instead of reading it into a buffer and
+// writing it back out again; fall back to doing that if sendfile can't be used.
+off_t BaseSocket::writeFromFile(int fd, off_t offset, off_t len, int timeout)
+{
+    off_t sent = 0;
+#ifdef HAVE_SYS_SENDFILE_H
+    while (sent < len) {
+        try {
+            readyForOutput(timeout); // throws exception on error or timeout
+        } catch (std::exception &e) {
+            return -1;
+        }
+        off_t pos = offset + sent;
+        ssize_t rc = sendfile(sck, fd, &pos, ((len - sent) > 0x7ffff000) ? 0x7ffff000 : (len - sent));
+        if (rc < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            if ((errno == EINVAL || errno == ENOSYS) && (sent == 0)) {
+                break; // not supported for this fd, so copy by hand
+            }
+            return -1;
+        }
+        if (rc == 0) {
+            return sent; // file shorter than expected
+        }
+        sent += rc;
+    }
+    if (sent >= len) {
+        return sent;
+    }
+#endif
+    return copyFromFile(fd, offset, sent, len, timeout);
+}
+
+off_t BaseSocket::copyFromFile(int fd, off_t offset, off_t sent, off_t len, int timeout)
+{
+    if (lseek(fd, offset + sent, SEEK_SET) < 0) {
+        return -1;
+    }
+    char buff[65536];
+    int rc;
+    while (sent < len) {
+        rc = readEINTR(fd, buff, ((len - sent) > (off_t)sizeof(buff)) ? sizeof(buff) : (len - sent));
+        if (rc < 0) {
+            return -1;
+        }
+        if (rc == 0) {
+            break; // file shorter than expected
+        }
+        if (!writeToSocket(buff, rc, 0, timeout)) {
+            return -1;
+        }
+        sent += rc;
+    }
+    return sent;
+}
+
 // read a specified expected amount and return what actually read
 int BaseSocket::readFromSocketn(char *buff, int len, unsigned int flags, int timeout)
 {
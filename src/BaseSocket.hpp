@@ -35,6 +35,11 @@ class BaseSocket
     // close socket
     void close();
 
+    // hand the FD over to the caller without closing it (e.g. to park it in a connection pool)
+    int releaseFD();
+    // close the current FD and take over an already connected one
+    void adoptFD(int fd);
+
     // set socket-wide timeout (is this actually used? all methods accept their own individual timeouts)
     void setTimeout(int t);
     // get timeout (is this actually used?)
@@ -59,13 +64,17 @@ class BaseSocket
     // write buffer to string - throws std::exception on error
     void writeString(const char *line) throw(std::exception);
     // write buffer to string - can be told not to do an initial readyForOutput, and told to break on -r
-    bool writeToSocket(const char *buff, int len, unsigned int flags, int timeout, bool check_first = true, bool honour_reloadconfig = false);
+    // (virtual so that copyFromFile goes through SSL on SSL sockets)
+    virtual bool writeToSocket(const char *buff, int len, unsigned int flags, int timeout, bool check_first = true, bool honour_reloadconfig = false);
     // read from socket, returning number of bytes read
     int readFromSocketn(char *buff, int len, unsigned int flags, int timeout);
     // read from socket, returning error status - can be told to skip initial checkForInput, and to break on -r
     int readFromSocket(char *buff, int len, unsigned int flags, int timeout, bool check_first = true, bool honour_reloadconfig = false);
     // write to socket, throwing std::exception on error - can be told to break on -r
     void writeToSockete(const char *buff, int len, unsigned int flags, int timeout, bool honour_reloadconfig = false) throw(std::exception);
+    // send len bytes of an open file, starting at offset, using sendfile() where available.
+    // returns number of bytes sent (short if the file ends early), or -1 on error
+    off_t writeFromFile(int fd, off_t offset, off_t len, int timeout);
 
     protected:
     // socket-wide timeout (is this actually used?)
@@ -79,6 +88,10 @@ class BaseSocket
     int buffstart;
     int bufflen;
 
+    // the rest of a file after sent bytes have gone, read in and passed to writeToSocket -
+    // for when sendfile() can't be used
+    off_t copyFromFile(int fd, off_t offset, off_t sent, off_t len, int timeout);
+
     // constructor - sets default values. override this if you actually wish to create a default socket.
     BaseSocket();
     // destructor - closes socket
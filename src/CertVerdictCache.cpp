@@ -0,0 +1,151 @@
+// Shared cache of upstream certificate check results
+//
+// Checking the certificate of a site that is tunnelled rather than MITM'd
+// takes a connection, proxy CONNECT & handshake of its own, so results are
+// kept in a fixed size, hostname hashed table in shared memory for any child
+// to use until they expire.  The certificate's fingerprint is kept alongside,
+// so a MITM'd connection - which already has the certificate - only trusts
+// a result for the certificate it was actually given.
+
+// For all support, instructions and copyright go to:
+// http://e2guardian.org/
+// Released under the GPL v2, with the OpenSSL exception described in the README file.
+
+// INCLUDES
+
+#ifdef HAVE_CONFIG_H
+#include "dgconfig.h"
+#endif
+
+#ifdef __SSLMITM
+
+#include <string.h>
+#include <syslog.h>
+#include <ctime>
+#include <sys/mman.h>
+
+#include "openssl/evp.h"
+#include "openssl/x509.h"
+
+#include "CertVerdictCache.hpp"
+
+// DEFINES
+
+#define CERT_VERDICT_HOST_SIZE 256
+#define CERT_VERDICT_FP_SIZE 32 // SHA-256
+
+// DECLARATIONS
+
+struct cert_verdict_slot {
+    volatile int lock;
+    time_t expires;
+    char host[CERT_VERDICT_HOST_SIZE];
+    unsigned char fingerprint[CERT_VERDICT_FP_SIZE];
+    cert_verdict verdict;
+};
+
+struct cert_verdict_state {
+    int ttl;
+    int slots;
+    // cert_verdict_slot[slots] follows
+};
+
+static cert_verdict_state *shared = NULL;
+static cert_verdict_slot *slots = NULL;
+
+// IMPLEMENTATION
+
+bool initCertVerdictCache(int nslots, int ttl)
+{
+    if (shared != NULL) {
+        shared->ttl = ttl;
+        return true;
+    }
+    if (nslots < 1)
+        return true;
+
+    size_t len = sizeof(cert_verdict_state) + nslots * sizeof(cert_verdict_slot);
+    void *mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        syslog(LOG_ERR, "Unable to allocate %lu bytes of shared memory for certificate check cache", (unsigned long)len);
+        return false;
+    }
+    shared = (cert_verdict_state *)mem;
+    slots = (cert_verdict_slot *)(shared + 1);
+    shared->slots = nslots;
+    shared->ttl = ttl;
+    return true;
+}
+
+static cert_verdict_slot *hostSlot(const char *hostname)
+{
+    // FNV-1a
+    unsigned long h = 2166136261UL;
+    for (const char *c = hostname; *c; c++) {
+        h ^= (unsigned char)*c;
+        h *= 16777619UL;
+    }
+    return &slots[h % shared->slots];
+}
+
+// slots are never waited for - if another child has one locked, just skip the cache
+static bool lockSlot(cert_verdict_slot *slot)
+{
+    return __sync_lock_test_and_set(&slot->lock, 1) == 0;
+}
+
+static void unlockSlot(cert_verdict_slot *slot)
+{
+    __sync_lock_release(&slot->lock);
+}
+
+static bool fingerprint(X509 *cert, unsigned char *md)
+{
+    unsigned int len = 0;
+    return X509_digest(cert, EVP_sha256(), md, &len) && len == CERT_VERDICT_FP_SIZE;
+}
+
+bool lookupCertVerdict(const char *hostname, X509 *cert, cert_verdict *verdict)
+{
+    if (shared == NULL || shared->ttl < 1 || strlen(hostname) >= CERT_VERDICT_HOST_SIZE)
+        return false;
+
+    unsigned char md[CERT_VERDICT_FP_SIZE];
+    if (cert != NULL && !fingerprint(cert, md))
+        return false;
+
+    bool found = false;
+    cert_verdict_slot *slot = hostSlot(hostname);
+    if (!lockSlot(slot))
+        return false;
+    if (slot->expires > time(NULL) && !strcmp(slot->host, hostname)
+        && (cert == NULL || !memcmp(slot->fingerprint, md, CERT_VERDICT_FP_SIZE))) {
+        *verdict = slot->verdict;
+        found = true;
+    }
+    unlockSlot(slot);
+    return found;
+}
+
+void storeCertVerdict(const char *hostname, X509 *cert, const cert_verdict &verdict)
+{
+    if (shared == NULL || shared->ttl < 1 || strlen(hostname) >= CERT_VERDICT_HOST_SIZE)
+        return;
+
+    // no certificate at all is also worth remembering
+    unsigned char md[CERT_VERDICT_FP_SIZE];
+    memset(md, 0, sizeof(md));
+    if (cert != NULL && !fingerprint(cert, md))
+        return;
+
+    cert_verdict_slot *slot = hostSlot(hostname);
+    if (!lockSlot(slot))
+        return;
+    strcpy(slot->host, hostname);
+    memcpy(slot->fingerprint, md, CERT_VERDICT_FP_SIZE);
+    slot->verdict = verdict;
+    slot->expires = time(NULL) + shared->ttl;
+    unlockSlot(slot);
+}
+
+#endif //__SSLMITM
@@ -0,0 +1,33 @@
+// Shared cache of upstream certificate check results
+
+// For all support, instructions and copyright go to:
+// http://e2guardian.org/
+// Released under the GPL v2, with the OpenSSL exception described in the README file.
+
+#ifndef __HPP_CERTVERDICTCACHE
+#define __HPP_CERTVERDICTCACHE
+#ifdef __SSLMITM
+
+#include "openssl/x509.h"
+
+// outcome of checking a site's certificate
+struct cert_verdict {
+    long valid; // Socket::checkCertValid - X509_V_OK, an X509_V_ERR code or -1 for no certificate
+    bool hostname_ok; // Socket::checkCertHostname matched (only meaningful if valid is X509_V_OK)
+};
+
+// set up the shared memory - must be called by the parent before forking children.
+// slots is the number of sites remembered (0 disables the cache), ttl how many
+// seconds a result is trusted for. on reload the existing memory is kept and only
+// ttl is updated
+bool initCertVerdictCache(int slots, int ttl);
+
+// find an unexpired result for hostname. if cert is given, the result only counts
+// when it was for the same certificate (compared by SHA-256 fingerprint)
+bool lookupCertVerdict(const char *hostname, X509 *cert, cert_verdict *verdict);
+
+// remember the result of checking cert, as presented by hostname
+void storeCertVerdict(const char *hostname, X509 *cert, const cert_verdict &verdict);
+
+#endif //__SSLMITM
+#endif //__HPP_CERTVERDICTCACHE
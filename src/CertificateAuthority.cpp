@@ -10,6 +10,7 @@
 
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <string.h>
 #include <errno.h>
 #include <syslog.h>
@@ -22,15 +23,33 @@
 #include <openssl/conf.h>
 #include <openssl/x509.h>
 #include <openssl/x509v3.h>
+#include <openssl/ocsp.h>
 #include "openssl/bio.h"
 #include "openssl/ssl.h"
 #include "openssl/err.h"
 
 #include "CertificateAuthority.hpp"
 #include "OptionContainer.hpp"
+#include "UDSocket.hpp"
 
 extern OptionContainer o;
 
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define X509_up_ref(x) CRYPTO_add(&(x)->references, 1, CRYPTO_LOCK_X509)
+#define EVP_PKEY_up_ref(k) CRYPTO_add(&(k)->references, 1, CRYPTO_LOCK_EVP_PKEY)
+#endif
+
+// generated certificates are around 1k, so this leaves plenty of room
+#define CA_SHARED_DER_SIZE 2048
+#define CA_SHARED_NAME_SIZE 256
+
+struct ca_shared_slot {
+    volatile int lock;
+    char commonname[CA_SHARED_NAME_SIZE];
+    int length;
+    unsigned char der[CA_SHARED_DER_SIZE];
+};
+
 void log_ssl_errors( const char *mess, const char *site) {
     if( o.log_ssl_errors ) {
         syslog(LOG_ERR, mess, site);
@@ -48,7 +67,10 @@ CertificateAuthority::CertificateAuthority(const char *caCert,
     const char *certPrivKey,
     const char *certPath,
     time_t caStart,
-    time_t caEnd)
+    time_t caEnd,
+    unsigned int cacheSize,
+    unsigned int sharedCacheSize)
+    : _ecCertPrivKey(NULL), _certCacheSize(cacheSize), _sharedCerts(NULL), _sharedCertSlots(0), _caChain(NULL)
 {
     FILE *fp;
 
@@ -66,6 +88,23 @@ CertificateAuthority::CertificateAuthority(const char *caCert,
         exit(1);
     }
 
+    //build the chain sent with every forged certificate once, so clients
+    //don't have to go looking for intermediates
+    _caChain = sk_X509_new_null();
+    if (X509_check_issued(_caCert, _caCert) != X509_V_OK) {
+        X509_up_ref(_caCert);
+        sk_X509_push(_caChain, _caCert);
+    }
+    X509 *intermediate;
+    while ((intermediate = PEM_read_X509(fp, NULL, NULL, NULL)) != NULL) {
+        // clients already have the root, if it's there
+        if (X509_check_issued(intermediate, intermediate) == X509_V_OK)
+            X509_free(intermediate);
+        else
+            sk_X509_push(_caChain, intermediate);
+    }
+    ERR_clear_error(); // end of file
+
     fclose(fp);
 
     //load the ca priv key
@@ -107,9 +146,21 @@ CertificateAuthority::CertificateAuthority(const char *caCert,
     //_ca_end = _ca_start + 315532800;  // 6th Dec 2024
     _ca_start = caStart;
     _ca_end = caEnd;
+
+    // the shared cache must be mapped before the children are forked
+    if (sharedCacheSize > 0) {
+        size_t len = sharedCacheSize * sizeof(ca_shared_slot);
+        void *mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            syslog(LOG_ERR, "Unable to allocate shared memory for certificate cache - continuing without");
+        } else {
+            _sharedCerts = (ca_shared_slot *)mem;
+            _sharedCertSlots = sharedCacheSize;
+        }
+    }
 }
 
-bool CertificateAuthority::getSerial(const char *commonname, struct ca_serial *caser)
+bool CertificateAuthority::getSerial(const char *commonname, struct ca_serial *caser, bool ec)
 {
     //generate hash of hostname
     char cnhash[EVP_MAX_MD_SIZE];
@@ -117,33 +168,35 @@ bool CertificateAuthority::getSerial(const char *commonname, struct ca_serial *c
 
     // added to generate different serial number than previous versions
     //   needs to be added as an option
+    // ECDSA certificates need a serial of their own, as they share the issuer
     std::string sname(commonname );
-    sname += "A";
+    sname += ec ? "E" : "A";
 
 #ifdef DGDEBUG
     std::cout << "Generating serial no for " << commonname << std::endl;
 #endif
 
-    EVP_MD_CTX mdctx;
+    // a heap context - the structure is opaque from OpenSSL 1.1 on
+    EVP_MD_CTX *mdctx = EVP_MD_CTX_create();
     const EVP_MD *md = EVP_md5();
-    EVP_MD_CTX_init(&mdctx);
 
-    bool failed = false;
-    if (!failed && EVP_DigestInit_ex(&mdctx, md, NULL) < 1) {
+    bool failed = (mdctx == NULL);
+    if (!failed && EVP_DigestInit_ex(mdctx, md, NULL) < 1) {
         failed = true;
     }
 
 
 //    if (!failed && EVP_DigestUpdate(&mdctx, commonname, strlen(commonname)) < 1) {
-    if (!failed && EVP_DigestUpdate(&mdctx, sname.c_str(), strlen(sname.c_str())) < 1) {
+    if (!failed && EVP_DigestUpdate(mdctx, sname.c_str(), strlen(sname.c_str())) < 1) {
         failed = true;
     }
 
-    if (!failed && EVP_DigestFinal_ex(&mdctx, (unsigned char *)cnhash, &cnhashlen) < 1) {
+    if (!failed && EVP_DigestFinal_ex(mdctx, (unsigned char *)cnhash, &cnhashlen) < 1) {
         failed = true;
     }
 
-    EVP_MD_CTX_cleanup(&mdctx);
+    if (mdctx != NULL)
+        EVP_MD_CTX_destroy(mdctx);
 
     if (failed) {
         return false;
@@ -173,7 +226,7 @@ bool CertificateAuthority::getSerial(const char *commonname, struct ca_serial *c
 //write a certificate to disk being careful to avoid race conditions.
 //returns true if it already existed or false on error
 //common name (sh/c)ould be derived from the certificate but that would add to the complexity of the code
-bool CertificateAuthority::writeCertificate(const char *commonname, X509 *newCert, struct ca_serial *caser)
+bool CertificateAuthority::writeCertificate(const char *commonname, X509 *newCert, struct ca_serial *caser, bool ec)
 {
     std::string path(caser->filename);
     std::string dirpath(caser->filepath);
@@ -229,6 +282,8 @@ bool CertificateAuthority::writeCertificate(const char *commonname, X509 *newCer
         fl.l_type = F_UNLCK;
         fcntl(fd, F_SETLK, &fl);
         close(fd);
+        cacheCertificate(cacheKey(commonname, ec), newCert);
+        shareCertificate(cacheKey(commonname, ec), newCert);
         return true;
     }
 
@@ -270,11 +325,14 @@ bool CertificateAuthority::writeCertificate(const char *commonname, X509 *newCer
     fcntl(fd, F_SETLK, &fl);
     fclose(fp);
     close(fd);
+
+    cacheCertificate(cacheKey(commonname, ec), newCert);
+    shareCertificate(cacheKey(commonname, ec), newCert);
     return true;
 }
 
 //generate a certificate for a given hostname
-X509 *CertificateAuthority::generateCertificate(const char *commonname, struct ca_serial *cser)
+X509 *CertificateAuthority::generateCertificate(const char *commonname, struct ca_serial *cser, bool ec)
 {
     //create a blank cert
     ERR_clear_error();
@@ -329,7 +387,7 @@ X509 *CertificateAuthority::generateCertificate(const char *commonname, struct c
     //set the public key of the new cert
     //the private key data type also contains the pub key which is used below.
     ERR_clear_error();
-    if (X509_set_pubkey(newCert, _certPrivKey) < 1) {
+    if (X509_set_pubkey(newCert, (ec ? _ecCertPrivKey : _certPrivKey)) < 1) {
 #ifdef DGDEBUG
         std::cout << "set_pubkey on cert failed for " << commonname << std::endl;
 #endif
@@ -408,12 +466,116 @@ X509 *CertificateAuthority::generateCertificate(const char *commonname, struct c
     return newCert;
 }
 
+// look in this child's cache - returns a new reference, or NULL
+X509 *CertificateAuthority::getCachedCertificate(const std::string &commonname)
+{
+    std::map<std::string, cert_lru::iterator>::iterator i = _certCacheIndex.find(commonname);
+    if (i == _certCacheIndex.end())
+        return NULL;
+
+    // move to the front
+    _certCache.splice(_certCache.begin(), _certCache, i->second);
+    X509 *cert = i->second->second;
+    X509_up_ref(cert);
+    return cert;
+}
+
+// add to this child's cache (taking a new reference), dropping the least recently used
+void CertificateAuthority::cacheCertificate(const std::string &commonname, X509 *cert)
+{
+    if (_certCacheSize == 0 || _certCacheIndex.count(commonname))
+        return;
+
+    if (_certCache.size() >= _certCacheSize) {
+        X509_free(_certCache.back().second);
+        _certCacheIndex.erase(_certCache.back().first);
+        _certCache.pop_back();
+    }
+    X509_up_ref(cert);
+    _certCache.push_front(std::make_pair(commonname, cert));
+    _certCacheIndex[commonname] = _certCache.begin();
+}
+
+static ca_shared_slot *sharedSlot(ca_shared_slot *slots, unsigned int nslots, const std::string &commonname)
+{
+    // FNV-1a
+    unsigned long h = 2166136261UL;
+    for (std::string::const_iterator c = commonname.begin(); c != commonname.end(); ++c) {
+        h ^= (unsigned char)*c;
+        h *= 16777619UL;
+    }
+    return &slots[h % nslots];
+}
+
+// look in the cache shared by all children - returns a new certificate, or NULL
+// slots locked by another child are treated as a miss rather than waited for
+X509 *CertificateAuthority::getSharedCertificate(const std::string &commonname)
+{
+    if (_sharedCerts == NULL || commonname.length() >= CA_SHARED_NAME_SIZE)
+        return NULL;
+
+    ca_shared_slot *slot = sharedSlot(_sharedCerts, _sharedCertSlots, commonname);
+    if (__sync_lock_test_and_set(&slot->lock, 1))
+        return NULL;
+
+    X509 *cert = NULL;
+    if (slot->length > 0 && commonname == slot->commonname) {
+        const unsigned char *p = slot->der;
+        cert = d2i_X509(NULL, &p, slot->length);
+    }
+    __sync_lock_release(&slot->lock);
+    return cert;
+}
+
+void CertificateAuthority::shareCertificate(const std::string &commonname, X509 *cert)
+{
+    if (_sharedCerts == NULL || commonname.length() >= CA_SHARED_NAME_SIZE)
+        return;
+
+    int len = i2d_X509(cert, NULL);
+    if (len <= 0 || len > CA_SHARED_DER_SIZE)
+        return;
+
+    ca_shared_slot *slot = sharedSlot(_sharedCerts, _sharedCertSlots, commonname);
+    if (__sync_lock_test_and_set(&slot->lock, 1))
+        return;
+
+    unsigned char *p = slot->der;
+    slot->length = i2d_X509(cert, &p);
+    strcpy(slot->commonname, commonname.c_str());
+    __sync_lock_release(&slot->lock);
+}
+
 //sets cert to the certificate for commonname
 //returns true if the cert was loaded from cache / false if it was generated
-bool CertificateAuthority::getServerCertificate(const char *commonname, X509 **cert, struct ca_serial *caser)
+//looks in this child's cache, then the shared cache, then the on disk store
+bool CertificateAuthority::getServerCertificate(const char *commonname, X509 **cert, struct ca_serial *caser, bool ec)
 {
+    std::string cn(cacheKey(commonname, ec));
+
+    caser->asn = NULL;
+    caser->charhex = NULL;
+    caser->filepath = NULL;
+    caser->filename = NULL;
+
+    *cert = getCachedCertificate(cn);
+    if (*cert != NULL) {
+#ifdef DGDEBUG
+        std::cout << "Certificate found in memory cache" << std::endl;
+#endif
+        return true;
+    }
+
+    *cert = getSharedCertificate(cn);
+    if (*cert != NULL) {
+#ifdef DGDEBUG
+        std::cout << "Certificate found in shared cache" << std::endl;
+#endif
+        cacheCertificate(cn, *cert);
+        return true;
+    }
 
-    getSerial(commonname, caser);
+    getSerial(commonname, caser, ec);
     std::string filename(caser->charhex);
 
     // Generate directory path
@@ -441,6 +603,11 @@ bool CertificateAuthority::getServerCertificate(const char *commonname, X509 **c
 
         fclose(link);
 
+        if (*cert != NULL) {
+            cacheCertificate(cn, *cert);
+            shareCertificate(cn, *cert);
+        }
+
         //dont need to check the return as this returns null if it couldnt load a cert
         return true;
     } else {
@@ -448,18 +615,158 @@ bool CertificateAuthority::getServerCertificate(const char *commonname, X509 **c
         std::cout << "Certificate not found. Creating one" << std::endl;
 #endif
 
-        //generate a certificate
-        *cert = generateCertificate(commonname, caser);
+        //generate a certificate - preferably via the generator process, so
+        //children asking for the same new site at once don't all sign one
+        //it is only cached once writeCertificate has stored it on disk
+        *cert = NULL;
+        if (!_generatorIpc.empty())
+            *cert = fetchCertificate(commonname, ec);
+        if (*cert == NULL)
+            *cert = generateCertificate(commonname, caser, ec);
         return false;
     }
 }
 
-EVP_PKEY *CertificateAuthority::getServerPkey()
+void CertificateAuthority::setCertGenerator(const std::string &ipcpath)
+{
+    _generatorIpc = ipcpath;
+}
+
+// request a certificate from the generator process
+// returns NULL on any error, so the caller can fall back to generating it itself
+X509 *CertificateAuthority::fetchCertificate(const char *commonname, bool ec)
+{
+    UDSocket ipcsock;
+    if (ipcsock.getFD() < 0) {
+        syslog(LOG_ERR, "%s", "Error creating ipc socket to certificate generator");
+        return NULL;
+    }
+    if (ipcsock.connect(_generatorIpc.c_str()) < 0) {
+        if (o.logconerror)
+            syslog(LOG_ERR, "%s", "Error connecting via ipc to certificate generator");
+        return NULL;
+    }
+
+    // "hostname" or "hostname ec"
+    std::string request(cacheKey(commonname, ec));
+    request += "\n";
+    char line[32];
+    unsigned char der[4096];
+    int len = 0;
+    try {
+        ipcsock.writeString(request.c_str()); // throws on err
+        ipcsock.getLine(line, sizeof(line), 10); // throws on err
+        len = atoi(line);
+        if (len <= 0 || len > (int)sizeof(der))
+            return NULL;
+        if (ipcsock.readFromSocketn((char *)der, len, 0, 10) != len)
+            return NULL;
+    } catch (std::exception &e) {
+#ifdef DGDEBUG
+        std::cerr << "Exception fetching certificate from generator: " << e.what() << std::endl;
+#endif
+        if (o.logconerror) {
+            syslog(LOG_ERR, "%s", "Exception fetching certificate from generator");
+            syslog(LOG_ERR, "%s", e.what());
+        }
+        return NULL;
+    }
+
+    const unsigned char *p = der;
+    return d2i_X509(NULL, &p, len);
+}
+
+X509 *CertificateAuthority::mintCertificate(const char *commonname, bool ec)
 {
+    X509 *cert = NULL;
+    struct ca_serial caser;
+    if (ec && _ecCertPrivKey == NULL)
+        return NULL;
+    if (!getServerCertificate(commonname, &cert, &caser, ec) && cert != NULL)
+        cacheCertificate(cacheKey(commonname, ec), cert);
+    free_ca_serial(&caser);
+    return cert;
+}
+
+EVP_PKEY *CertificateAuthority::getServerPkey(bool ec)
+{
+    EVP_PKEY *pkey = ec ? _ecCertPrivKey : _certPrivKey;
+    if (pkey == NULL)
+        return NULL;
     //openssl is missing a EVP_PKEY_dup function so just up the ref count
     //see http://www.mail-archive.com/openssl-users@openssl.org/msg17614.html
-    CRYPTO_add(&_certPrivKey->references, 1, CRYPTO_LOCK_EVP_PKEY);
-    return _certPrivKey;
+    EVP_PKEY_up_ref(pkey);
+    return pkey;
+}
+
+std::string CertificateAuthority::cacheKey(const char *commonname, bool ec)
+{
+    std::string key(commonname);
+    if (ec)
+        key += " ec";
+    return key;
+}
+
+// read an EC private key, or generate a P-256 one and save it if there is no file yet
+EVP_PKEY *CertificateAuthority::loadOrCreateEcKey(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (fp != NULL) {
+        EVP_PKEY *pkey = PEM_read_PrivateKey(fp, NULL, NULL, NULL);
+        fclose(fp);
+        if (pkey == NULL)
+            log_ssl_errors("Couldn't load ec certificate private key from %s", path);
+        return pkey;
+    }
+
+    ERR_clear_error();
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    // keys generated this way already carry the named curve
+    EVP_PKEY *pkey = EVP_EC_gen("P-256");
+    if (pkey == NULL) {
+        log_ssl_errors("Couldn't generate ec certificate private key for %s", path);
+        return NULL;
+    }
+#else
+    EC_KEY *eckey = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+    if (eckey == NULL || !EC_KEY_generate_key(eckey)) {
+        log_ssl_errors("Couldn't generate ec certificate private key for %s", path);
+        EC_KEY_free(eckey);
+        return NULL;
+    }
+    // certificates must carry the named curve, not explicit parameters
+    EC_KEY_set_asn1_flag(eckey, OPENSSL_EC_NAMED_CURVE);
+    EVP_PKEY *pkey = EVP_PKEY_new();
+    EVP_PKEY_assign_EC_KEY(pkey, eckey);
+#endif
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, S_IWUSR | S_IRUSR); //only e2g has access
+    fp = (fd < 0) ? NULL : fdopen(fd, "w");
+    if (fp == NULL || !PEM_write_PrivateKey(fp, pkey, NULL, NULL, 0, NULL, NULL)) {
+        syslog(LOG_ERR, "Couldn't save ec certificate private key to %s", path);
+        if (fp != NULL)
+            fclose(fp);
+        else if (fd >= 0)
+            close(fd);
+        EVP_PKEY_free(pkey);
+        return NULL;
+    }
+    fclose(fp);
+    syslog(LOG_INFO, "Created ec certificate private key %s", path);
+    return pkey;
+}
+
+bool CertificateAuthority::setEcCertKey(const char *path)
+{
+    if (_ecCertPrivKey != NULL)
+        EVP_PKEY_free(_ecCertPrivKey);
+    _ecCertPrivKey = loadOrCreateEcKey(path);
+    return _ecCertPrivKey != NULL;
+}
+
+bool CertificateAuthority::hasEcCertKey()
+{
+    return _ecCertPrivKey != NULL;
 }
 
 int CertificateAuthority::do_mkdir(const char *path, mode_t mode)
@@ -515,10 +822,98 @@ bool CertificateAuthority::free_ca_serial(struct ca_serial *cs)
     return true;
 }
 
+STACK_OF(X509) *CertificateAuthority::getCaChain()
+{
+    if (_caChain == NULL || sk_X509_num(_caChain) == 0)
+        return NULL;
+    return _caChain;
+}
+
+bool CertificateAuthority::makeOcspResponse(X509 *cert, std::string &der)
+{
+    bool ok = false;
+    OCSP_BASICRESP *basic = OCSP_BASICRESP_new();
+    OCSP_CERTID *id = OCSP_cert_to_id(EVP_sha1(), cert, _caCert);
+    ASN1_TIME *now = X509_gmtime_adj(NULL, 0);
+    ASN1_TIME *next = X509_gmtime_adj(NULL, 7 * 24 * 3600);
+    OCSP_RESPONSE *resp = NULL;
+
+    // the signer goes in the response unless it is already in the chain sent with the certificate
+    ERR_clear_error();
+    if (basic != NULL && id != NULL && now != NULL && next != NULL
+        && OCSP_basic_add1_status(basic, id, V_OCSP_CERTSTATUS_GOOD, 0, NULL, now, next) != NULL
+        && OCSP_basic_sign(basic, _caCert, _caPrivKey, EVP_sha256(), NULL, (getCaChain() != NULL) ? OCSP_NOCERTS : 0)
+        && (resp = OCSP_response_create(OCSP_RESPONSE_STATUS_SUCCESSFUL, basic)) != NULL) {
+        unsigned char *buf = NULL;
+        int len = i2d_OCSP_RESPONSE(resp, &buf);
+        if (len > 0) {
+            der.assign((char *)buf, len);
+            ok = true;
+        }
+        OPENSSL_free(buf);
+    }
+    if (!ok)
+        log_ssl_errors("Couldn't create OCSP response for %s", "forged certificate");
+
+    OCSP_RESPONSE_free(resp);
+    ASN1_TIME_free(next);
+    ASN1_TIME_free(now);
+    OCSP_CERTID_free(id);
+    OCSP_BASICRESP_free(basic);
+    return ok;
+}
+
+bool CertificateAuthority::getOcspResponse(X509 *cert, std::string &der)
+{
+    if (cert == NULL || X509_check_issued(_caCert, cert) != X509_V_OK)
+        return false;
+
+    BIGNUM *bn = ASN1_INTEGER_to_BN(X509_get_serialNumber(cert), NULL);
+    char *hex = (bn == NULL) ? NULL : BN_bn2hex(bn);
+    BN_free(bn);
+    if (hex == NULL)
+        return false;
+    std::string serial(hex);
+    OPENSSL_free(hex);
+
+    time_t now = time(NULL);
+    std::map<std::string, ocsp_lru::iterator>::iterator i = _ocspCacheIndex.find(serial);
+    if (i != _ocspCacheIndex.end()) {
+        if (i->second->second.renew > now) {
+            // move to the front
+            _ocspCache.splice(_ocspCache.begin(), _ocspCache, i->second);
+            der = i->second->second.der;
+            return true;
+        }
+        _ocspCache.erase(i->second);
+        _ocspCacheIndex.erase(i);
+    }
+
+    if (!makeOcspResponse(cert, der))
+        return false;
+    // dropping the least recently used
+    if (_ocspCache.size() >= (_certCacheSize > 0 ? _certCacheSize : 1)) {
+        _ocspCacheIndex.erase(_ocspCache.back().first);
+        _ocspCache.pop_back();
+    }
+    ocsp_entry entry;
+    entry.der = der;
+    entry.renew = now + (7 * 24 * 3600) / 2;
+    _ocspCache.push_front(std::make_pair(serial, entry));
+    _ocspCacheIndex[serial] = _ocspCache.begin();
+    return true;
+}
+
 CertificateAuthority::~CertificateAuthority()
 {
+    for (cert_lru::iterator i = _certCache.begin(); i != _certCache.end(); ++i)
+        X509_free(i->second);
+    if (_sharedCerts != NULL)
+        munmap(_sharedCerts, _sharedCertSlots * sizeof(ca_shared_slot));
     if (_caCert) X509_free(_caCert);
     if (_caPrivKey) EVP_PKEY_free(_caPrivKey);
     if (_certPrivKey) EVP_PKEY_free(_certPrivKey);
+    if (_ecCertPrivKey) EVP_PKEY_free(_ecCertPrivKey);
+    if (_caChain) sk_X509_pop_free(_caChain, X509_free);
 }
 #endif //__SSLMITM
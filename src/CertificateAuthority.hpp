@@ -2,6 +2,10 @@
 #define __HPP_CERTIFICATEAUTHORITY
 #ifdef __SSLMITM
 
+#include <list>
+#include <map>
+#include <string>
+
 struct ca_serial {
     ASN1_INTEGER *asn;
     char *charhex;
@@ -11,12 +15,15 @@ struct ca_serial {
 
 void log_ssl_errors( const char *mess, const char *site);
 
+struct ca_shared_slot;
+
 class CertificateAuthority
 {
 
     protected:
     EVP_PKEY *_caPrivKey;
     EVP_PKEY *_certPrivKey;
+    EVP_PKEY *_ecCertPrivKey; // optional ECDSA key for a second set of certificates
     X509 *_caCert;
     std::string _certPath;
     int _certPathLen;
@@ -26,21 +33,80 @@ class CertificateAuthority
     static int do_mkdir(const char *path, mode_t mode);
     int mkpath(const char *path, mode_t mode);
 
+    // parsed certificates used by this child, most recently used first
+    typedef std::list<std::pair<std::string, X509 *> > cert_lru;
+    cert_lru _certCache;
+    std::map<std::string, cert_lru::iterator> _certCacheIndex;
+    unsigned int _certCacheSize;
+
+    // DER encoded certificates in memory shared by all children
+    ca_shared_slot *_sharedCerts;
+    unsigned int _sharedCertSlots;
+
+    X509 *getCachedCertificate(const std::string &commonname);
+    void cacheCertificate(const std::string &commonname, X509 *cert);
+    X509 *getSharedCertificate(const std::string &commonname);
+    void shareCertificate(const std::string &commonname, X509 *cert);
+
+    // sent after each forged certificate - intermediates from the ca certificate file,
+    // plus the ca certificate itself if it isn't a root
+    STACK_OF(X509) *_caChain;
+
+    // stapled OCSP responses for forged certificates by serial number: DER & when to renew
+    struct ocsp_entry {
+        std::string der;
+        time_t renew;
+    };
+    // most recently used first, as with the certificates
+    typedef std::list<std::pair<std::string, ocsp_entry> > ocsp_lru;
+    ocsp_lru _ocspCache;
+    std::map<std::string, ocsp_lru::iterator> _ocspCacheIndex;
+    bool makeOcspResponse(X509 *cert, std::string &der);
+
+    // unix socket of the certificate generator process ("" = generate locally)
+    std::string _generatorIpc;
+    X509 *fetchCertificate(const char *commonname, bool ec);
+
+    // the ECDSA certificate for a site is cached & stored separately from the default one
+    static std::string cacheKey(const char *commonname, bool ec);
+    static EVP_PKEY *loadOrCreateEcKey(const char *path);
+
     public:
     CertificateAuthority(const char *caCert,
         const char *caPrivKey,
         const char *certPrivKey,
         const char *certPath,
         time_t caStart,
-        time_t caEnd);
+        time_t caEnd,
+        unsigned int cacheSize = 0,
+        unsigned int sharedCacheSize = 0);
 
     ~CertificateAuthority();
-    X509 *generateCertificate(const char *commonname, struct ca_serial *cser);
-    bool getSerial(const char *commonname, struct ca_serial *cser);
-    bool getServerCertificate(const char *commonname, X509 **cert, struct ca_serial *cser);
-    bool writeCertificate(const char *hostname, X509 *newCert, struct ca_serial *cser);
-    EVP_PKEY *getServerPkey();
+    // ec selects the certificate using the ECDSA key (see setEcCertKey)
+    X509 *generateCertificate(const char *commonname, struct ca_serial *cser, bool ec = false);
+    bool getSerial(const char *commonname, struct ca_serial *cser, bool ec = false);
+    bool getServerCertificate(const char *commonname, X509 **cert, struct ca_serial *cser, bool ec = false);
+    bool writeCertificate(const char *hostname, X509 *newCert, struct ca_serial *cser, bool ec = false);
+    EVP_PKEY *getServerPkey(bool ec = false);
     bool free_ca_serial(struct ca_serial *cs);
+
+    // also issue ECDSA P-256 certificates, using the key at path (created if missing)
+    // clients are then offered both and OpenSSL picks by their signature algorithms
+    bool setEcCertKey(const char *path);
+    bool hasEcCertKey();
+
+    // ask the certificate generator process at ipcpath for new certificates
+    // rather than signing them here ("" to stop)
+    void setCertGenerator(const std::string &ipcpath);
+    // used by the generator process - find or generate a certificate, keeping
+    // newly generated ones in memory so repeat requests don't sign again
+    X509 *mintCertificate(const char *commonname, bool ec = false);
+
+    // the chain to send with forged certificates (NULL if there is nothing to send)
+    STACK_OF(X509) *getCaChain();
+    // a "good" OCSP response for one of our certificates, signed by the ca and kept
+    // until it is halfway to expiry. false if cert wasn't issued by us
+    bool getOcspResponse(X509 *cert, std::string &der);
 };
 
 #endif //__SSLMITM
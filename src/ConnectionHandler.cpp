@@ -13,6 +13,7 @@
 #include "BackedStore.hpp"
 #include "ImageContainer.hpp"
 #include "FDFuncs.hpp"
+#include "ScanVerdictCache.hpp"
 #include <signal.h>
 
 #ifdef __SSLMITM
@@ -34,6 +35,9 @@
 #include <istream>
 #include <sstream>
 #include <memory>
+#include <map>
+#include <pthread.h>
+#include <csignal>
 
 #ifdef ENABLE_ORIG_IP
 #include <linux/types.h>
@@ -150,6 +154,158 @@ void addToClean(String &url, const int fg)
     ipcsock.close();
 }
 
+// where POST data spills to - named temp files stay in /tmp, where they
+// have always gone, the unnamed ones are made in filecachedir
+const char *postTempDir()
+{
+    return (o.temp_file_mode == DG_TEMPFILE_NAMED) ? "/tmp" : o.download_dir.c_str();
+}
+
+//
+// Scan result cache funcs
+//
+
+// name a content scanner for the scan result cache - its place in the plugin
+// list plus the version of its signatures, so that updates invalidate results.
+// empty for scanners which can't say what their version is, as there would be
+// no telling when their results had gone stale
+String scanResultKey(CSPlugin *cs)
+{
+    String version(cs->getScannerVersion());
+    if (version.length() == 0)
+        return version;
+    String key((int)(std::find(o.csplugins.begin(), o.csplugins.end(), cs) - o.csplugins.begin()));
+    key += " ";
+    key += version;
+    return key;
+}
+
+// repeat a remembered scan result
+void applyScanResult(const scan_verdict &verdict, NaughtyFilter *checkme)
+{
+    if (verdict.result == DGCS_CLEAN)
+        return;
+    checkme->message_no = verdict.message_no;
+    checkme->whatIsNaughty = verdict.whatIsNaughty;
+    checkme->whatIsNaughtyLog = verdict.whatIsNaughtyLog;
+    checkme->whatIsNaughtyCategories = verdict.whatIsNaughtyCategories;
+    checkme->isItNaughty = true;
+    checkme->isException = false;
+}
+
+// remember a clean or infected result - anything else is worth trying again
+void storeScanResult(const unsigned char *md, CSPlugin *cs, int csrc, NaughtyFilter *checkme)
+{
+    if (csrc != DGCS_CLEAN && csrc != DGCS_INFECTED)
+        return;
+    String key(scanResultKey(cs));
+    if (key.length() == 0)
+        return;
+    scan_verdict verdict;
+    memset(&verdict, 0, sizeof(verdict));
+    verdict.result = csrc;
+    if (csrc == DGCS_INFECTED) {
+        verdict.message_no = checkme->message_no;
+        strncpy(verdict.whatIsNaughty, checkme->whatIsNaughty.c_str(), SCAN_VERDICT_TEXT_SIZE - 1);
+        strncpy(verdict.whatIsNaughtyLog, checkme->whatIsNaughtyLog.c_str(), SCAN_VERDICT_TEXT_SIZE - 1);
+        strncpy(verdict.whatIsNaughtyCategories, checkme->whatIsNaughtyCategories.c_str(), SCAN_VERDICT_TEXT_SIZE - 1);
+    }
+    storeScanVerdict(md, key.toCharArray(), verdict);
+}
+
+//
+// Parallel content scanning funcs
+//
+
+// one content scanner's part in a parallel scan
+struct parallel_scan {
+    CSPlugin *cs;
+    HTTPHeader *header;
+    HTTPHeader *docheader;
+    const char *user;
+    int filtergroup;
+    const char *ip;
+    // the temp file if there is one, else the memory buffer
+    const char *filename;
+    const char *data;
+    off_t size;
+    bool interactive;
+    // every scanner in the scan, so that the first to find something can cancel the rest
+    std::deque<parallel_scan *> *all;
+    volatile int *found;
+    // results - each scanner gets its own NaughtyFilter to block with
+    NaughtyFilter checkme;
+    int result;
+    long msecs;
+    pthread_t thread;
+};
+
+long msecsSince(struct timeval &start)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start.tv_sec) * 1000 + (now.tv_usec - start.tv_usec) / 1000;
+}
+
+void *parallelScan(void *arg)
+{
+    parallel_scan *ps = (parallel_scan *)arg;
+    struct timeval start;
+    gettimeofday(&start, NULL);
+    // nothing may escape a scan thread - an uncaught exception there ends the process
+    try {
+        ps->result = ps->cs->scheduledScan(ps->header, ps->docheader, ps->user, ps->filtergroup, ps->ip,
+            ps->filename, ps->data, ps->size, ps->interactive, &ps->checkme);
+    } catch (std::exception &e) {
+        syslog(LOG_ERR, "Content scanner %s failed: %s", ps->cs->getPluginName().toCharArray(), e.what());
+        ps->result = DGCS_SCANERROR;
+    } catch (...) {
+        ps->result = DGCS_SCANERROR;
+    }
+    ps->msecs = msecsSince(start);
+    // first infection found - nothing the others say can change the outcome
+    if ((ps->result == DGCS_INFECTED || ps->result == DGCS_BLOCKED) && __sync_bool_compare_and_swap(ps->found, 0, 1)) {
+        for (std::deque<parallel_scan *>::iterator i = ps->all->begin(); i != ps->all->end(); i++) {
+            if (*i != ps)
+                (*i)->cs->cancelScan();
+        }
+    }
+    return NULL;
+}
+
+// run the scans all at once - one in this thread, the rest in threads of their own
+void runParallelScans(std::deque<parallel_scan *> &scans)
+{
+    // signals are for the main thread only
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    std::deque<bool> started;
+    for (std::deque<parallel_scan *>::iterator i = scans.begin(); i != scans.end(); i++) {
+        (*i)->cs->resetCancel();
+        started.push_back(i != scans.begin() && pthread_create(&(*i)->thread, NULL, parallelScan, *i) == 0);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    // anything that couldn't get a thread runs here, in turn
+    for (unsigned int i = 0; i < scans.size(); i++) {
+        if (!started[i] && !*scans[i]->found)
+            parallelScan(scans[i]);
+    }
+    for (unsigned int i = 0; i < scans.size(); i++) {
+        if (started[i])
+            pthread_join(scans[i]->thread, NULL);
+    }
+    // a cancellation mustn't outlive the scan it was for
+    for (std::deque<parallel_scan *>::iterator i = scans.begin(); i != scans.end(); i++)
+        (*i)->cs->resetCancel();
+}
+
+void logScanTime(CSPlugin *cs, long msecs, int csrc, String &url)
+{
+    syslog(LOG_INFO, "Content scanner %s returned %d after %ldms: %s", cs->getPluginName().toCharArray(), csrc, msecs, url.toCharArray());
+}
+
 //
 // ConnectionHandler class
 //
@@ -285,39 +441,17 @@ off_t ConnectionHandler::sendFile(Socket *peerconn, String &filename, String &fi
     }
 
     // perform the actual sending
-    off_t sent = 0;
-    int rc;
-    char *buffer = new char[250000];
-    while (sent < filesize) {
-        rc = readEINTR(fd, buffer, 250000);
-#ifdef DGDEBUG
-        std::cout << dbgPeerPort << " -reading send file rc:" << rc << std::endl;
-#endif
-        if (rc < 0) {
-#ifdef DGDEBUG
-            std::cout << dbgPeerPort << " -error reading send file so throwing exception" << std::endl;
-#endif
-            delete[] buffer;
-            throw std::exception();
-        }
-        if (rc == 0) {
+    off_t sent = peerconn->writeFromFile(fd, 0, filesize, 100);
+    close(fd);
+    if (sent < 0) {
 #ifdef DGDEBUG
-            std::cout << dbgPeerPort << " -got zero bytes reading send file" << std::endl;
+        std::cout << dbgPeerPort << " -error sending file so throwing exception" << std::endl;
 #endif
-            break; // should never happen
-        }
-        // as it's cached to disk the buffer must be reasonably big
-        if (!peerconn->writeToSocket(buffer, rc, 0, 100)) {
-            delete[] buffer;
-            throw std::exception();
-        }
-        sent += rc;
+        throw std::exception();
+    }
 #ifdef DGDEBUG
-        std::cout << dbgPeerPort << " -total sent from temp:" << sent << std::endl;
+    std::cout << dbgPeerPort << " -total sent from temp:" << sent << std::endl;
 #endif
-    }
-    delete[] buffer;
-    close(fd);
     return sent;
 }
 
@@ -333,7 +467,15 @@ int ConnectionHandler::handlePeer(Socket &peerconn, String &ip)
 #endif
     Socket proxysock;
 
-    return handleConnection(peerconn, ip, false, proxysock);
+    proxy_reusable = false;
+    proxy_authed = false;
+    int rc = handleConnection(peerconn, ip, false, proxysock);
+
+    // client has gone, but the proxy connection may serve the next one
+    if (proxy_reusable)
+        proxypool.put(proxysock);
+
+    return rc;
 
     //return;
 }
@@ -553,9 +695,22 @@ int ConnectionHandler::handleConnection(Socket &peerconn, String &ip, bool ismit
             urldomain = url.getHostname();
             is_ssl = header.requestType().startsWith("CONNECT");
 
+            proxy_reusable = false;
+            if (!persistProxy)
+                proxy_authed = false;
+            if (header.getAuthType().length() > 0)
+                proxy_authed = true;
+
             //If proxy connction is not persistent...
+            if (!persistProxy && !ismitm && proxypool.get(proxysock)) {
+                // ...reuse an idle one left by a previous client
+                persistProxy = true;
+            }
             if (!persistProxy) {
                 try {
+                    // previous proxy connection may have been closed
+                    if (proxysock.getFD() < 0)
+                        proxysock.reset();
                     // ...connect to proxy
                     for (int i = 0; i < o.proxy_timeout; i++) {
                         rc = proxysock.connect(o.proxy_ip, o.proxy_port);
@@ -650,6 +805,7 @@ int ConnectionHandler::handleConnection(Socket &peerconn, String &ip, bool ismit
                 std::cout << dbgPeerPort << " -Not got persistent credentials for this connection - querying auth plugins" << std::endl;
 #endif
                 bool dobreak = false;
+                overide_persist = false;
                 if (o.authplugins.size() != 0) {
                     // We have some auth plugins load
                     int authloop = 0;
@@ -1561,9 +1717,14 @@ int ConnectionHandler::handleConnection(Socket &peerconn, String &ip, bool ismit
                 //  instead off on every request
 
                 X509 *cert = NULL;
-                struct ca_serial caser;
+                struct ca_serial caser = { NULL, NULL, NULL, NULL };
                 EVP_PKEY *pkey = NULL;
                 bool certfromcache = false;
+                // the optional ECDSA certificate, offered alongside the RSA one
+                X509 *eccert = NULL;
+                struct ca_serial eccaser = { NULL, NULL, NULL, NULL };
+                EVP_PKEY *eckey = NULL;
+                bool eccertfromcache = false;
                 //generate the cert
                 if (!checkme.isItNaughty) {
 #ifdef DGDEBUG
@@ -1612,7 +1773,20 @@ int ConnectionHandler::handleConnection(Socket &peerconn, String &ip, bool ismit
                     std::string msg = "HTTP/1.0 200 Connection established\r\n\r\n";
                     peerconn.writeString(msg.c_str());
 
-                    if (peerconn.startSslServer(cert, pkey, o.set_cipher_list) < 0) {
+                    // the ECDSA certificate costs a second signature to forge, so only make
+                    // one if the ClientHello says the client can use it
+                    if (o.ca->hasEcCertKey()) {
+                        std::string sni, alpn;
+                        bool ecdsa = true; // if in doubt, offer both
+                        peerconn.peekSslClientHello(sni, alpn, o.exchange_timeout, &ecdsa);
+                        if (ecdsa) {
+                            eckey = o.ca->getServerPkey(true);
+                            eccertfromcache = o.ca->getServerCertificate(urldomain.CN().c_str(), &eccert,
+                                &eccaser, true);
+                        }
+                    }
+
+                    if (peerconn.startSslServer(cert, pkey, o.set_cipher_list, eccert, eckey, o.ca, o.ssl_ocsp_staple) < 0) {
                         //make sure the ssl stuff is shutdown properly so we display the old ssl blockpage
                         //peerconn.stopSsl();
 
@@ -1664,6 +1838,10 @@ int ConnectionHandler::handleConnection(Socket &peerconn, String &ip, bool ismit
                         writecert = o.ca->writeCertificate(urldomain.CN().c_str(), cert,
                             &caser);
                     }
+                    if (eccert != NULL && !eccertfromcache) {
+                        writecert = o.ca->writeCertificate(urldomain.CN().c_str(), eccert,
+                                        &eccaser, true) && writecert;
+                    }
 
                     //if we cant write the certificate its not the end of the world but it is slow
                     if (!writecert) {
@@ -1686,6 +1864,7 @@ int ConnectionHandler::handleConnection(Socket &peerconn, String &ip, bool ismit
 #endif
                 }
                 o.ca->free_ca_serial(&caser);
+                o.ca->free_ca_serial(&eccaser);
 
                 //stopssl on the proxy connection
                 //if it was marked as naughty then show a deny page and close the connection
@@ -1717,6 +1896,10 @@ int ConnectionHandler::handleConnection(Socket &peerconn, String &ip, bool ismit
                 //tidy up key and cert
                 X509_free(cert);
                 EVP_PKEY_free(pkey);
+                if (eccert != NULL)
+                    X509_free(eccert);
+                if (eckey != NULL)
+                    EVP_PKEY_free(eckey);
 
                 persistProxy = false;
                 proxysock.close();
@@ -1741,6 +1924,37 @@ int ConnectionHandler::handleConnection(Socket &peerconn, String &ip, bool ismit
                     if (isconnect)
                         header.sslsiteRegExp(filtergroup);
                     header.out(NULL, &proxysock, __DGHEADER_SENDALL, true); // send proxy the request
+                    // but with sslsnipeek the site named in the ClientHello can be checked too -
+                    // the client only sends that once it has had the proxy's answer to the CONNECT,
+                    // and tunnels which aren't TLS are passed through unchecked
+                    if (!isexception && o.fg[filtergroup]->ssl_sni_peek) {
+                        try {
+                            proxysock.checkForInput(o.exchange_timeout);
+                            docheader.in(&proxysock, false);
+                        } catch (std::exception &e) {
+#ifdef DGDEBUG
+                            std::cout << dbgPeerPort << " -No reply from proxy to CONNECT: " << e.what() << std::endl;
+#endif
+                            proxysock.close();
+                            break;
+                        }
+                        wasrequested = true;
+                        docheader.out(NULL, &peerconn, __DGHEADER_SENDALL); // refusals go back as they are
+                        if (docheader.returnCode() == 200) {
+                            sniChecks(&peerconn, urldomain, &checkme);
+                            message_no = checkme.message_no;
+                            if (checkme.isItNaughty) {
+                                // the client is talking TLS now, so there is no way of showing a block page
+                                String rtype(header.requestType());
+                                doLog(clientuser, clientip, logurl, header.port, checkme.whatIsNaughtyLog, rtype, docsize, &checkme.whatIsNaughtyCategories, true, checkme.blocktype,
+                                    isexception, false, &thestart,
+                                    cachehit, 200, mimetype, wasinfected,
+                                    wasscanned, checkme.naughtiness, filtergroup, &header, message_no, false, urlmodified, headermodified, headeradded);
+                                proxysock.close();
+                                break;
+                            }
+                        }
+                    }
                 } else {
                     docheader.out(NULL, &peerconn, __DGHEADER_SENDALL);
                 }
@@ -1985,8 +2199,9 @@ int ConnectionHandler::handleConnection(Socket &peerconn, String &ip, bool ismit
                                                     std::cerr << dbgPeerPort << " -willScanData returned: " << csrc << std::endl;
 #endif
                                                     if (csrc > 0) {
-                                                        csrc = (*i)->scanMemory(&header, NULL, clientuser.c_str(), filtergroup, clientip.c_str(),
-                                                            data + offset, part->getLength() - offset, &checkme,
+                                                        off_t partsize = part->getLength() - offset;
+                                                        csrc = (*i)->scheduledScan(&header, NULL, clientuser.c_str(), filtergroup, clientip.c_str(),
+                                                            NULL, data + offset, partsize, partsize <= o.interactive_scan_size, &checkme,
                                                             &disposition, &mimetype);
                                                         if (csrc != DGCS_CLEAN && csrc != DGCS_WARNING) {
                                                             checkme.blocktype = 1;
@@ -2060,7 +2275,7 @@ int ConnectionHandler::handleConnection(Socket &peerconn, String &ip, bool ismit
                                             if (last)
                                                 proxysock.writeToSockete("\r\n", 2, 0, 10);
                                         }
-                                        part.reset(new BackedStore(o.max_content_ramcache_scan_size, o.max_content_filecache_scan_size));
+                                        part.reset(new BackedStore(o.max_content_ramcache_scan_size, o.max_content_filecache_scan_size, postTempDir(), o.temp_file_mode));
                                     }
                                 }
 
@@ -2091,7 +2306,7 @@ int ConnectionHandler::handleConnection(Socket &peerconn, String &ip, bool ismit
                                         // For all boundaries after the first, include the leading CRLF
                                         boundary.insert(0, "\r\n");
                                         // Create BackedStore for first data part
-                                        part.reset(new BackedStore(o.max_content_ramcache_scan_size, o.max_content_filecache_scan_size));
+                                        part.reset(new BackedStore(o.max_content_ramcache_scan_size, o.max_content_filecache_scan_size, postTempDir(), o.temp_file_mode));
                                     }
                                 }
                                 rolling_buffer.erase(0, loc);
@@ -2231,8 +2446,9 @@ int ConnectionHandler::handleConnection(Socket &peerconn, String &ip, bool ismit
 #endif
                             if (csrc > 0) {
                                 String mimetype("text/plain");
-                                csrc = (*i)->scanMemory(&header, NULL, clientuser.c_str(), filtergroup, clientip.c_str(),
-                                    result.c_str(), result.length(), &checkme, NULL, &mimetype);
+                                // form submissions are always interactive
+                                csrc = (*i)->scheduledScan(&header, NULL, clientuser.c_str(), filtergroup, clientip.c_str(),
+                                    NULL, result.c_str(), result.length(), true, &checkme, NULL, &mimetype);
                                 if (csrc != DGCS_CLEAN && csrc != DGCS_WARNING) {
                                     checkme.blocktype = 1;
                                     postparts.back().blocked = true;
@@ -2741,7 +2957,7 @@ int ConnectionHandler::handleConnection(Socket &peerconn, String &ip, bool ismit
                     // &N=tempfilename&M=mimetype&D=dispos
 
                     String ip(clientip);
-                    String tempfilename(docbody.tempfilepath.after("/tf"));
+                    String tempfilename(docbody.getTempFilePath().after("/tf"));
                     String tempfilemime(docheader.getContentType());
                     String tempfiledis(miniURLEncode(docheader.disposition().toCharArray()).c_str());
                     String secret(o.fg[filtergroup]->magic.c_str());
@@ -2817,6 +3033,9 @@ int ConnectionHandler::handleConnection(Socket &peerconn, String &ip, bool ismit
 
             if (!persistProxy)
                 proxysock.close();
+            else if (!is_ssl && !ismitm && !proxy_authed
+                && !(docheader.header.size() > 0 && docheader.authRequired()))
+                proxy_reusable = true;
 
         } // while persistOutgoing
     } catch (postfilter_exception &e) {
@@ -3312,6 +3531,19 @@ void ConnectionHandler::requestChecks(HTTPHeader *header, NaughtyFilter *checkme
         std::cout << dbgPeerPort << " -checking SSL certificate" << std::endl;
 #endif
 
+        String hostname(temp);
+        hostname.removePTP();
+
+        //a recent check by any child saves connecting to the site
+        cert_verdict verdict;
+        if (lookupCertVerdict(hostname.c_str(), NULL, &verdict)) {
+#ifdef DGDEBUG
+            std::cout << dbgPeerPort << " -using cached SSL certificate check result" << std::endl;
+#endif
+            applyCertVerdict(verdict, checkme);
+            return;
+        }
+
         Socket ssl_sock;
         //connect to the local proxy then do a connect
         //to make sure we go through any upstream proxys
@@ -3334,8 +3566,6 @@ void ConnectionHandler::requestChecks(HTTPHeader *header, NaughtyFilter *checkme
 #endif
 
         //create tunnel to destination
-        String hostname(temp);
-        hostname.removePTP();
         int rc = sendProxyConnect(hostname, &ssl_sock, checkme);
         if (rc < 0) {
             return;
@@ -3365,6 +3595,38 @@ void ConnectionHandler::requestChecks(HTTPHeader *header, NaughtyFilter *checkme
 #endif //__SSLMITM
 }
 
+// check the server name in a tunnelled connection's ClientHello against the SSL site lists
+// - as with the CONNECT hostname, grey sites are not banned
+void ConnectionHandler::sniChecks(Socket *peerconn, String &connecthost, NaughtyFilter *checkme)
+{
+    std::string sni, alpn;
+    if (!peerconn->peekSslClientHello(sni, alpn, o.exchange_timeout)) {
+#ifdef DGDEBUG
+        std::cout << dbgPeerPort << " -no TLS ClientHello to check" << std::endl;
+#endif
+        return;
+    }
+#ifdef DGDEBUG
+    std::cout << dbgPeerPort << " -ClientHello server name: " << sni << " alpn: " << alpn << std::endl;
+#endif
+    String hostname(sni);
+    hostname.toLower();
+    if (hostname.length() == 0 || hostname == connecthost)
+        return; // already checked as the CONNECT hostname
+
+    char *retchar;
+    if (o.fg[filtergroup]->inGreySSLSiteList(hostname, false, false, true))
+        return;
+    if ((retchar = o.fg[filtergroup]->inBannedSSLSiteList(hostname, false, false, true)) != NULL) {
+        checkme->whatIsNaughty = o.language_list.getTranslation(520); // banned site
+        checkme->message_no = 520;
+        checkme->whatIsNaughty += retchar;
+        checkme->whatIsNaughtyLog = checkme->whatIsNaughty + " (" + hostname + ")";
+        checkme->isItNaughty = true;
+        checkme->whatIsNaughtyCategories = o.lm.l[o.fg[filtergroup]->banned_ssl_site_list]->lastcategory.toCharArray();
+    }
+}
+
 // check the request header is OK (client host/user/IP allowed to browse, site not banned, upload not too big)
 void ConnectionHandler::requestLocalChecks(HTTPHeader *header, NaughtyFilter *checkme, String *urld, String *url,
     std::string *clientip, std::string *clientuser, int filtergroup,
@@ -3955,7 +4217,22 @@ void ConnectionHandler::contentFilter(HTTPHeader *docheader, HTTPHeader *header,
     std::cout << dbgPeerPort << docheader->contentEncoding() << std::endl;
     std::cout << dbgPeerPort << " -about to get body from proxy" << std::endl;
 #endif
+    // scanners that can take the body as it downloads get it block by block,
+    // so their scans overlap the download instead of following it
+    std::deque<CSPlugin *> streamscanners;
+    if (!wasclean && (docheader->contentLength() <= o.max_content_filecache_scan_size)) {
+        for (std::deque<CSPlugin *>::iterator i = responsescanners.begin(); i != responsescanners.end(); i++) {
+            if ((*i)->startStream(header, docheader, checkme)) {
+#ifdef DGDEBUG
+                std::cout << dbgPeerPort << " -Streaming body to content scanner" << std::endl;
+#endif
+                streamscanners.push_back(*i);
+                docbody->addStreamScanner(*i);
+            }
+        }
+    }
     (*pausedtoobig) = docbody->in(proxysock, peerconn, header, docheader, !responsescanners.empty(), headersent); // get body from proxy
+    docbody->clearStreamScanners();
 // checkme: surely if pausedtoobig is true, we just want to break here?
 // the content is larger than max_content_filecache_scan_size if it was downloaded for scanning,
 // and larger than max_content_filter_size if not.
@@ -3975,6 +4252,17 @@ void ConnectionHandler::contentFilter(HTTPHeader *docheader, HTTPHeader *header,
     } else {
         dblen = docbody->buffer_length;
     }
+    bool scansize = isfile ? dblen <= o.max_content_filecache_scan_size : dblen <= o.max_content_ramcache_scan_size;
+
+    // collect the verdicts of streamed scans, or drop them if there's nothing to scan
+    std::map<CSPlugin *, int> streamverdicts;
+    for (std::deque<CSPlugin *>::iterator i = streamscanners.begin(); i != streamscanners.end(); i++) {
+        if (dblen > 0 && scansize && !(*pausedtoobig))
+            streamverdicts[*i] = (*i)->endStream();
+        else
+            (*i)->abortStream();
+    }
+
     // don't scan zero-length buffers (waste of AV resources, especially with external scanners (ICAP)).
     // these were encountered browsing opengroup.org, caused by a stats script. (PRA 21/09/2005)
     // if we wanted to honour a hypothetical min_content_scan_size, we'd do it here.
@@ -3992,27 +4280,152 @@ void ConnectionHandler::contentFilter(HTTPHeader *docheader, HTTPHeader *header,
     if (!wasclean) { // was not clean or no urlcache
 
         // fixed to obey maxcontentramcachescansize
-        if (!responsescanners.empty() && (isfile ? dblen <= o.max_content_filecache_scan_size : dblen <= o.max_content_ramcache_scan_size)) {
+        if (!responsescanners.empty() && scansize) {
             int csrc = 0;
 #ifdef DGDEBUG
             int k = 0;
 #endif
+            // content already scanned, by any child, needn't be scanned again
+            unsigned char contenthash[SCAN_VERDICT_HASH_SIZE];
+            bool hashed = false;
+            if (scanVerdictCacheEnabled()) {
+                // not worth hashing unless one of the scanners can have its results kept
+                for (std::deque<CSPlugin *>::iterator i = responsescanners.begin(); i != responsescanners.end(); i++) {
+                    if (scanResultKey(*i).length() > 0) {
+                        hashed = hashScanContent(docbody->data, docbody->buffer_length, isfile ? docbody->getTempFilePath().toCharArray() : NULL, contenthash);
+                        break;
+                    }
+                }
+            }
+            // small objects & page content are for someone waiting on them, so get
+            // the interactive scan slots - see CSPlugin::scheduledScan
+            bool interactive = (dblen <= o.interactive_scan_size)
+                || (dblen <= o.max_content_filter_size && docheader->isContentType("text", filtergroup));
+            std::map<CSPlugin *, scan_verdict> remembered;
+            std::deque<CSPlugin *> toscan;
+            bool decided = false;
             for (std::deque<CSPlugin *>::iterator i = responsescanners.begin(); i != responsescanners.end(); i++) {
+                scan_verdict verdict;
+                String key;
+                if (streamverdicts.count(*i)) {
+                    csrc = streamverdicts[*i];
+                } else if (hashed && (key = scanResultKey(*i)).length() > 0 && lookupScanVerdict(contenthash, key.toCharArray(), &verdict)) {
+                    remembered[*i] = verdict;
+                    csrc = verdict.result;
+                } else {
+                    toscan.push_back(*i);
+                    continue;
+                }
+                if (csrc == DGCS_INFECTED || csrc == DGCS_BLOCKED)
+                    decided = true;
+            }
+
+            // with parallelscan the rest are all scanned at once, so that the
+            // scan takes as long as the slowest scanner rather than all of them.
+            // once one finds an infection that's the verdict - the rest are cancelled
+            std::deque<CSPlugin *> scanorder(responsescanners);
+            std::map<CSPlugin *, parallel_scan *> parallel;
+            std::deque<parallel_scan *> scans;
+            volatile int found = 0;
+            if (o.parallel_scan && toscan.size() > 1 && !decided) {
+#ifdef DGDEBUG
+                std::cout << dbgPeerPort << " -Running " << toscan.size() << " scans in parallel" << std::endl;
+#endif
+                for (std::deque<CSPlugin *>::iterator i = toscan.begin(); i != toscan.end(); i++) {
+                    parallel_scan *ps = new parallel_scan;
+                    ps->cs = *i;
+                    ps->header = header;
+                    ps->docheader = docheader;
+                    ps->user = clientuser->c_str();
+                    ps->filtergroup = filtergroup;
+                    ps->ip = clientip->c_str();
+                    ps->filename = isfile ? docbody->getTempFilePath().toCharArray() : NULL;
+                    ps->data = docbody->data;
+                    ps->size = dblen;
+                    ps->interactive = interactive;
+                    ps->all = &scans;
+                    ps->found = &found;
+                    ps->result = DGCS_SCANERROR;
+                    ps->msecs = 0;
+                    scans.push_back(ps);
+                    parallel[*i] = ps;
+                }
+                // the scanners cache parsed header values as they're asked for them -
+                // fill the caches now, so that the threads only ever read them
+                header->getUrl();
+                header->contentLength();
+                docheader->getUrl();
+                docheader->contentLength();
+                runParallelScans(scans);
+                for (std::deque<parallel_scan *>::iterator j = scans.begin(); j != scans.end(); j++) {
+                    if (found && ((*j)->result == DGCS_INFECTED || (*j)->result == DGCS_BLOCKED)) {
+                        scanorder.clear();
+                        scanorder.push_back((*j)->cs);
+                        break;
+                    }
+                }
+            }
+
+            for (std::deque<CSPlugin *>::iterator i = scanorder.begin(); i != scanorder.end(); i++) {
                 (*wasscanned) = true;
-                if (isfile) {
+                if (streamverdicts.count(*i)) {
+                    csrc = streamverdicts[*i];
+                    if (hashed)
+                        storeScanResult(contenthash, *i, csrc, checkme);
+                    if (isfile && (csrc != DGCS_CLEAN) && (csrc != DGCS_WARNING)) {
+                        unlink(docbody->getTempFilePath().toCharArray());
+                    }
+                } else if (remembered.count(*i)) {
 #ifdef DGDEBUG
-                    std::cout << dbgPeerPort << " -Running scanFile" << std::endl;
+                    std::cout << dbgPeerPort << " -Using remembered scan result" << std::endl;
 #endif
-                    csrc = (*i)->scanFile(header, docheader, clientuser->c_str(), filtergroup, clientip->c_str(), docbody->tempfilepath.toCharArray(), checkme);
-                    if ((csrc != DGCS_CLEAN) && (csrc != DGCS_WARNING)) {
-                        unlink(docbody->tempfilepath.toCharArray());
-                        // delete infected (or unscanned due to error) file straight away
+                    csrc = remembered[*i].result;
+                    applyScanResult(remembered[*i], checkme);
+                    if (isfile && (csrc != DGCS_CLEAN)) {
+                        unlink(docbody->getTempFilePath().toCharArray());
+                    }
+                } else if (parallel.count(*i)) {
+                    parallel_scan *ps = parallel[*i];
+                    csrc = ps->result;
+                    if (ps->checkme.isItNaughty) {
+                        checkme->message_no = ps->checkme.message_no;
+                        checkme->whatIsNaughty = ps->checkme.whatIsNaughty;
+                        checkme->whatIsNaughtyLog = ps->checkme.whatIsNaughtyLog;
+                        checkme->whatIsNaughtyCategories = ps->checkme.whatIsNaughtyCategories;
+                        checkme->isItNaughty = true;
+                        checkme->isException = false;
+                    }
+                    if (o.log_scan_times)
+                        logScanTime(*i, ps->msecs, csrc, url);
+                    if (hashed)
+                        storeScanResult(contenthash, *i, csrc, checkme);
+                    if (isfile && (csrc != DGCS_CLEAN) && (csrc != DGCS_WARNING)) {
+                        unlink(docbody->getTempFilePath().toCharArray());
                     }
                 } else {
+                    struct timeval start;
+                    gettimeofday(&start, NULL);
+                    if (isfile) {
+#ifdef DGDEBUG
+                        std::cout << dbgPeerPort << " -Running scanFile" << std::endl;
+#endif
+                        csrc = (*i)->scheduledScan(header, docheader, clientuser->c_str(), filtergroup, clientip->c_str(),
+                            docbody->getTempFilePath().toCharArray(), NULL, dblen, interactive, checkme);
+                        if ((csrc != DGCS_CLEAN) && (csrc != DGCS_WARNING)) {
+                            unlink(docbody->getTempFilePath().toCharArray());
+                            // delete infected (or unscanned due to error) file straight away
+                        }
+                    } else {
 #ifdef DGDEBUG
-                    std::cout << dbgPeerPort << " -Running scanMemory" << std::endl;
+                        std::cout << dbgPeerPort << " -Running scanMemory" << std::endl;
 #endif
-                    csrc = (*i)->scanMemory(header, docheader, clientuser->c_str(), filtergroup, clientip->c_str(), docbody->data, docbody->buffer_length, checkme);
+                        csrc = (*i)->scheduledScan(header, docheader, clientuser->c_str(), filtergroup, clientip->c_str(),
+                            NULL, docbody->data, docbody->buffer_length, interactive, checkme);
+                    }
+                    if (o.log_scan_times)
+                        logScanTime(*i, msecsSince(start), csrc, url);
+                    if (hashed)
+                        storeScanResult(contenthash, *i, csrc, checkme);
                 }
 #ifdef DGDEBUG
                 std::cerr << dbgPeerPort << " -AV scan " << k << " returned: " << csrc << std::endl;
@@ -4058,6 +4471,8 @@ void ConnectionHandler::contentFilter(HTTPHeader *docheader, HTTPHeader *header,
                 k++;
 #endif
             }
+            for (std::deque<parallel_scan *>::iterator j = scans.begin(); j != scans.end(); j++)
+                delete *j;
 
 #ifdef DGDEBUG
             std::cout << dbgPeerPort << " -finished running AV" << std::endl;
@@ -4202,12 +4617,33 @@ void ConnectionHandler::checkCertificate(String &hostname, Socket *sslsock, Naug
 //#endif
 //	return;
 
+    cert_verdict verdict;
+    X509 *peercert = sslsock->getPeerCertificate();
+    if (peercert == NULL || !lookupCertVerdict(hostname.c_str(), peercert, &verdict)) {
+#ifdef DGDEBUG
+        std::cout << dbgPeerPort << " -checking SSL certificate is valid" << std::endl;
+#endif
+        //check that everything in this certificate is correct appart from the hostname
+        verdict.valid = sslsock->checkCertValid();
+
 #ifdef DGDEBUG
-    std::cout << dbgPeerPort << " -checking SSL certificate is valid" << std::endl;
+        std::cout << dbgPeerPort << " -checking SSL certificate hostname" << std::endl;
 #endif
+        //check the common name and altnames of a certificate against hostname
+        verdict.hostname_ok = (verdict.valid == X509_V_OK) && (sslsock->checkCertHostname(hostname) >= 0);
 
-    long rc = sslsock->checkCertValid();
-    //check that everything in this certificate is correct appart from the hostname
+        storeCertVerdict(hostname.c_str(), peercert, verdict);
+    }
+    if (peercert != NULL)
+        X509_free(peercert);
+
+    applyCertVerdict(verdict, checkme);
+}
+
+// fill in checkme from the result of a certificate check
+void ConnectionHandler::applyCertVerdict(const cert_verdict &verdict, NaughtyFilter *checkme)
+{
+    long rc = verdict.valid;
     if (rc < 0) {
         //no certificate
         if ( o.fg[filtergroup]->allow_empty_host_certs)
@@ -4230,12 +4666,7 @@ void ConnectionHandler::checkCertificate(String &hostname, Socket *sslsock, Naug
         return;
     }
 
-#ifdef DGDEBUG
-    std::cout << dbgPeerPort << " -checking SSL certificate hostname" << std::endl;
-#endif
-
-    //check the common name and altnames of a certificate against hostname
-    if (sslsock->checkCertHostname(hostname) < 0) {
+    if (!verdict.hostname_ok) {
         //hostname was not matched by the certificate
         checkme->isItNaughty = true;
         //(*checkme).whatIsNaughty = "Server's SSL certificate does not match domain name";
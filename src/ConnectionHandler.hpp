@@ -8,8 +8,11 @@
 // INCLUDES
 #include <iostream>
 #include <string>
+#include <list>
 #include "OptionContainer.hpp"
 #include "Socket.hpp"
+#include "ProxyPool.hpp"
+#include "CertVerdictCache.hpp"
 #include "HTTPHeader.hpp"
 #include "NaughtyFilter.hpp"
 
@@ -54,12 +57,26 @@ class ConnectionHandler
     // pass data between proxy and client, filtering as we go.
     int handlePeer(Socket &peerconn, String &ip);
 
+    // log proxy connection pool statistics (called when the child exits)
+    void logProxyPoolStats()
+    {
+        proxypool.logStats();
+    };
+
     private:
     int filtergroup;
     bool matchedip;
     bool persistent_authed;
     bool overide_persist;
 
+    // idle connections to the proxy, kept across client connections
+    ProxyPool proxypool;
+    // proxy connection was left between requests when the client went away
+    bool proxy_reusable;
+    // the proxy connection has carried proxy authentication - NTLM & co. are
+    // bound to the connection, so it mustn't be handed to another client
+    bool proxy_authed;
+
     std::string clientuser;
     std::string *clienthost;
     std::string urlparams;
@@ -114,9 +131,13 @@ class ConnectionHandler
     // send a file to the client - used during bypass of blocked downloads
     off_t sendFile(Socket *peerconn, String &filename, String &filemime, String &filedis, String &url);
 
+    // check the site named in a tunnelled connection's TLS ClientHello
+    void sniChecks(Socket *peerconn, String &connecthost, NaughtyFilter *checkme);
+
 #ifdef __SSLMITM
     //ssl certificat checking
     void checkCertificate(String &hostname, Socket *sslSock, NaughtyFilter *checkme);
+    void applyCertVerdict(const cert_verdict &verdict, NaughtyFilter *checkme);
 
     int sendProxyConnect(String &hostname, Socket *sock, NaughtyFilter *checkme);
 #endif //__SSLMITM
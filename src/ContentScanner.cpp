@@ -24,6 +24,10 @@
 #include <fcntl.h>
 #include <syslog.h>
 #include <cerrno>
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <ctime>
 
 // GLOBALS
 extern bool is_daemonised;
@@ -56,9 +60,70 @@ extern cscreate_t commandlinecreate;
 // CSPlugin class
 
 CSPlugin::CSPlugin(ConfigVar &definition)
-    : scanpost(false)
+    : cancelled(false), cancelfd(-1), cancelpid(0), scanslots(NULL), maxscans(0), interactiveslots(0),
+      scandeadline(0), scanpost(false)
 {
     cv = definition;
+    pthread_mutex_init(&cancellock, NULL);
+}
+
+CSPlugin::~CSPlugin()
+{
+    // children keep their own mapping of the slots, this only drops ours
+    if (scanslots != NULL)
+        munmap(scanslots, maxscans * sizeof(pid_t));
+}
+
+void CSPlugin::resetCancel()
+{
+    pthread_mutex_lock(&cancellock);
+    cancelled = false;
+    if (cancelfd >= 0)
+        close(cancelfd);
+    cancelfd = -1;
+    cancelpid = 0;
+    pthread_mutex_unlock(&cancellock);
+}
+
+// shutting the socket down wakes up anything blocked on it, and makes any
+// further reads & writes fail straight away
+void CSPlugin::cancelScan()
+{
+    pthread_mutex_lock(&cancellock);
+    cancelled = true;
+    if (cancelfd >= 0)
+        shutdown(cancelfd, SHUT_RDWR);
+    if (cancelpid != 0)
+        kill(cancelpid, SIGKILL);
+    pthread_mutex_unlock(&cancellock);
+}
+
+// the descriptor is duplicated, so that the number can't be reused by some
+// other socket - opened by another scanner's thread - while it's registered here
+void CSPlugin::setCancellable(int fd, pid_t pid)
+{
+    pthread_mutex_lock(&cancellock);
+    if (cancelfd >= 0)
+        close(cancelfd);
+    cancelfd = (fd >= 0) ? dup(fd) : -1;
+    cancelpid = pid;
+    if (cancelled) {
+        if (cancelfd >= 0)
+            shutdown(cancelfd, SHUT_RDWR);
+        if (cancelpid != 0)
+            kill(cancelpid, SIGKILL);
+    }
+    pthread_mutex_unlock(&cancellock);
+}
+
+void CSPlugin::clearCancellable()
+{
+    pthread_mutex_lock(&cancellock);
+    if (cancelfd >= 0)
+        close(cancelfd);
+    cancelfd = -1;
+    cancelpid = 0;
+    pthread_mutex_unlock(&cancellock);
 }
 
 // start the plugin - i.e. read in the configuration
@@ -72,9 +137,101 @@ int CSPlugin::init(void *args)
     if (!readStandardLists()) { //always
         return DGCS_ERROR; //include
     } // these
+
+    // how many scans all the children together may have running at once
+    if (scanslots == NULL && cv["maxscans"].toInteger() > 0) {
+        maxscans = cv["maxscans"].toInteger();
+        if (cv["interactivescans"] == "") {
+            interactiveslots = (maxscans + 3) / 4;
+            if (interactiveslots >= maxscans)
+                interactiveslots = maxscans - 1;
+        } else
+            interactiveslots = cv["interactivescans"].toInteger();
+        if (interactiveslots >= maxscans) {
+            if (!is_daemonised)
+                std::cerr << "interactivescans must be less than maxscans" << std::endl;
+            syslog(LOG_ERR, "interactivescans must be less than maxscans");
+            return DGCS_ERROR;
+        }
+        void *mem = mmap(NULL, maxscans * sizeof(pid_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            syslog(LOG_ERR, "Unable to allocate shared memory for scan scheduling - not limiting scans");
+            maxscans = 0;
+        } else {
+            scanslots = (pid_t *)mem;
+        }
+    }
     return DGCS_OK;
 }
 
+// take a slot for a scan, waiting for one to come free until the deadline.
+// interactive scans may use any slot, others only those after the interactive
+// ones. slots held by children that have gone are reused. -1 if none came free
+int CSPlugin::claimScanSlot(bool interactive, time_t deadline)
+{
+    pid_t me = getpid();
+    unsigned int first = interactive ? 0 : interactiveslots;
+    useconds_t wait = 5000;
+    while (!cancelled) {
+        for (unsigned int i = first; i < maxscans; i++) {
+            pid_t holder = scanslots[i];
+            if (holder != 0 && !(kill(holder, 0) < 0 && errno == ESRCH))
+                continue;
+            if (__sync_bool_compare_and_swap(&scanslots[i], holder, me))
+                return i;
+        }
+        if (time(NULL) >= deadline)
+            break;
+        usleep(wait);
+        if (wait < 100000)
+            wait *= 2;
+    }
+    return -1;
+}
+
+void CSPlugin::freeScanSlot(int slot)
+{
+    if (slot >= 0)
+        __sync_bool_compare_and_swap(&scanslots[slot], getpid(), 0);
+}
+
+int CSPlugin::scheduledScan(HTTPHeader *requestheader, HTTPHeader *docheader, const char *user, int filtergroup,
+    const char *ip, const char *filename, const char *object, off_t size, bool interactive,
+    NaughtyFilter *checkme, const String *disposition, const String *mimetype)
+{
+    time_t deadline = time(NULL) + o.content_scanner_timeout + (size >> 20) * o.content_scanner_timeout_per_mb;
+    int slot = -1;
+    if (scanslots != NULL && (slot = claimScanSlot(interactive, deadline)) < 0) {
+        lastmessage = lastvirusname = "";
+        if (cancelled)
+            return DGCS_SCANERROR;
+        lastmessage = "Timed out waiting for content scanner";
+        syslog(LOG_ERR, "Timed out waiting for a free %s scan slot", cv["plugname"].toCharArray());
+        return DGCS_SCANERROR;
+    }
+#ifdef DGDEBUG
+    std::cout << "Scanning " << size << " bytes (" << (interactive ? "interactive" : "bulk") << ") in slot " << slot
+              << ", " << (deadline - time(NULL)) << "s left" << std::endl;
+#endif
+    scandeadline = deadline;
+    int rc;
+    if (filename != NULL)
+        rc = scanFile(requestheader, docheader, user, filtergroup, ip, filename, checkme, disposition, mimetype);
+    else
+        rc = scanMemory(requestheader, docheader, user, filtergroup, ip, object, size, checkme, disposition, mimetype);
+    scandeadline = 0;
+    freeScanSlot(slot);
+    return rc;
+}
+
+int CSPlugin::scanTimeout()
+{
+    if (scandeadline == 0)
+        return o.content_scanner_timeout;
+    time_t left = scandeadline - time(NULL);
+    return (left < 1) ? 1 : left;
+}
+
 // make a temporary file for storing data which is to be scanned
 // returns FD in int and saves filename to String pointer
 // filename is not used as input
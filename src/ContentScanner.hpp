@@ -18,6 +18,7 @@
 #include "FDFuncs.hpp"
 #include "Plugin.hpp"
 #include <stdexcept>
+#include <pthread.h>
 
 // DEFINES
 #define DGCS_OK 0
@@ -49,7 +50,7 @@ class CSPlugin : public Plugin
     //constructor with CS plugin configuration passed in
     CSPlugin(ConfigVar &definition);
 
-    virtual ~CSPlugin(){};
+    virtual ~CSPlugin();
 
     // Test for whether or nor a particular ContentScanner is likely to be interested
     // in scanning data associated with the given HTTP request.  If "post" is true,
@@ -82,6 +83,57 @@ class CSPlugin : public Plugin
         const char *filename, NaughtyFilter *checkme, const String *disposition = NULL, const String *mimetype = NULL)
         = 0;
 
+    // scan the file (if filename isn't NULL) or memory, via the scheduler: when the
+    // plugin's maxscans limits how many scans all the children may have running at
+    // once, wait for a free slot first. interactive scans (small objects, page
+    // content) have interactivescans slots to themselves, so never queue behind
+    // bulk downloads. the scan gets a deadline, from contentscannertimeout plus
+    // contentscannertimeoutpermb for its size, which covers any waiting as well
+    int scheduledScan(HTTPHeader *requestheader, HTTPHeader *docheader, const char *user, int filtergroup,
+        const char *ip, const char *filename, const char *object, off_t size, bool interactive,
+        NaughtyFilter *checkme, const String *disposition = NULL, const String *mimetype = NULL);
+
+    // optional streaming scans, for scanners able to take a response body as it
+    // downloads instead of once it is complete. startStream returns false if the
+    // plugin won't stream this response, in which case scanFile/scanMemory are used.
+    // streamBlock is given the body (as received, i.e. possibly still compressed)
+    // a block at a time, and returns false once it wants no more; endStream then
+    // gives the verdict as scanFile/scanMemory would. abortStream is called instead
+    // of endStream if the body isn't going to be scanned after all.
+    virtual bool startStream(HTTPHeader *requestheader, HTTPHeader *docheader, NaughtyFilter *checkme)
+    {
+        return false;
+    };
+    virtual bool streamBlock(const char *block, int len)
+    {
+        return false;
+    };
+    virtual int endStream()
+    {
+        return DGCS_SCANERROR;
+    };
+    virtual void abortStream(){};
+
+    // version of the scanner and its signatures, for remembering results - a
+    // result is only reused while this is unchanged. empty if not known
+    virtual String getScannerVersion()
+    {
+        return "";
+    };
+
+    // with parallelscan, scanFile & scanMemory run in threads of their own, one
+    // per scanner, and once one scanner has found an infection the others are
+    // cancelled from its thread. a cancelled scan returns as soon as it can -
+    // its result is ignored. resetCancel is called before each scan is started,
+    // and also forgets anything a previous scan left registered
+    void cancelScan();
+    void resetCancel();
+
+    String getPluginName()
+    {
+        return cv["plugname"];
+    };
+
     const String &getLastMessage()
     {
         return lastmessage;
@@ -99,6 +151,21 @@ class CSPlugin : public Plugin
     };
 
     private:
+    // what a scan in progress is waiting on, for cancelScan to interrupt
+    pthread_mutex_t cancellock;
+    volatile bool cancelled;
+    int cancelfd;
+    pid_t cancelpid;
+
+    // scheduling: pids of the children with a scan running, shared between all
+    // of them. the first interactiveslots are only for interactive scans
+    pid_t *scanslots;
+    unsigned int maxscans;
+    unsigned int interactiveslots;
+    time_t scandeadline;
+    int claimScanSlot(bool interactive, time_t deadline);
+    void freeScanSlot(int slot);
+
     // lists of all the various things we may not want to scan
     ListContainer exceptionvirusmimetypelist;
     ListContainer exceptionvirusextensionlist;
@@ -115,6 +182,20 @@ class CSPlugin : public Plugin
 
     void blockFile(std::string *_category, std::string *_message, NaughtyFilter *checkme);
 
+    // the socket (and/or child process - or process group, if negative) a scan
+    // is currently waiting on, so that it can be cancelled. clear it once the
+    // scan is done with them
+    void setCancellable(int fd, pid_t pid = 0);
+    void clearCancellable();
+    bool isCancelled()
+    {
+        return cancelled;
+    };
+
+    // seconds left before the deadline of the scan in progress - to be used as
+    // the timeout for talking to the scanner. contentscannertimeout if none
+    int scanTimeout();
+
     // read in scan exception lists
     bool readStandardLists();
     // make & write to temp files, primarily for plugins with no direct memory scanning capability (e.g. clamdscan)
@@ -9,6 +9,7 @@
 #endif
 #include "HTTPHeader.hpp"
 #include "OptionContainer.hpp"
+#include "ContentScanner.hpp"
 
 #include <sys/stat.h>
 #include <syslog.h>
@@ -16,6 +17,9 @@
 #include <cstdlib>
 #include <unistd.h>
 #include <zlib.h>
+#ifdef HAVE_BROTLI
+#include <brotli/decode.h>
+#endif
 #include <cerrno>
 #include <fstream>
 #include <sys/time.h>
@@ -28,6 +32,11 @@
 #define __DGHEADER_SENDFIRSTLINE 1
 #define __DGHEADER_SENDREST 2
 
+// initial allocation when growing the body buffer
+#define DATABUFFER_MINGROW 32768
+// largest body buffer kept for reuse by the next request on a connection
+#define DATABUFFER_KEEPSIZE 65536
+
 // GLOBALS
 
 extern OptionContainer o;
@@ -35,23 +44,32 @@ extern OptionContainer o;
 // IMPLEMENTATION
 
 DataBuffer::DataBuffer()
-    : data(new char[1]), buffer_length(0), compresseddata(NULL), compressed_buffer_length(0), tempfilesize(0), dontsendbody(false), tempfilefd(-1), dm_plugin(NULL), timeout(20), bytesalreadysent(0), preservetemp(false)
+    : data(new char[1]), buffer_length(0), compresseddata(NULL), compressed_buffer_length(0), tempfilesize(0), dontsendbody(false), tempfilefd(-1), dm_plugin(NULL), timeout(20), bytesalreadysent(0), preservetemp(false), buffer_size(0),
+      decompress_type(DECOMPRESS_NONE), decompress_done(false), zstream(NULL), brstream(NULL), decompressed(NULL), decompressed_length(0), decompressed_size(0)
 {
     data[0] = '\0';
 }
 
 DataBuffer::DataBuffer(const void *indata, off_t length)
-    : data(new char[length]), buffer_length(length), compresseddata(NULL), compressed_buffer_length(0), tempfilesize(0), dontsendbody(false), tempfilefd(-1), timeout(20), bytesalreadysent(0), preservetemp(false)
+    : data(new char[length + 1]), buffer_length(length), compresseddata(NULL), compressed_buffer_length(0), tempfilesize(0), dontsendbody(false), tempfilefd(-1), dm_plugin(NULL), timeout(20), bytesalreadysent(0), preservetemp(false), buffer_size(0),
+      decompress_type(DECOMPRESS_NONE), decompress_done(false), zstream(NULL), brstream(NULL), decompressed(NULL), decompressed_length(0), decompressed_size(0)
 {
     memcpy(data, indata, length);
+    data[length] = '\0';
+    buffer_size = length;
 }
 
 void DataBuffer::reset()
 {
-    delete[] data;
     delete[] compresseddata;
 
-    data = new char[1];
+    // hang on to a modestly sized buffer for the next request on this
+    // connection, rather than going back to the allocator every time
+    if (buffer_size > DATABUFFER_KEEPSIZE) {
+        delete[] data;
+        data = new char[1];
+        buffer_size = 0;
+    }
     data[0] = '\0';
 
     compresseddata = NULL;
@@ -72,11 +90,14 @@ void DataBuffer::reset()
     dontsendbody = false;
     preservetemp = false;
     decompress = "";
+    abortDecompression();
+    streamscanners.clear();
 }
 
 // delete the memory block when the class is destroyed
 DataBuffer::~DataBuffer()
 {
+    abortDecompression();
     delete[] data;
     if (compresseddata != NULL) {
         delete[] compresseddata;
@@ -100,6 +121,7 @@ void DataBuffer::swapbacktocompressed()
     if (compresseddata != NULL && compressed_buffer_length > 0) {
         delete[] data;
         buffer_length = compressed_buffer_length;
+        buffer_size = compressed_buffer_length;
         data = compresseddata;
         compresseddata = NULL;
         compressed_buffer_length = 0;
@@ -117,12 +139,14 @@ int DataBuffer::bufferReadFromSocket(Socket *sock, char *buffer, int size, int s
         if (rc < 1) {
             // none recieved or an error
             if (pos > 0) {
+                streamToScanners(buffer, pos);
                 return pos; // some was recieved previous into buffer
             }
             return rc; // just return with the return code
         }
         pos += rc;
     }
+    streamToScanners(buffer, size);
     return size; // full buffer
 }
 
@@ -143,6 +167,7 @@ int DataBuffer::bufferReadFromSocket(Socket *sock, char *buffer, int size, int s
         if (rc < 1) {
             // none recieved or an error
             if (pos > 0) {
+                streamToScanners(buffer, pos);
                 return pos; // some was recieved previous into buffer
             }
             return rc; // just return with the return code
@@ -153,18 +178,71 @@ int DataBuffer::bufferReadFromSocket(Socket *sock, char *buffer, int size, int s
 #ifdef DGDEBUG
             std::cout << "buffered socket read more than timeout" << std::endl;
 #endif
+            streamToScanners(buffer, pos);
             return pos; // just return how much got so far then
         }
     }
+    streamToScanners(buffer, size);
     return size; // full buffer
 }
 
+// every block of the body comes through the buffered reads, so this is where
+// scanners that can stream get it - while the rest is still downloading
+void DataBuffer::streamToScanners(const char *block, int len)
+{
+    std::deque<CSPlugin *>::iterator i = streamscanners.begin();
+    while (i != streamscanners.end()) {
+        if ((*i)->streamBlock(block, len)) {
+            i++;
+        } else {
+#ifdef DGDEBUG
+            std::cout << "stream scanner has finished early" << std::endl;
+#endif
+            i = streamscanners.erase(i);
+        }
+    }
+}
+
+// make room for len more bytes on the end of the body. the buffer is
+// doubled as needed, so downloading a large body into RAM costs amortised
+// linear copying rather than a copy of everything so far per block.
+char *DataBuffer::reserveSpace(off_t len)
+{
+    if (buffer_length + len > buffer_size) {
+        off_t newsize = (buffer_size > DATABUFFER_MINGROW) ? buffer_size : DATABUFFER_MINGROW;
+        while (newsize < buffer_length + len) {
+            newsize *= 2;
+        }
+        char *temp = new char[newsize + 1];
+        memcpy(temp, data, buffer_length);
+        delete[] data;
+        data = temp;
+        buffer_size = newsize;
+    }
+    return data + buffer_length;
+}
+
+// take len bytes written after the current data into the body
+void DataBuffer::commitSpace(off_t len)
+{
+    buffer_length += len;
+    data[buffer_length] = '\0';
+}
+
 // make a temp file and return its FD. only currently used in DM plugins.
 int DataBuffer::getTempFileFD()
 {
     if (tempfilefd > -1) {
         return tempfilefd;
     }
+    // downloads may need a name later for content scanning or a fancy DM link,
+    // so memfd mode uses an O_TMPFILE too, which can be linked in if needed
+    if (o.temp_file_mode != DG_TEMPFILE_NAMED) {
+        tempfilepath = "";
+        if ((tempfilefd = createAnonTempFile(o.download_dir.c_str(), DG_TEMPFILE_TMPFILE)) > -1) {
+            return tempfilefd;
+        }
+    }
     tempfilepath = o.download_dir.c_str();
     tempfilepath += "/tfXXXXXX";
     char *tempfilepatharray = new char[tempfilepath.length() + 1];
@@ -185,6 +263,20 @@ int DataBuffer::getTempFileFD()
     return tempfilefd;
 }
 
+// give an unnamed temp file a name in the file cache dir, for things which
+// need to open it by name
+String &DataBuffer::getTempFilePath()
+{
+    if ((tempfilefd > -1) && (tempfilepath.length() == 0)) {
+        std::string path(linkAnonTempFile(tempfilefd, o.download_dir.c_str(), "tf"));
+        if (path.length() == 0) {
+            syslog(LOG_ERR, "Could not link temp file into %s: %s", o.download_dir.c_str(), strerror(errno));
+        }
+        tempfilepath = path.c_str();
+    }
+    return tempfilepath;
+}
+
 // check the client's user agent, see if we have a DM plugin compatible with it, and use it to download the body of the given request
 bool DataBuffer::in(Socket *sock, Socket *peersock, HTTPHeader *requestheader, HTTPHeader *docheader, bool runav, int *headersent)
 {
@@ -249,38 +341,17 @@ void DataBuffer::out(Socket *sock) throw(std::exception)
 #ifdef DGDEBUG
         std::cout << "Sending " << tempfilesize - bytesalreadysent << " bytes from temp file (" << bytesalreadysent << " already sent)" << std::endl;
 #endif
-        off_t sent = bytesalreadysent;
-        int rc;
-
-        if (lseek(tempfilefd, bytesalreadysent, SEEK_SET) < 0)
-            throw std::runtime_error(std::string("Can't write to socket: ") + strerror(errno));
-
-        while (sent < tempfilesize) {
-            rc = readEINTR(tempfilefd, data, buffer_length);
-#ifdef DGDEBUG
-            std::cout << "reading temp file rc:" << rc << std::endl;
-#endif
-            if (rc < 0) {
+        // non-SSL sockets use sendfile(), so the body never comes back through user space
+        off_t sent = sock->writeFromFile(tempfilefd, bytesalreadysent, tempfilesize - bytesalreadysent, timeout);
+        if (sent < 0) {
 #ifdef DGDEBUG
-                std::cout << "error reading temp file so throwing exception" << std::endl;
+            std::cout << "error sending temp file so throwing exception" << std::endl;
 #endif
-                throw std::exception();
-            }
-            if (rc == 0) {
-#ifdef DGDEBUG
-                std::cout << "got zero bytes reading temp file" << std::endl;
-#endif
-                break; // should never happen
-            }
-            // as it's cached to disk the buffer must be reasonably big
-            if (!sock->writeToSocket(data, rc, 0, timeout)) {
-                throw std::runtime_error(std::string("Can't write to socket: ") + strerror(errno));
-            }
-            sent += rc;
+            throw std::runtime_error(std::string("Can't write to socket: ") + strerror(errno));
+        }
 #ifdef DGDEBUG
-            std::cout << "total sent from temp:" << sent << std::endl;
+        std::cout << "total sent from temp:" << bytesalreadysent + sent << std::endl;
 #endif
-        }
         close(tempfilefd);
         tempfilefd = -1;
         tempfilesize = 0;
@@ -300,16 +371,14 @@ void DataBuffer::out(Socket *sock) throw(std::exception)
     }
 }
 
-// zlib decompression
-void DataBuffer::zlibinflate(bool header)
+// set up incremental decompression according to the content encoding
+void DataBuffer::startDecompression()
 {
-    if (buffer_length < 12) {
-        return; // it can't possibly be zlib'd
-    }
-#ifdef DGDEBUG
-    std::cout << "compressed size:" << buffer_length << std::endl;
-#endif
+    abortDecompression();
 
+    if (decompress.contains("deflate")) {
+        decompress_type = DECOMPRESS_DEFLATE;
+    } else if (decompress.contains("gzip")) {
 #if ZLIB_VERNUM < 0x1210
 #warning ************************************
 #warning For gzip support you need zlib 1.2.1
@@ -317,110 +386,212 @@ void DataBuffer::zlibinflate(bool header)
 #warning You can ignore this warning but
 #warning internet bandwidth may be wasted.
 #warning ************************************
-    if (header) {
         return;
+#endif
+        decompress_type = DECOMPRESS_GZIP;
+    }
+#ifdef HAVE_BROTLI
+    else if (decompress.contains("br")) {
+        decompress_type = DECOMPRESS_BROTLI;
     }
 #endif
+    else {
+        return;
+    }
 
-    int newsize = buffer_length * 5; // good estimate of deflated HTML
-
-    char *block = new char[newsize];
-    block[0] = '\0';
-
-    char *temp = NULL;
-
-    off_t bytesgot = 0;
-    int err;
+#ifdef HAVE_BROTLI
+    if (decompress_type == DECOMPRESS_BROTLI) {
+#ifdef DGDEBUG
+        std::cout << "brotli format" << std::endl;
+#endif
+        brstream = BrotliDecoderCreateInstance(NULL, NULL, NULL);
+        if (brstream == NULL) {
+#ifdef DGDEBUG
+            std::cerr << "bad init brotli decoder" << std::endl;
+#endif
+            decompress_type = DECOMPRESS_NONE;
+        }
+        return;
+    }
+#endif
 
-    z_stream d_stream;
-    d_stream.zalloc = (alloc_func)0;
-    d_stream.zfree = (free_func)0;
-    d_stream.opaque = (voidpf)0;
-    d_stream.next_in = (Bytef *)data;
-    d_stream.avail_in = buffer_length;
-    d_stream.next_out = (Bytef *)block;
-    d_stream.avail_out = newsize;
+#ifdef DGDEBUG
+    std::cout << (decompress_type == DECOMPRESS_GZIP ? "gzip format" : "zlib format") << std::endl;
+#endif
+    zstream = new z_stream;
+    zstream->zalloc = (alloc_func)0;
+    zstream->zfree = (free_func)0;
+    zstream->opaque = (voidpf)0;
+    zstream->next_in = Z_NULL;
+    zstream->avail_in = 0;
 
     // inflate either raw zlib, or possibly gzip with a header
-    if (header) {
-        err = inflateInit2(&d_stream, 15 + 32);
-    } else {
-        err = inflateInit2(&d_stream, -15);
-    }
-
-    if (err != Z_OK) { // was a problem so just return
-        delete[] block; // don't forget to free claimed memory
+    int err = inflateInit2(zstream, (decompress_type == DECOMPRESS_GZIP) ? 15 + 32 : -15);
+    if (err != Z_OK) {
 #ifdef DGDEBUG
         std::cerr << "bad init inflate: " << err << std::endl;
 #endif
+        delete zstream;
+        zstream = NULL;
+        decompress_type = DECOMPRESS_NONE;
+    }
+}
+
+// decompress one block of the body as it comes off the socket.
+// output goes through a fixed size window, so the memory used per call is
+// bounded no matter how well the block compressed.
+void DataBuffer::decompressBlock(const char *block, off_t len)
+{
+    if ((decompress_type == DECOMPRESS_NONE) || decompress_done || (len <= 0)) {
         return;
     }
-    while (true) {
-#ifdef DGDEBUG
-        std::cerr << "inflate loop" << std::endl;
-#endif
-        err = inflate(&d_stream, Z_SYNC_FLUSH);
-        bytesgot = d_stream.total_out;
-        if (err == Z_STREAM_END) {
-            err = inflateEnd(&d_stream);
-            if (err != Z_OK) {
-                delete[] block;
+
+    char window[16384];
+
+    if (zstream != NULL) {
+        zstream->next_in = (Bytef *)block;
+        zstream->avail_in = len;
+        while (true) {
+            zstream->next_out = (Bytef *)window;
+            zstream->avail_out = sizeof(window);
+            int err = inflate(zstream, Z_SYNC_FLUSH);
+            if ((err != Z_OK) && (err != Z_STREAM_END) && (err != Z_BUF_ERROR)) {
 #ifdef DGDEBUG
-                std::cerr << "bad inflateEnd: " << d_stream.msg << std::endl;
+                std::cerr << "bad inflate: " << (zstream->msg ? zstream->msg : "") << std::endl;
 #endif
+                abortDecompression();
                 return;
             }
-            break;
+            if (!appendDecompressed(window, sizeof(window) - zstream->avail_out)) {
+                return;
+            }
+            if (err == Z_STREAM_END) {
+                decompress_done = true;
+                break;
+            }
+            // stop once all input is consumed and the window was not filled
+            if ((err == Z_BUF_ERROR) || ((zstream->avail_in == 0) && (zstream->avail_out > 0))) {
+                break;
+            }
         }
-        if (err != Z_OK) { // was a problem so just return
-            delete[] block; // don't forget to free claimed memory
-#ifdef DGDEBUG
-            std::cerr << "bad inflate: " << d_stream.msg << std::endl;
-#endif
-            err = inflateEnd(&d_stream);
-            if (err != Z_OK) {
+    }
+#ifdef HAVE_BROTLI
+    else if (brstream != NULL) {
+        size_t avail_in = len;
+        const uint8_t *next_in = (const uint8_t *)block;
+        while (true) {
+            size_t avail_out = sizeof(window);
+            uint8_t *next_out = (uint8_t *)window;
+            BrotliDecoderResult res = BrotliDecoderDecompressStream(brstream, &avail_in, &next_in, &avail_out, &next_out, NULL);
+            if (res == BROTLI_DECODER_RESULT_ERROR) {
 #ifdef DGDEBUG
-                std::cerr << "bad inflateEnd: " << d_stream.msg << std::endl;
+                std::cerr << "bad brotli decode: " << BrotliDecoderErrorString(BrotliDecoderGetErrorCode(brstream)) << std::endl;
 #endif
+                abortDecompression();
+                return;
+            }
+            if (!appendDecompressed(window, sizeof(window) - avail_out)) {
+                return;
+            }
+            if (res == BROTLI_DECODER_RESULT_SUCCESS) {
+                decompress_done = true;
+                break;
+            }
+            if (res == BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT) {
+                break;
             }
-            return;
         }
-        if (bytesgot > o.max_content_filter_size) {
-            delete[] block; // don't forget to free claimed memory
-#ifdef DGDEBUG
-            std::cerr << "inflated file larger than maxcontentfiltersize, not inflating further" << std::endl;
+    }
 #endif
-            err = inflateEnd(&d_stream);
-            if (err != Z_OK) {
+}
+
+// add output from the decompressor to the decompressed copy of the body
+bool DataBuffer::appendDecompressed(const char *block, off_t len)
+{
+    if (len <= 0) {
+        return true;
+    }
+    if (decompressed_length + len > o.max_content_filter_size) {
 #ifdef DGDEBUG
-                std::cerr << "bad inflateEnd: " << d_stream.msg << std::endl;
+        std::cerr << "inflated file larger than maxcontentfiltersize, not inflating further" << std::endl;
 #endif
-            }
-            return;
+        abortDecompression();
+        return false;
+    }
+    // leave room for a terminating null, as the content filters expect one
+    if (decompressed_length + len + 1 > decompressed_size) {
+        off_t newsize = (decompressed_size > 0) ? decompressed_size : 32768;
+        while (newsize < decompressed_length + len + 1) {
+            newsize *= 2;
+        }
+        char *temp = new char[newsize];
+        if (decompressed != NULL) {
+            memcpy(temp, decompressed, decompressed_length);
+            delete[] decompressed;
         }
+        decompressed = temp;
+        decompressed_size = newsize;
+    }
+    memcpy(decompressed + decompressed_length, block, len);
+    decompressed_length += len;
+    return true;
+}
 
-        // inflation is going ok, but we don't have enough room in the output buffer
-        newsize = bytesgot * 2;
-        temp = new char[newsize];
-        memcpy(temp, block, bytesgot);
-        delete[] block;
-        block = temp;
-        temp = NULL;
+// swap the decompressed body in, keeping the original for swapbacktocompressed.
+// if the stream did not end cleanly, the body is left compressed.
+void DataBuffer::finishDecompression()
+{
+    if (decompress_type == DECOMPRESS_NONE) {
+        return;
+    }
+    if (!decompress_done) {
+#ifdef DGDEBUG
+        std::cerr << "compressed stream incomplete, not decompressing" << std::endl;
+#endif
+        abortDecompression();
+        return;
+    }
 
-        d_stream.next_out = (Bytef *)(block + bytesgot);
-        d_stream.avail_out = newsize - bytesgot;
+    if (decompressed == NULL) {
+        decompressed = new char[1];
+        decompressed_size = 1;
     }
+    decompressed[decompressed_length] = '\0';
 
+    delete[] compresseddata;
     compresseddata = data;
     compressed_buffer_length = buffer_length;
-    buffer_length = bytesgot;
+    data = decompressed;
+    buffer_length = decompressed_length;
+    buffer_size = decompressed_size - 1;
 #ifdef DGDEBUG
-    std::cout << "decompressed size: " << buffer_length << std::endl;
+    std::cout << "compressed size: " << compressed_buffer_length << " decompressed size: " << buffer_length << std::endl;
+#endif
+
+    decompressed = NULL;
+    abortDecompression();
+}
+
+// throw away any decompression in progress
+void DataBuffer::abortDecompression()
+{
+    if (zstream != NULL) {
+        inflateEnd(zstream);
+        delete zstream;
+        zstream = NULL;
+    }
+#ifdef HAVE_BROTLI
+    if (brstream != NULL) {
+        BrotliDecoderDestroyInstance(brstream);
+        brstream = NULL;
+    }
 #endif
-    data = new char[bytesgot + 1];
-    data[bytesgot] = '\0';
-    memcpy(data, block, bytesgot);
-    delete[] block;
+    delete[] decompressed;
+    decompressed = NULL;
+    decompressed_length = 0;
+    decompressed_size = 0;
+    decompress_type = DECOMPRESS_NONE;
+    decompress_done = false;
 }
 
 // Does a regexp search and replace.
@@ -536,6 +707,7 @@ bool DataBuffer::contentRegExp(int filtergroup)
             delete[] data;
             data = newblock;
             buffer_length = buffer_length + sizediff;
+            buffer_size = buffer_length;
             contentmodified = true;
         }
     }
@@ -6,12 +6,16 @@
 #define __HPP_DATABUFFER
 
 #include <exception>
+#include <deque>
 #include <string.h>
 #include "Socket.hpp"
 #include "String.hpp"
 #include "FDFuncs.hpp"
 
 class DMPlugin;
+class CSPlugin;
+struct z_stream_s;
+struct BrotliDecoderStateStruct;
 
 class DataBuffer
 {
@@ -63,8 +67,20 @@ class DataBuffer
     // content regexp search and replace
     bool contentRegExp(int filtergroup);
 
+    // content scanners to hand the body to as it is read in (see CSPlugin::startStream)
+    void addStreamScanner(CSPlugin *cs)
+    {
+        streamscanners.push_back(cs);
+    };
+    void clearStreamScanners()
+    {
+        streamscanners.clear();
+    };
+
     // create a temp file and return its FD	- NOT a simple accessor function
     int getTempFileFD();
+    // path of the temp file - an unnamed (O_TMPFILE) one is linked in on first use
+    String &getTempFilePath();
 
     void reset();
 
@@ -83,9 +99,43 @@ class DataBuffer
     off_t bytesalreadysent;
     bool preservetemp;
 
+    // allocated size of data, not counting room for a null terminator
+    off_t buffer_size;
+
+    // make room for len more bytes after the current data, growing the buffer
+    // geometrically; returns where to write them
+    char *reserveSpace(off_t len);
+    // add len bytes written at the position given by reserveSpace to the data
+    void commitSpace(off_t len);
+
     String decompress;
 
-    void zlibinflate(bool header);
+    // incremental decompression state - the DM plugins feed each block
+    // through decompressBlock as it arrives, so the decompressed copy is
+    // built up alongside the compressed one rather than all at the end
+    enum { DECOMPRESS_NONE, DECOMPRESS_DEFLATE, DECOMPRESS_GZIP, DECOMPRESS_BROTLI };
+    int decompress_type;
+    bool decompress_done;
+    z_stream_s *zstream;
+    BrotliDecoderStateStruct *brstream;
+    char *decompressed;
+    off_t decompressed_length;
+    off_t decompressed_size;
+
+    // set up decompression according to the content encoding given to setDecompress
+    void startDecompression();
+    // decompress one block of the encoded body
+    void decompressBlock(const char *block, off_t len);
+    // swap in the decompressed body, if decompression completed successfully
+    void finishDecompression();
+    // discard any decompression state and output
+    void abortDecompression();
+    // append decompressed output, growing the output buffer geometrically
+    bool appendDecompressed(const char *block, off_t len);
+
+    std::deque<CSPlugin *> streamscanners;
+    // pass a block just read to the stream scanners, dropping those that are done
+    void streamToScanners(const char *block, int len);
 
     // buffered socket reads - one with an extra "global" timeout within which all individual reads must complete
     int bufferReadFromSocket(Socket *sock, char *buffer, int size, int sockettimeout);
@@ -13,6 +13,13 @@
 #endif
 #include "FDFuncs.hpp"
 
+#include <fcntl.h>
+#include <cstdio>
+#include <cstdlib>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+
 // IMPLEMENTATION
 
 // wrapper around FD read that restarts on EINTR
@@ -48,3 +55,53 @@ int writeEINTR(int fd, char *buf, unsigned int count)
     }
     return rc; // return status
 }
+
+// create an unnamed temp file. a memfd lives purely in RAM; an O_TMPFILE
+// lives in the given directory's filesystem. either way there is no name
+// to create or unlink, and the data goes away when the last fd is closed.
+int createAnonTempFile(const char *dir, int mode)
+{
+    int fd = -1;
+#ifdef HAVE_MEMFD_CREATE
+    if (mode == DG_TEMPFILE_MEMFD) {
+        fd = memfd_create("e2guardian", MFD_CLOEXEC);
+        if (fd > -1)
+            return fd;
+    }
+#endif
+#ifdef O_TMPFILE
+    if (mode != DG_TEMPFILE_NAMED) {
+        do {
+            fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+        } while (fd < 0 && errno == EINTR);
+    }
+#endif
+    return fd;
+}
+
+// link an O_TMPFILE file into the filesystem under a unique name
+std::string linkAnonTempFile(int fd, const char *dir, const char *prefix)
+{
+    static const char chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
+    char procpath[64];
+    snprintf(procpath, sizeof(procpath), "/proc/self/fd/%d", fd);
+
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    unsigned long long seed = ((unsigned long long)tv.tv_usec << 16) ^ tv.tv_sec ^ getpid();
+
+    for (int attempt = 0; attempt < 100; attempt++) {
+        std::string path(dir);
+        path += "/";
+        path += prefix;
+        for (int i = 0; i < 6; i++) {
+            seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+            path += chars[(seed >> 33) % (sizeof(chars) - 1)];
+        }
+        if (linkat(AT_FDCWD, procpath, AT_FDCWD, path.c_str(), AT_SYMLINK_FOLLOW) == 0)
+            return path;
+        if (errno != EEXIST)
+            break;
+    }
+    return "";
+}
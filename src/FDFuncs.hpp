@@ -13,6 +13,14 @@
 
 #include <unistd.h>
 #include <cerrno>
+#include <string>
+
+// DEFINES
+
+// where spilled temp data lives (tempfilemode option)
+#define DG_TEMPFILE_NAMED 0 // mkstemp in the temp directory
+#define DG_TEMPFILE_TMPFILE 1 // unnamed O_TMPFILE in the temp directory
+#define DG_TEMPFILE_MEMFD 2 // anonymous memfd, never touches a filesystem
 
 // IMPLEMENTATION
 
@@ -20,4 +28,11 @@
 int readEINTR(int fd, char *buf, unsigned int count);
 int writeEINTR(int fd, char *buf, unsigned int count);
 
+// create an unnamed temp file according to mode - returns -1 if that is not
+// possible here (or mode is DG_TEMPFILE_NAMED), in which case use mkstemp
+int createAnonTempFile(const char *dir, int mode);
+// give an O_TMPFILE file a unique name in dir starting with prefix;
+// returns the new path, or an empty string on failure
+std::string linkAnonTempFile(int fd, const char *dir, const char *prefix);
+
 #endif
@@ -68,6 +68,11 @@ bool FDTunnel::tunnel(Socket &sockfrom, Socket &sockto, bool twoway, off_t targe
         sockfrom.buffstart = 0;
     }
 
+#ifdef __SSLMITM
+    if (sockfrom.isSsl() || sockto.isSsl())
+        return tunnelNonBlocking(sockfrom, sockto, twoway, targetthroughput, ignore);
+#endif
+
     int maxfd, rc, fdfrom, fdto;
 
     fdfrom = sockfrom.getFD();
@@ -106,21 +111,7 @@ bool FDTunnel::tunnel(Socket &sockfrom, Socket &sockto, bool twoway, off_t targe
         if (ignore && !twoway)
             FD_CLR(fdto, &inset);
 
-#ifdef __SSLMITM
-        //<TODO> This if is a nasty hack for ssl man in the middle
-        //FD_SET sets the fd to a readable state then data is read
-        //from the server until the server runs out of data then it
-        //gets gets dumped out to the client.
-        //This will break if the server is ever expecting data from
-        //the client.
-        //There isnt and SSL_select function, SSL_pending only reports
-        //whats waiting in the current record, and nbio doesnt seem to
-        //work if you use BIO_setfd (like we have to) so no ideas how
-        //to actually fix this other than rewrite dg
-        if (sockfrom.isSsl()) {
-        } else
-#endif
-            if (selectEINTR(maxfd + 1, &inset, NULL, NULL, &t) < 1) {
+        if (selectEINTR(maxfd + 1, &inset, NULL, NULL, &t) < 1) {
             break; // an error occurred or it timed out so end while()
         }
 
@@ -213,3 +204,145 @@ bool FDTunnel::tunnel(Socket &sockfrom, Socket &sockto, bool twoway, off_t targe
 #endif
     return (targetthroughput > -1) ? (throughput <= targetthroughput) : true;
 }
+
+#ifdef __SSLMITM
+// one direction of a non-blocking tunnel - data read from src, waiting to go to dst
+struct tunnel_leg {
+    Socket *src;
+    Socket *dst;
+    char buff[32768];
+    int len; // bytes in buff
+    int off; // bytes of buff already written
+    bool closed; // src has nothing more to send
+};
+
+// SSL can't be driven by select() alone: records may already be decrypted and
+// waiting (SSL_pending), and a read can need the socket to be writable or a
+// write need it to be readable. So both ends are made non-blocking and each
+// direction reads from its source only once the last read has been written
+// out, retrying whichever side would have blocked when select() says so.
+bool FDTunnel::tunnelNonBlocking(Socket &sockfrom, Socket &sockto, bool twoway, off_t targetthroughput, bool ignore)
+{
+    tunnel_leg legs[2];
+    legs[0].src = &sockfrom;
+    legs[0].dst = &sockto;
+    legs[1].src = &sockto;
+    legs[1].dst = &sockfrom;
+    int nlegs = twoway ? 2 : 1;
+    for (int i = 0; i < 2; i++) {
+        legs[i].len = legs[i].off = 0;
+        legs[i].closed = false;
+    }
+
+    int fdfrom = sockfrom.getFD();
+    int fdto = sockto.getFD();
+    int maxfd = fdfrom > fdto ? fdfrom : fdto;
+    // one way tunnels end when the client starts sending a new request (see tunnel)
+    bool watchto = !twoway && !ignore;
+
+    sockfrom.setNonBlocking(true);
+    sockto.setNonBlocking(true);
+
+    bool error = false;
+    while (true) {
+        bool progress = false;
+
+        for (int i = 0; i < nlegs && !error; i++) {
+            tunnel_leg &leg = legs[i];
+            while (true) {
+                int rc;
+                if (leg.off == leg.len) {
+                    leg.off = leg.len = 0;
+                    if (leg.closed)
+                        break;
+                    int want = sizeof(leg.buff);
+                    if (i == 0 && targetthroughput > -1) {
+                        if (throughput >= targetthroughput)
+                            break;
+                        if ((targetthroughput - throughput) < want)
+                            want = targetthroughput - throughput;
+                    }
+                    rc = leg.src->readNonBlocking(leg.buff, want);
+                    if (rc == SOCKET_WOULD_BLOCK)
+                        break;
+                    if (rc <= 0) {
+                        leg.closed = true; // closed, or an error - either way nothing more to come
+                        break;
+                    }
+                    leg.len = rc;
+                    if (i == 0)
+                        throughput += rc;
+                    progress = true;
+                }
+                rc = leg.dst->writeNonBlocking(leg.buff + leg.off, leg.len - leg.off);
+                if (rc == SOCKET_WOULD_BLOCK)
+                    break;
+                if (rc <= 0) {
+                    error = true;
+                    break;
+                }
+                leg.off += rc;
+                progress = true;
+            }
+        }
+        if (error)
+            break;
+
+        // finished once a direction has closed (or had all it was expected to
+        // send) and everything read from it has been passed on
+        bool finished = false;
+        for (int i = 0; i < nlegs; i++) {
+            bool drained = legs[i].closed || (i == 0 && targetthroughput > -1 && throughput >= targetthroughput);
+            if (drained && legs[i].len == 0)
+                finished = true;
+        }
+        if (finished)
+            break;
+
+        if (progress)
+            continue; // more may be waiting without touching the network
+        if (watchto && sockto.hasBufferedInput()) {
+#ifdef DGDEBUG
+            std::cout << "fdto is sending data; closing tunnel. (This must be a persistent connection.)" << std::endl;
+#endif
+            break;
+        }
+
+        fd_set inset, outset;
+        FD_ZERO(&inset);
+        FD_ZERO(&outset);
+        for (int i = 0; i < nlegs; i++) {
+            Socket *waiting = (legs[i].len > 0) ? legs[i].dst : legs[i].src;
+            if (legs[i].len == 0 && legs[i].closed)
+                continue;
+            FD_SET(waiting->getFD(), waiting->waitingToWrite() ? &outset : &inset);
+        }
+        if (watchto)
+            FD_SET(fdto, &inset);
+
+        timeval t;
+        t.tv_sec = 120;
+        t.tv_usec = 0;
+        if (selectEINTR(maxfd + 1, &inset, &outset, NULL, &t) < 1)
+            break; // an error occurred or it timed out
+
+        if (watchto && FD_ISSET(fdto, &inset) && !(legs[0].len > 0 && !sockto.waitingToWrite())) {
+#ifdef DGDEBUG
+            std::cout << "fdto is sending data; closing tunnel. (This must be a persistent connection.)" << std::endl;
+#endif
+            break;
+        }
+    }
+
+    sockfrom.setNonBlocking(false);
+    sockto.setNonBlocking(false);
+
+#ifdef DGDEBUG
+    if ((throughput >= targetthroughput) && (targetthroughput > -1))
+        std::cout << "All expected data tunnelled. (expected " << targetthroughput << "; tunnelled " << throughput << ")" << std::endl;
+    else
+        std::cout << "Tunnel closed." << std::endl;
+#endif
+    return (targetthroughput > -1) ? (throughput <= targetthroughput) : true;
+}
+#endif
@@ -28,6 +28,12 @@ class FDTunnel
     bool tunnel(Socket &sockfrom, Socket &sockto, bool twoway = false, off_t targetthroughput = -1, bool ignore = false);
 
     void reset();
+
+    private:
+#ifdef __SSLMITM
+    // tunnel where either end is SSL, using non-blocking reads & writes
+    bool tunnelNonBlocking(Socket &sockfrom, Socket &sockto, bool twoway, off_t targetthroughput, bool ignore);
+#endif
 };
 
 #endif
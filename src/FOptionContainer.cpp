@@ -197,6 +197,7 @@ void FOptionContainer::resetJustListData()
     enable_regex_grey = false;
     only_mitm_ssl_grey = false;
     ssl_mitm = false;
+    ssl_sni_peek = false;
     enable_ssl_legacy_logic = false;
 //searchengine_regexp_flag = false;
 #ifdef PRT_DNSAUTH
@@ -391,6 +392,8 @@ bool FOptionContainer::read(const char *filename)
             enable_ssl_legacy_logic = false;
         }
 
+        ssl_sni_peek = (findoptionS("sslsnipeek") == "on");
+
 #ifdef __SSLMITM
         if (findoptionS("sslcheckcert") == "on") {
             ssl_check_cert = true;
@@ -1442,6 +1445,10 @@ char *FOptionContainer::inSiteList(String &url, unsigned int list, bool doblanke
         }
         delete url2s;
     }
+    if (isipurl) {
+        // an IP has no higher level domains to check - just the one lookup
+        return (*o.lm.l[list]).findInList(url.toCharArray());
+    }
     while (url.contains(".")) {
         i = (*o.lm.l[list]).findInList(url.toCharArray());
         if (i != NULL) {
@@ -49,6 +49,9 @@ class FOptionContainer
     //SSL certificate checking
     bool ssl_check_cert;
 
+    //check the server name in the ClientHello of tunnelled connections
+    bool ssl_sni_peek;
+
     //SSL Man in the middle
     bool ssl_mitm;
     bool only_mitm_ssl_grey;
@@ -29,6 +29,7 @@
 
 #include <istream>
 #include <map>
+#include <deque>
 #include <memory>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -52,6 +53,9 @@
 #include "SocketArray.hpp"
 #include "UDSocket.hpp"
 #include "SysV.hpp"
+#include "SSLSessionCache.hpp"
+#include "CertVerdictCache.hpp"
+#include "ScanVerdictCache.hpp"
 
 // GLOBALS
 
@@ -96,6 +100,9 @@ SocketArray serversockets; // the sockets we will listen on for connections
 UDSocket loggersock; // the unix domain socket to be used for ipc with the forked children
 UDSocket urllistsock;
 UDSocket iplistsock;
+#ifdef __SSLMITM
+UDSocket certlistsock;
+#endif
 Socket *peersock(NULL); // the socket which will contain the connection
 
 String peersockip; // which will contain the connection ip
@@ -130,7 +137,14 @@ void stat_rec::start()
         old_umask = umask(S_IWGRP | S_IWOTH);
         fs = fopen(o.dstat_location.c_str(), "a");
         if (fs) {
-            fprintf(fs, "time		children 	busy	free	wait	births	deaths	conx	conx/s\n");
+            fprintf(fs, "time		children 	busy	free	wait	births	deaths	conx	conx/s");
+#ifdef __SSLMITM
+            fprintf(fs, "	sslres	sslfull	upres	upfull");
+#endif
+#ifdef PRT_DNSAUTH
+            fprintf(fs, "	dnshit	dnsneg	dnsstale	dnsmiss");
+#endif
+            fprintf(fs, "\n");
         } else {
             syslog(LOG_ERR, "Unable to open dstats_log %s for writing\nContinuing with logging\n",
                 o.dstat_location.c_str());
@@ -145,7 +159,7 @@ void stat_rec::reset()
 {
     time_t now = time(NULL);
     long cps = conx / (now - start_int);
-    fprintf(fs, "%ld	%d	%d	%d	%d	%ld	%ld	%ld	%ld\n", now, numchildren,
+    fprintf(fs, "%ld	%d	%d	%d	%d	%ld	%ld	%ld	%ld", now, numchildren,
         (busychildren - waitingfor),
         freechildren,
         waitingfor,
@@ -153,6 +167,27 @@ void stat_rec::reset()
         deaths,
         conx,
         cps);
+#ifdef __SSLMITM
+    // ssl resumption counters are kept by the children in shared memory
+    ssl_session_stats sslstats;
+    takeSslSessionStats(&sslstats);
+    fprintf(fs, "	%lu	%lu	%lu	%lu",
+        sslstats.server_resumed,
+        sslstats.server_full,
+        sslstats.client_resumed,
+        sslstats.client_full);
+#endif
+#ifdef PRT_DNSAUTH
+    // as are the dnsauth plugin's lookup cache counters
+    dnsauth_stats dnsstats;
+    takeDnsAuthStats(&dnsstats);
+    fprintf(fs, "	%lu	%lu	%lu	%lu",
+        dnsstats.hits,
+        dnsstats.negative_hits,
+        dnsstats.stale_hits,
+        dnsstats.misses);
+#endif
+    fprintf(fs, "\n");
     fflush(fs);
     clear();
     if ((end_int + o.dstat_interval) > now)
@@ -216,6 +251,10 @@ void sig_segv(int signo, siginfo_t *info, void *secret); // Generate a backtrace
 // logging & URL cache processes
 int log_listener(std::string log_location, bool logconerror, bool logsyslog);
 int url_list_listener(bool logconerror);
+#ifdef __SSLMITM
+// certificate generator process
+int cert_listener(bool logconerror);
+#endif
 // send flush message over URL cache IPC socket
 void flush_urlcache();
 
@@ -701,6 +740,8 @@ int handle_connections(UDSocket &pipe)
     }
     if (!(++cycle) && o.logchildprocs)
         syslog(LOG_ERR, "Child has handled %d requests and is exiting", o.maxage_children);
+    if (o.logchildprocs)
+        h.logProxyPoolStats();
 #ifdef DGDEBUG
     if (reloadconfig) {
         std::cout << "child been told to exit by hup" << std::endl;
@@ -2202,6 +2243,148 @@ int url_list_listener(bool logconerror)
     return 1; // It is only possible to reach here with an error
 }
 
+#ifdef __SSLMITM
+// sign certificates for new sites on behalf of the children - as requests are
+// handled one at a time, simultaneous requests for the same site only sign once
+int cert_listener(bool logconerror)
+{
+#ifdef DGDEBUG
+    std::cout << "cert listener started" << std::endl;
+#endif
+    if (!drop_priv_completely()) {
+        return 1; //error
+    }
+    o.deleteFilterGroupsJustListData();
+    o.lm.garbageCollect();
+    // that would be us
+    o.ca->setCertGenerator("");
+
+    // hostnames to create certificates for while otherwise idle
+    std::deque<std::string> warmup;
+    if (o.cert_warmup_list.length()) {
+        std::ifstream wfile(o.cert_warmup_list.c_str(), std::ios::in);
+        if (!wfile.good()) {
+            syslog(LOG_ERR, "Unable to read certwarmuplist %s", o.cert_warmup_list.c_str());
+        }
+        std::string line;
+        while (std::getline(wfile, line)) {
+            String host(line);
+            host.removeWhiteSpace();
+            if (host.length() && !host.startsWith("#"))
+                warmup.push_back(host.toCharArray());
+        }
+    }
+
+    UDSocket *ipcpeersock = NULL; // the socket which will contain the ipc connection
+    int rc, ipcsockfd;
+    char *logline = new char[32000];
+    unsigned char *der = NULL;
+    ipcsockfd = certlistsock.getFD();
+
+    fd_set fdSet; // our set of fds (only 1) that select monitors for us
+    fd_set fdcpy; // select modifes the set so we need to use a copy
+    FD_ZERO(&fdSet); // clear the set
+    FD_SET(ipcsockfd, &fdSet); // add ipcsock to the set
+
+    while (true) { // loop, essentially, for ever
+
+        fdcpy = fdSet; // take a copy
+        timeval t; // poll only, while there are certificates to warm up
+        t.tv_sec = 0;
+        t.tv_usec = 0;
+
+        rc = select(ipcsockfd + 1, &fdcpy, NULL, NULL, warmup.empty() ? NULL : &t); // block
+        if (rc < 0) { // was an error
+            if (errno == EINTR) {
+                continue; // was interupted by a signal so restart
+            }
+            if (logconerror) {
+                syslog(LOG_ERR, "%s", "cert ipc rc<0. (Ignorable)");
+            }
+            continue;
+        }
+        if (rc == 0) {
+            // nobody waiting, so create and store the next warm-up certificate
+            std::string host(warmup.front());
+            warmup.pop_front();
+            for (int ec = 0; ec <= (o.ca->hasEcCertKey() ? 1 : 0); ec++) {
+                X509 *cert = NULL;
+                struct ca_serial caser;
+                if (!o.ca->getServerCertificate(host.c_str(), &cert, &caser, ec) && cert != NULL) {
+                    if (!o.ca->writeCertificate(host.c_str(), cert, &caser, ec))
+                        syslog(LOG_ERR, "Couldn't save warm-up certificate for %s", host.c_str());
+                }
+                o.ca->free_ca_serial(&caser);
+                if (cert != NULL)
+                    X509_free(cert);
+            }
+            continue;
+        }
+        if (FD_ISSET(ipcsockfd, &fdcpy)) {
+            ipcpeersock = certlistsock.accept();
+            if (ipcpeersock->getFD() < 0) {
+                delete ipcpeersock;
+                if (logconerror) {
+                    syslog(LOG_ERR, "%s", "Error accepting cert ipc. (Ignorable)");
+                }
+                continue; // if the fd of the new socket < 0 there was error
+                // but we ignore it as its not a problem
+            }
+            try {
+                rc = ipcpeersock->getLine(logline, 32000, 3, true); // throws on err
+            } catch (std::exception &e) {
+                delete ipcpeersock; // close the connection
+                if (logconerror) {
+                    syslog(LOG_ERR, "%s", "Error reading cert ipc. (Ignorable)");
+                    syslog(LOG_ERR, "%s", e.what());
+                }
+                continue;
+            }
+#ifdef DGDEBUG
+            std::cout << "certificate request for " << logline << std::endl;
+#endif
+            // request is the hostname, followed by " ec" for an ECDSA certificate
+            // reply is the DER length on a line of its own, then the DER
+            // a length of 0 tells the child to generate it itself
+            bool ec = false;
+            char *space = strchr(logline, ' ');
+            if (space != NULL) {
+                ec = (strcmp(space, " ec") == 0);
+                *space = '\0';
+            }
+            X509 *cert = o.ca->mintCertificate(logline, ec);
+            int len = 0;
+            der = NULL;
+            if (cert != NULL) {
+                len = i2d_X509(cert, &der);
+                X509_free(cert);
+                if (len < 0)
+                    len = 0;
+            }
+            try {
+                String reply(len);
+                reply += "\n";
+                ipcpeersock->writeString(reply.toCharArray());
+                if (len > 0)
+                    ipcpeersock->writeToSockete((char *)der, len, 0, 6);
+            } catch (std::exception &e) {
+                if (logconerror) {
+                    syslog(LOG_ERR, "%s", "Error writing cert ipc. (Ignorable)");
+                    syslog(LOG_ERR, "%s", e.what());
+                }
+            }
+            if (der != NULL)
+                OPENSSL_free(der);
+            delete ipcpeersock; // close the connection
+            continue; // go back to listening
+        }
+    }
+    delete[] logline;
+    certlistsock.close(); // be nice and neat
+    return 1; // It is only possible to reach here with an error
+}
+#endif
+
 int ip_list_listener(std::string stat_location, bool logconerror)
 {
 #ifdef DGDEBUG
@@ -2414,10 +2597,20 @@ int fc_controlit()
     } else {
         iplistsock.close();
     }
+#ifdef __SSLMITM
+    if (o.cert_generator) {
+        certlistsock.reset();
+    } else {
+        certlistsock.close();
+    }
+#endif
 
     pid_t loggerpid = 0; // to hold the logging process pid
     pid_t urllistpid = 0; // url cache process id
     pid_t iplistpid = 0; // ip cache process id
+#ifdef __SSLMITM
+    pid_t certlistpid = 0; // certificate generator process id
+#endif
 
     if (!o.no_logger) {
         if (loggersock.getFD() < 0) {
@@ -2524,6 +2717,10 @@ int fc_controlit()
     // re-enabled temporarily
     unlink(o.urlipc_filename.c_str());
     unlink(o.ipipc_filename.c_str());
+#ifdef __SSLMITM
+    if (o.cert_generator)
+        unlink(o.certipc_filename.c_str());
+#endif
 
     if (!o.no_logger) {
         if (loggersock.bind(o.ipc_filename.c_str())) { // bind to file
@@ -2569,6 +2766,30 @@ int fc_controlit()
         }
     }
 
+#ifdef __SSLMITM
+    if (o.cert_generator) {
+        if (certlistsock.bind(o.certipc_filename.c_str())) { // bind to file
+            if (!is_daemonised) {
+                std::cerr << "Error binding certlistsock server file (try using the SysV to stop e2guardian then try starting it again or doing an 'rm " << o.certipc_filename << "')." << std::endl;
+            }
+            syslog(LOG_ERR, "Error binding certlistsock server file (try using the SysV to stop e2guardian then try starting it again or doing an 'rm %s').", o.certipc_filename.c_str());
+            close(pidfilefd);
+            free(serversockfds);
+            return 1;
+        }
+        if (certlistsock.listen(256)) { // set it to listen mode with a kernel
+            // queue of 256 backlog connections
+            if (!is_daemonised) {
+                std::cerr << "Error listening to cert ipc server file" << std::endl;
+            }
+            syslog(LOG_ERR, "Error listening to cert ipc server file");
+            close(pidfilefd);
+            free(serversockfds);
+            return 1;
+        }
+    }
+#endif
+
     if (o.max_ips > 0) {
         if (iplistsock.bind(o.ipipc_filename.c_str())) { // bind to file
             if (!is_daemonised) {
@@ -2619,8 +2840,21 @@ int fc_controlit()
     OpenSSL_add_all_algorithms();
     OpenSSL_add_all_digests();
     SSL_library_init();
+
+    // ticket keys & upstream sessions are shared between all children
+    initSslSessionCache(o.ssl_session_cache_size, o.ssl_ticket_key_lifetime);
+    // as are the results of upstream certificate checks
+    initCertVerdictCache(o.cert_check_cache_size, o.cert_check_cache_ttl);
+
+    // build the shared SSL contexts once, children inherit them
+    if (!Socket::initSslContexts(o.ssl_certificate_path, o.set_cipher_list, o.ssl_ktls)) {
+        syslog(LOG_ERR, "Error creating shared SSL contexts - will retry per connection");
+    }
 #endif
 
+    // content scanner results are shared between children too
+    initScanVerdictCache(o.scan_result_cache_size, o.scan_result_cache_ttl);
+
     // this has to be done after daemonise to ensure we get the correct PID.
     rc = sysv_writepidfile(pidfilefd); // also closes the fd
     if (rc != 0) {
@@ -2663,6 +2897,11 @@ int fc_controlit()
             if (o.url_cache_number > 0) {
                 urllistsock.close(); // we don't need our copy of this so close it
             }
+#ifdef __SSLMITM
+            if (o.cert_generator) {
+                certlistsock.close(); // we don't need our copy of this so close it
+            }
+#endif
             if ((log_listener(o.log_location, o.logconerror, o.log_syslog)) > 0) {
                 syslog(LOG_ERR, "Error starting log listener");
             }
@@ -2685,6 +2924,11 @@ int fc_controlit()
             if (o.max_ips > 0) {
                 iplistsock.close();
             }
+#ifdef __SSLMITM
+            if (o.cert_generator) {
+                certlistsock.close(); // we don't need our copy of this so close it
+            }
+#endif
             if ((url_list_listener(o.logconerror)) > 0) {
                 syslog(LOG_ERR, "Error starting url list listener");
             }
@@ -2707,6 +2951,11 @@ int fc_controlit()
             if (o.url_cache_number > 0) {
                 urllistsock.close(); // we don't need our copy of this so close it
             }
+#ifdef __SSLMITM
+            if (o.cert_generator) {
+                certlistsock.close(); // we don't need our copy of this so close it
+            }
+#endif
             if ((ip_list_listener(o.stat_location, o.logconerror)) > 0) {
                 syslog(LOG_ERR, "Error starting ip list listener");
             }
@@ -2717,6 +2966,33 @@ int fc_controlit()
         }
     }
 
+#ifdef __SSLMITM
+    // and for the certificate generator
+    if (o.cert_generator) {
+        certlistpid = fork();
+        if (certlistpid == 0) { // ma ma!  i am the child
+            serversockets.deleteAll(); // we don't need our copy of this so close it
+            free(serversockfds);
+            if (!o.no_logger) {
+                loggersock.close(); // we don't need our copy of this so close it
+            }
+            if (o.url_cache_number > 0) {
+                urllistsock.close(); // we don't need our copy of this so close it
+            }
+            if (o.max_ips > 0) {
+                iplistsock.close();
+            }
+            if ((cert_listener(o.logconerror)) > 0) {
+                syslog(LOG_ERR, "Error starting certificate generator");
+            }
+#ifdef DGDEBUG
+            std::cout << "Certificate generator exiting" << std::endl;
+#endif
+            _exit(0); // is reccomended for child and daemons to use this instead
+        }
+    }
+#endif
+
 // I am the parent process here onwards.
 
 #ifdef DGDEBUG
@@ -2732,6 +3008,11 @@ int fc_controlit()
     if (o.max_ips > 0) {
         iplistsock.close();
     }
+#ifdef __SSLMITM
+    if (o.cert_generator) {
+        certlistsock.close();
+    }
+#endif
 
     memset(&sa, 0, sizeof(sa));
     if (!o.soft_restart) {
@@ -2943,6 +3224,8 @@ int fc_controlit()
                         reloadconfig = true; // content scan plugs problem
 	                gentlereload = false; // this is no longer a gentle reload -CN
                     }
+                    // children with the new plugins don't use results from the old ones
+                    initScanVerdictCache(o.scan_result_cache_size, o.scan_result_cache_ttl);
                     if (!reloadconfig) {
                         o.deletePlugins(o.authplugins);
                         if (!o.loadAuthPlugins()) {
@@ -3255,6 +3538,9 @@ int fc_controlit()
         }
         if (o.dstat_log_flag && (now >= dystat->end_int))
             dystat->reset();
+#ifdef __SSLMITM
+        rotateSslTicketKey(now);
+#endif
     }
     if (o.monitor_helper_flag)
         tell_monitor(false); // tell monitor that we are not accepting any more connections
@@ -3367,6 +3653,10 @@ int fc_controlit()
             ::kill(urllistpid, SIGTERM); // get rid of url cache
         if (o.max_ips > 0)
             ::kill(iplistpid, SIGTERM); // get rid of iplist
+#ifdef __SSLMITM
+        if (o.cert_generator)
+            ::kill(certlistpid, SIGTERM); // get rid of certificate generator
+#endif
         return reloadconfig ? 2 : 0;
     }
     if (o.logconerror) {
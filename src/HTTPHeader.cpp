@@ -452,8 +452,9 @@ void HTTPHeader::makeTransparent(bool incoming)
 String HTTPHeader::modifyEncodings(String e)
 {
 
-    // There are 4 types of encoding: gzip, deflate, compress and identity
+    // There are 5 types of encoding: gzip, deflate, br, compress and identity
     // deflate is in zlib format
+    // br is brotli, supported only if built with libbrotlidec
     // compress is in unix compress format
     // identity is uncompressed and supported by all browsers (obviously)
     // we do not support compress
@@ -470,6 +471,11 @@ String HTTPHeader::modifyEncodings(String e)
     if (e.contains("deflate")) {
         o += ",deflate";
     }
+#ifdef HAVE_BROTLI
+    if (e.contains("br")) {
+        o += ",br";
+    }
+#endif
 
     if (e.contains("pack200-gzip")) {
         o += ",pack200-gzip";
@@ -7,22 +7,11 @@
 
 // INCLUDES
 
-#include <list>
+#include "IPPrefixTree.hpp"
 
 // DECLARATIONS
 
-// convenience structs for subnets and IP ranges
-struct ipl_subnetstruct {
-    uint32_t maskedaddr;
-    uint32_t mask;
-};
-
-struct ipl_rangestruct {
-    uint32_t startaddr;
-    uint32_t endaddr;
-};
-
-// IP subnet/range/mask & hostname list
+// IP, subnet, range & hostname list
 class IPList
 {
     public:
@@ -32,10 +21,9 @@ class IPList
     bool readIPMelangeList(const char *filename);
 
     private:
-    std::vector<uint32_t> iplist;
+    // IPv4 & IPv6 addresses, subnets and ranges
+    IPPrefixTree iptree;
     std::vector<String> hostlist;
-    std::list<ipl_rangestruct> iprangelist;
-    std::list<ipl_subnetstruct> ipsubnetlist;
 };
 
 #endif
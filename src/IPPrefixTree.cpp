@@ -0,0 +1,320 @@
+// IPPrefixTree - longest prefix match of IPv4 & IPv6 addresses against lists
+// of IPs, subnets and ranges, as used by the IP lists and the IP auth plugin.
+
+// For all support, instructions and copyright go to:
+// http://e2guardian.org/
+// Released under the GPL v2, with the OpenSSL exception described in the README file.
+
+// INCLUDES
+
+#ifdef HAVE_CONFIG_H
+#include "dgconfig.h"
+#endif
+
+#include "IPPrefixTree.hpp"
+
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// DEFINES
+
+#define IPV4_MAPPED 0xffff00000000ULL // ::ffff:0.0.0.0, the low half of an IPv4-mapped address
+#define IPV4_PREFIX 96 // prefix length of an IPv4-mapped address with IPv4 prefix length 0
+
+// IMPLEMENTATION
+
+// bit i of an address, counting from the most significant
+static inline int bitAt(const ip_address &a, int i)
+{
+    if (i < 64)
+        return (a.hi >> (63 - i)) & 1;
+    return (a.lo >> (127 - i)) & 1;
+}
+
+// an address with all but the first len bits cleared
+static ip_address maskAddress(ip_address a, int len)
+{
+    if (len <= 0) {
+        a.hi = 0;
+        a.lo = 0;
+    } else if (len < 64) {
+        a.hi &= ~0ULL << (64 - len);
+        a.lo = 0;
+    } else if (len == 64) {
+        a.lo = 0;
+    } else if (len < 128) {
+        a.lo &= ~0ULL << (128 - len);
+    }
+    return a;
+}
+
+// an address with just the last len bits set
+static ip_address lowBits(int len)
+{
+    ip_address a;
+    if (len <= 0) {
+        a.hi = 0;
+        a.lo = 0;
+    } else if (len < 64) {
+        a.hi = 0;
+        a.lo = (1ULL << len) - 1;
+    } else if (len == 64) {
+        a.hi = 0;
+        a.lo = ~0ULL;
+    } else if (len < 128) {
+        a.hi = (1ULL << (len - 64)) - 1;
+        a.lo = ~0ULL;
+    } else {
+        a.hi = ~0ULL;
+        a.lo = ~0ULL;
+    }
+    return a;
+}
+
+// number of leading bits two addresses have in common
+static int commonLength(const ip_address &a, const ip_address &b)
+{
+    uint64_t x = a.hi ^ b.hi;
+    if (x)
+        return __builtin_clzll(x);
+    x = a.lo ^ b.lo;
+    if (x)
+        return 64 + __builtin_clzll(x);
+    return 128;
+}
+
+static int trailingZeros(const ip_address &a)
+{
+    if (a.lo)
+        return __builtin_ctzll(a.lo);
+    if (a.hi)
+        return 64 + __builtin_ctzll(a.hi);
+    return 128;
+}
+
+static bool lessThan(const ip_address &a, const ip_address &b)
+{
+    return a.hi < b.hi || (a.hi == b.hi && a.lo < b.lo);
+}
+
+static bool isIPv4(const ip_address &a)
+{
+    return a.hi == 0 && (a.lo & ~0xffffffffULL) == IPV4_MAPPED;
+}
+
+IPPrefixTree::IPPrefixTree()
+    : root(-1), prefixes(0)
+{
+}
+
+void IPPrefixTree::reset()
+{
+    nodes.clear();
+    root = -1;
+    prefixes = 0;
+}
+
+int IPPrefixTree::newNode(const ip_address &prefix, int len, int value)
+{
+    node n;
+    n.prefix = prefix;
+    n.len = len;
+    n.value = value;
+    n.child[0] = -1;
+    n.child[1] = -1;
+    nodes.push_back(n);
+    if (value >= 0)
+        prefixes++;
+    return nodes.size() - 1;
+}
+
+void IPPrefixTree::addPrefix(ip_address addr, int prefixlen, int value)
+{
+    if (prefixlen < 0 || prefixlen > 128 || value < 0)
+        return;
+    addr = maskAddress(addr, prefixlen);
+
+    // walk down as far as the existing prefixes agree with the new one
+    int parent = -1;
+    int side = 0;
+    int i = root;
+    int n;
+    while (true) {
+        if (i < 0) {
+            n = newNode(addr, prefixlen, value);
+            break;
+        }
+        int common = commonLength(nodes[i].prefix, addr);
+        if (common > nodes[i].len)
+            common = nodes[i].len;
+        if (common > prefixlen)
+            common = prefixlen;
+        if (common == nodes[i].len) {
+            if (prefixlen == nodes[i].len) {
+                // already here - first one given wins
+                if (nodes[i].value < 0) {
+                    nodes[i].value = value;
+                    prefixes++;
+                }
+                return;
+            }
+            parent = i;
+            side = bitAt(addr, nodes[i].len);
+            i = nodes[i].child[side];
+            continue;
+        }
+        // the new prefix parts company with node i part way along it
+        if (common == prefixlen) {
+            // ... and contains it
+            n = newNode(addr, prefixlen, value);
+            nodes[n].child[bitAt(nodes[i].prefix, prefixlen)] = i;
+        } else {
+            // ... and is beside it, so join the two under their common prefix
+            n = newNode(maskAddress(addr, common), common, -1);
+            int leaf = newNode(addr, prefixlen, value);
+            nodes[n].child[bitAt(addr, common)] = leaf;
+            nodes[n].child[bitAt(nodes[i].prefix, common)] = i;
+        }
+        break;
+    }
+    if (parent < 0)
+        root = n;
+    else
+        nodes[parent].child[side] = n;
+}
+
+// split the range into the fewest prefixes covering exactly it
+void IPPrefixTree::addRange(ip_address start, ip_address end, int value)
+{
+    if (lessThan(end, start))
+        return;
+    while (true) {
+        int hostbits = trailingZeros(start);
+        ip_address last;
+        while (true) {
+            ip_address m = lowBits(hostbits);
+            last.hi = start.hi | m.hi;
+            last.lo = start.lo | m.lo;
+            if (!lessThan(end, last))
+                break;
+            hostbits--;
+        }
+        addPrefix(start, 128 - hostbits, value);
+        if (last.hi == end.hi && last.lo == end.lo)
+            break;
+        start = last;
+        if (++start.lo == 0)
+            start.hi++;
+    }
+}
+
+int IPPrefixTree::find(const ip_address &addr) const
+{
+    int best = -1;
+    int i = root;
+    while (i >= 0) {
+        const node &n = nodes[i];
+        if (commonLength(n.prefix, addr) < n.len)
+            break;
+        if (n.value >= 0)
+            best = n.value;
+        if (n.len == 128)
+            break;
+        i = n.child[bitAt(addr, n.len)];
+    }
+    return best;
+}
+
+int IPPrefixTree::find(const std::string &addr) const
+{
+    ip_address a;
+    if (root < 0 || !parseAddress(addr, a))
+        return -1;
+    return find(a);
+}
+
+bool IPPrefixTree::parseAddress(const std::string &text, ip_address &addr)
+{
+    if (text.find(':') != std::string::npos) {
+        struct in6_addr a6;
+        if (inet_pton(AF_INET6, text.c_str(), &a6) != 1)
+            return false;
+        addr.hi = 0;
+        addr.lo = 0;
+        for (int i = 0; i < 8; i++) {
+            addr.hi = (addr.hi << 8) | a6.s6_addr[i];
+            addr.lo = (addr.lo << 8) | a6.s6_addr[i + 8];
+        }
+        return true;
+    }
+
+    // dotted quads only - inet_aton would take "10" as 0.0.0.10
+    int dots = 0;
+    for (std::string::const_iterator c = text.begin(); c != text.end(); ++c) {
+        if (*c == '.')
+            dots++;
+        else if (*c < '0' || *c > '9')
+            return false;
+    }
+    struct in_addr a4;
+    if (dots != 3 || !inet_aton(text.c_str(), &a4))
+        return false;
+    addr.hi = 0;
+    addr.lo = IPV4_MAPPED | ntohl(a4.s_addr);
+    return true;
+}
+
+int IPPrefixTree::addEntry(const std::string &entry, int value)
+{
+    ip_address addr;
+    std::string::size_type sep;
+
+    if ((sep = entry.find('/')) != std::string::npos) {
+        // subnet
+        if (!parseAddress(entry.substr(0, sep), addr))
+            return 0;
+        std::string mask(entry.substr(sep + 1));
+        int len;
+        if (mask.find('.') != std::string::npos) {
+            // IPv4 dotted mask, which must be contiguous
+            ip_address m;
+            if (!isIPv4(addr) || !parseAddress(mask, m))
+                return -1;
+            uint32_t inv = ~(uint32_t)m.lo;
+            if (inv & (inv + 1))
+                return -1;
+            len = IPV4_PREFIX + __builtin_popcount((uint32_t)m.lo);
+        } else {
+            if (mask.empty() || mask.length() > 3 || mask.find_first_not_of("0123456789") != std::string::npos)
+                return -1;
+            len = atoi(mask.c_str());
+            if (isIPv4(addr)) {
+                if (len > 32)
+                    return -1;
+                len += IPV4_PREFIX;
+            } else if (len > 128) {
+                return -1;
+            }
+        }
+        addPrefix(addr, len, value);
+        return 1;
+    }
+
+    if ((sep = entry.find('-')) != std::string::npos) {
+        // range
+        ip_address end;
+        if (!parseAddress(entry.substr(0, sep), addr))
+            return 0;
+        if (!parseAddress(entry.substr(sep + 1), end) || isIPv4(addr) != isIPv4(end))
+            return -1;
+        addRange(addr, end, value);
+        return 1;
+    }
+
+    if (!parseAddress(entry, addr))
+        return 0;
+    addPrefix(addr, 128, value);
+    return 1;
+}
@@ -0,0 +1,74 @@
+// IPPrefixTree - longest prefix match of IPv4 & IPv6 addresses against lists
+// of IPs, subnets and ranges, as used by the IP lists and the IP auth plugin.
+
+// For all support, instructions and copyright go to:
+// http://e2guardian.org/
+// Released under the GPL v2, with the OpenSSL exception described in the README file.
+
+#ifndef __HPP_IPPREFIXTREE
+#define __HPP_IPPREFIXTREE
+
+// INCLUDES
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// DECLARATIONS
+
+// an IPv6 address, most significant bits first.  IPv4 addresses are held
+// IPv4-mapped (::ffff:a.b.c.d), so that both live in the one tree
+struct ip_address {
+    uint64_t hi;
+    uint64_t lo;
+};
+
+// path-compressed binary trie (Patricia tree) of address prefixes, each with
+// a value.  a lookup walks at most one node per distinct prefix length along
+// the address, however many entries there are.  ranges are stored as the
+// prefixes which make them up
+class IPPrefixTree
+{
+    public:
+    IPPrefixTree();
+
+    void reset();
+
+    // add an entry from a list file: an IPv4 or IPv6 address, subnet
+    // (address/prefix length, or IPv4 address/dotted mask) or range
+    // (address-address).  returns 1 if added, 0 if the entry isn't an address
+    // at all (e.g. a hostname), -1 if it is but isn't valid.  where the same
+    // prefix is given more than once, the first value is kept
+    int addEntry(const std::string &entry, int value);
+
+    void addPrefix(ip_address addr, int prefixlen, int value);
+    void addRange(ip_address start, ip_address end, int value);
+
+    // value of the most specific entry containing the address, or -1
+    int find(const ip_address &addr) const;
+    int find(const std::string &addr) const;
+
+    // number of prefixes held
+    size_t size() const
+    {
+        return prefixes;
+    };
+
+    // parse a textual IPv4 or IPv6 address
+    static bool parseAddress(const std::string &text, ip_address &addr);
+
+    private:
+    struct node {
+        ip_address prefix;
+        int len;
+        int value; // -1 if this node only joins its children
+        int child[2];
+    };
+    std::vector<node> nodes;
+    int root; // -1 while empty
+    size_t prefixes;
+
+    int newNode(const ip_address &prefix, int len, int value);
+};
+
+#endif
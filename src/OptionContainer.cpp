@@ -10,6 +10,7 @@
 #include "OptionContainer.hpp"
 #include "RegExp.hpp"
 #include "ConfigVar.hpp"
+#include "FDFuncs.hpp"
 
 #include <iostream>
 #include <fstream>
@@ -29,8 +30,11 @@ ListContainer total_block_url_list;
 // IMPLEMENTATION
 
 OptionContainer::OptionContainer()
-    : use_filter_groups_list(false), auth_needs_proxy_query(false), prefer_cached_lists(false), no_daemon(false), no_logger(false), log_syslog(false), anonymise_logs(false), log_ad_blocks(false), log_timestamp(false), log_user_agent(false), soft_restart(false), delete_downloaded_temp_files(false), max_logitem_length(2000), max_content_filter_size(0), max_content_ramcache_scan_size(0), max_content_filecache_scan_size(0), scan_clean_cache(0), content_scan_exceptions(0), initial_trickle_delay(0), trickle_delay(0), content_scanner_timeout(0), reporting_level(0), weighted_phrase_mode(0), numfg(0), dstat_log_flag(false), dstat_interval(300), fg(NULL)
+    : use_filter_groups_list(false), auth_needs_proxy_query(false), prefer_cached_lists(false), no_daemon(false), no_logger(false), log_syslog(false), anonymise_logs(false), log_ad_blocks(false), log_timestamp(false), log_user_agent(false), soft_restart(false), delete_downloaded_temp_files(false), max_logitem_length(2000), max_content_filter_size(0), max_content_ramcache_scan_size(0), max_content_filecache_scan_size(0), scan_clean_cache(0), content_scan_exceptions(0), temp_file_mode(0), initial_trickle_delay(0), trickle_delay(0), content_scanner_timeout(0), content_scanner_timeout_per_mb(0), interactive_scan_size(0), scan_result_cache_size(0), parallel_scan(false), log_scan_times(false), scan_result_cache_ttl(0), reporting_level(0), weighted_phrase_mode(0), numfg(0), dstat_log_flag(false), dstat_interval(300), fg(NULL)
 {
+#ifdef __SSLMITM
+    ca = NULL;
+#endif
 }
 
 OptionContainer::~OptionContainer()
@@ -55,6 +59,10 @@ void OptionContainer::reset()
     filter_ip.clear();
     filter_ports.clear();
     auth_map.clear();
+#ifdef __SSLMITM
+    delete ca;
+    ca = NULL;
+#endif
 }
 
 void OptionContainer::deleteFilterGroups()
@@ -136,6 +144,9 @@ bool OptionContainer::read(const char *filename, int type)
 			if ((ipipc_filename = findoptionS("ipipcfilename")) == "")
 				ipipc_filename = "/tmp/.e2guardianipipc";
 
+			if ((certipc_filename = findoptionS("certipcfilename")) == "")
+				certipc_filename = "/tmp/.e2guardiancertipc";
+
 			if ((pid_filename = findoptionS("pidfilename")) == "") {
 				pid_filename = __PIDDIR;
 				pid_filename += "/e2guardian.pid";
@@ -206,6 +217,41 @@ bool OptionContainer::read(const char *filename, int type)
         if (ssl_certificate_path == "/") {
             ssl_certificate_path = ""; // "" will enable default openssl certs
         }
+
+        if (findoptionS("sslsessioncachesize") == "")
+            ssl_session_cache_size = 512;
+        else
+            ssl_session_cache_size = findoptionI("sslsessioncachesize");
+        if (!realitycheck(ssl_session_cache_size, 0, 65536, "sslsessioncachesize")) {
+            return false;
+        }
+
+        if (findoptionS("sslticketkeylifetime") == "")
+            ssl_ticket_key_lifetime = 3600;
+        else
+            ssl_ticket_key_lifetime = findoptionI("sslticketkeylifetime");
+        if (!realitycheck(ssl_ticket_key_lifetime, 0, 86400, "sslticketkeylifetime")) {
+            return false;
+        }
+
+        ssl_ktls = (findoptionS("sslktls") == "on");
+        ssl_ocsp_staple = (findoptionS("sslocspstaple") != "off");
+
+        if (findoptionS("certcheckcachesize") == "")
+            cert_check_cache_size = 1024;
+        else
+            cert_check_cache_size = findoptionI("certcheckcachesize");
+        if (!realitycheck(cert_check_cache_size, 0, 65536, "certcheckcachesize")) {
+            return false;
+        }
+
+        if (findoptionS("certcheckcachettl") == "")
+            cert_check_cache_ttl = 300;
+        else
+            cert_check_cache_ttl = findoptionI("certcheckcachettl");
+        if (!realitycheck(cert_check_cache_ttl, 0, 86400, "certcheckcachettl")) {
+            return false;
+        }
 #endif
 
 #ifdef __SSLMITM
@@ -225,6 +271,9 @@ bool OptionContainer::read(const char *filename, int type)
             //cert_private_key_path = __CONFDIR "/certs.key";
         }
 
+        // optional - also forge ECDSA certificates for clients that support them
+        ec_cert_private_key_path = findoptionS("eccertprivatekeypath");
+
         generated_cert_path = findoptionS("generatedcertpath") + "/";
         if (generated_cert_path == "/") {
             //generated_cert_path = "/etc/ssl/certs/";
@@ -244,14 +293,44 @@ bool OptionContainer::read(const char *filename, int type)
         if (set_cipher_list == "")
             set_cipher_list = "HIGH:!ADH:!MD5:!RC4:!SRP:!PSK:!DSS";
 
+        if (findoptionS("certcachesize") == "")
+            cert_cache_size = 256;
+        else
+            cert_cache_size = findoptionI("certcachesize");
+        if (!realitycheck(cert_cache_size, 0, 65536, "certcachesize")) {
+            return false;
+        }
+
+        if (findoptionS("sharedcertcachesize") == "")
+            shared_cert_cache_size = 2048;
+        else
+            shared_cert_cache_size = findoptionI("sharedcertcachesize");
+        if (!realitycheck(shared_cert_cache_size, 0, 1048576, "sharedcertcachesize")) {
+            return false;
+        }
+
         if (ca_certificate_path != "") {
             ca = new CertificateAuthority(ca_certificate_path.c_str(),
                 ca_private_key_path.c_str(),
                 cert_private_key_path.c_str(),
                 generated_cert_path.c_str(),
-                gen_cert_start, gen_cert_end);
+                gen_cert_start, gen_cert_end,
+                cert_cache_size, shared_cert_cache_size);
+            if (ec_cert_private_key_path != "" && !ca->setEcCertKey(ec_cert_private_key_path.c_str())) {
+                if (!is_daemonised) {
+                    std::cerr << "Error - Could not load or create eccertprivatekeypath " << ec_cert_private_key_path << std::endl;
+                }
+                syslog(LOG_ERR, "Error - Could not load or create eccertprivatekeypath %s", ec_cert_private_key_path.c_str());
+                return false;
+            }
         }
 
+        // certificates for new sites are signed by a dedicated process
+        cert_generator = (ca != NULL) && (findoptionS("certgenerator") == "on");
+        cert_warmup_list = findoptionS("certwarmuplist");
+        if (cert_generator)
+            ca->setCertGenerator(certipc_filename);
+
 #endif
 
 #ifdef ENABLE_EMAIL
@@ -287,6 +366,18 @@ bool OptionContainer::read(const char *filename, int type)
             return false;
         } // check its a reasonable value
 
+        proxy_pool_size = findoptionI("proxypoolsize");
+        if (!realitycheck(proxy_pool_size, 0, 64, "proxypoolsize")) {
+            return false;
+        } // check its a reasonable value
+
+        proxy_pool_idle = findoptionI("proxypoolidle");
+        if (proxy_pool_idle == 0)
+            proxy_pool_idle = pcon_timeout;
+        if (!realitycheck(proxy_pool_idle, 1, 300, "proxypoolidle")) {
+            return false;
+        } // check its a reasonable value
+
         exchange_timeout = findoptionI("proxyexchange");
         if (!realitycheck(exchange_timeout, 5, 300, "proxyexchange")) {
             return false;
@@ -414,6 +505,20 @@ bool OptionContainer::read(const char *filename, int type)
                 return false;
             }
 
+            content_scanner_timeout_per_mb = findoptionI("contentscannertimeoutpermb");
+            if (!realitycheck(content_scanner_timeout_per_mb, 0, 3600, "contentscannertimeoutpermb")) {
+                return false;
+            }
+
+            if (findoptionS("interactivescansize") == "")
+                interactive_scan_size = 256;
+            else
+                interactive_scan_size = findoptionI("interactivescansize");
+            if (!realitycheck(interactive_scan_size, 0, 0, "interactivescansize")) {
+                return false;
+            }
+            interactive_scan_size *= 1024;
+
             if (findoptionS("scancleancache") == "off") {
                 scan_clean_cache = false;
             } else {
@@ -425,6 +530,25 @@ bool OptionContainer::read(const char *filename, int type)
             } else {
                 content_scan_exceptions = false;
             }
+
+            parallel_scan = (findoptionS("parallelscan") == "on");
+            log_scan_times = (findoptionS("logscantimes") == "on");
+
+            if (findoptionS("scanresultcachesize") == "")
+                scan_result_cache_size = 4096;
+            else
+                scan_result_cache_size = findoptionI("scanresultcachesize");
+            if (!realitycheck(scan_result_cache_size, 0, 1048576, "scanresultcachesize")) {
+                return false;
+            }
+
+            if (findoptionS("scanresultcachettl") == "")
+                scan_result_cache_ttl = 3600;
+            else
+                scan_result_cache_ttl = findoptionI("scanresultcachettl");
+            if (!realitycheck(scan_result_cache_ttl, 0, 604800, "scanresultcachettl")) {
+                return false;
+            }
         }
 
         if (findoptionS("deletedownloadedtempfiles") == "off") {
@@ -675,6 +799,24 @@ bool OptionContainer::read(const char *filename, int type)
         // because ClamAV plugin makes use of it during init()
         download_dir = findoptionS("filecachedir");
 
+        // how temp files for spilled content are created
+        {
+            std::string temp_mode(findoptionS("tempfilemode"));
+            if (temp_mode == "tmpfile") {
+                temp_file_mode = DG_TEMPFILE_TMPFILE;
+            } else if (temp_mode == "memfd") {
+                temp_file_mode = DG_TEMPFILE_MEMFD;
+            } else if ((temp_mode == "") || (temp_mode == "named")) {
+                temp_file_mode = DG_TEMPFILE_NAMED;
+            } else {
+                if (!is_daemonised) {
+                    std::cerr << "Invalid tempfilemode: " << temp_mode << std::endl;
+                }
+                syslog(LOG_ERR, "Invalid tempfilemode: %s", temp_mode.c_str());
+                return false;
+            }
+        }
+
         if (contentscanning) {
             if (!loadCSPlugins()) {
                 if (!is_daemonised) {
@@ -821,7 +963,8 @@ bool OptionContainer::read(const char *filename, int type)
                     ca_private_key_path.c_str(),
                     cert_private_key_path.c_str(),
                     generated_cert_path.c_str(),
-                    gen_cert_start, gen_cert_end);
+                    gen_cert_start, gen_cert_end,
+                    cert_cache_size, shared_cert_cache_size);
             } else {
                 if (!is_daemonised) {
                     std::cerr << "Error - Valid cacertificatepath, caprivatekeypath and generatedcertpath must given when using MITM." << std::endl;
@@ -1481,6 +1624,7 @@ bool OptionContainer::loadAuthPlugins()
     // Assume no auth plugins need an upstream proxy query (NTLM, BASIC) until told otherwise
     auth_needs_proxy_query = false;
 
+    bool conn_auth = false;
     std::deque<String> dq = findoptionM("authplugin");
     unsigned int numplugins = dq.size();
     if (numplugins < 1) {
@@ -1518,6 +1662,8 @@ bool OptionContainer::loadAuthPlugins()
             syslog(LOG_ERR, "Auth plugin init returned warning value: %d", rc);
         }
 
+        if (app->is_connection_based)
+            conn_auth = true;
         if (app->needs_proxy_query) {
             auth_needs_proxy_query = true;
 #ifdef DGDEBUG
@@ -1529,5 +1675,11 @@ bool OptionContainer::loadAuthPlugins()
     // cache reusable iterators
     authplugins_begin = authplugins.begin();
     authplugins_end = authplugins.end();
+
+    // a proxy connection another client has authenticated mustn't be pooled
+    if (proxy_pool_size > 0 && (auth_needs_proxy_query || conn_auth)) {
+        syslog(LOG_INFO, "proxypoolsize ignored: not pooling proxy connections with proxy or connection-based auth plugins loaded");
+        proxy_pool_size = 0;
+    }
     return true;
 }
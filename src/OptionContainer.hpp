@@ -21,6 +21,7 @@
 #include "IPList.hpp"
 
 #include <deque>
+#include <list>
 
 #ifdef __SSLMITM
 #include "CertificateAuthority.hpp"
@@ -85,6 +86,8 @@ class OptionContainer
     int proxy_failure_log_interval;
     int exchange_timeout;
     int pcon_timeout;
+    int proxy_pool_size;
+    int proxy_pool_idle;
     int min_children;
     int maxspare_children;
     int prefork_children;
@@ -111,6 +114,7 @@ class OptionContainer
     std::string ipc_filename;
     std::string urlipc_filename;
     std::string ipipc_filename;
+    std::string certipc_filename;
     std::string pid_filename;
     std::string blocked_content_store;
     std::string monitor_helper;
@@ -144,14 +148,25 @@ class OptionContainer
 
 #ifdef __SSLMITM
     std::string ssl_certificate_path;
+    int ssl_session_cache_size;
+    int ssl_ticket_key_lifetime;
+    bool ssl_ktls;
+    bool ssl_ocsp_staple;
+    int cert_check_cache_size;
+    int cert_check_cache_ttl;
 #endif
 
 #ifdef __SSLMITM
     std::string ca_certificate_path;
     std::string ca_private_key_path;
     std::string cert_private_key_path;
+    std::string ec_cert_private_key_path;
     std::string generated_cert_path;
     std::string generated_link_path;
+    int cert_cache_size;
+    int shared_cert_cache_size;
+    bool cert_generator;
+    std::string cert_warmup_list;
     CertificateAuthority *ca;
 #endif
     std::string set_cipher_list;
@@ -170,9 +185,16 @@ class OptionContainer
     bool content_scan_exceptions;
     bool delete_downloaded_temp_files;
     std::string download_dir;
+    int temp_file_mode;
     int initial_trickle_delay;
     int trickle_delay;
     int content_scanner_timeout;
+    int content_scanner_timeout_per_mb;
+    off_t interactive_scan_size;
+    int scan_result_cache_size;
+    bool parallel_scan;
+    bool log_scan_times;
+    int scan_result_cache_ttl;
 
     HTMLTemplate html_template;
     ListContainer filter_groups_list;
@@ -0,0 +1,143 @@
+// ProxyPool - per-child pool of idle persistent connections to the parent proxy
+
+// For all support, instructions and copyright go to:
+// http://e2guardian.org/
+// Released under the GPL v2, with the OpenSSL exception described in the README file.
+
+// INCLUDES
+
+#ifdef HAVE_CONFIG_H
+#include "dgconfig.h"
+#endif
+
+#include <syslog.h>
+#include <unistd.h>
+#include <cerrno>
+#include <sys/poll.h>
+
+#ifdef DGDEBUG
+#include <iostream>
+#endif
+
+#include "ProxyPool.hpp"
+#include "OptionContainer.hpp"
+
+// GLOBALS
+
+extern OptionContainer o;
+
+// IMPLEMENTATION
+
+ProxyPool::ProxyPool()
+    : hits(0), misses(0), stale(0), expired(0), parked(0), overflows(0)
+{
+}
+
+ProxyPool::~ProxyPool()
+{
+    reset();
+}
+
+void ProxyPool::reset()
+{
+    while (!idle.empty()) {
+        ::close(idle.back().fd);
+        idle.pop_back();
+    }
+}
+
+void ProxyPool::expire(time_t now)
+{
+    while (!idle.empty() && (now - idle.front().idle_since) >= o.proxy_pool_idle) {
+        ::close(idle.front().fd);
+        idle.pop_front();
+        ++expired;
+    }
+}
+
+bool ProxyPool::get(Socket &sock)
+{
+    if (o.proxy_pool_size < 1)
+        return false;
+
+    expire(time(NULL));
+
+    while (!idle.empty()) {
+        PooledConnection pc = idle.back();
+        idle.pop_back();
+
+        // an idle connection should have nothing to say - if it is readable
+        // then the proxy has either closed it or sent something unsolicited
+        struct pollfd pfd;
+        pfd.fd = pc.fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        int rc;
+        while ((rc = poll(&pfd, 1, 0)) < 0 && errno == EINTR)
+            ;
+        if (rc != 0) {
+#ifdef DGDEBUG
+            std::cout << "ProxyPool: discarding stale connection fd " << pc.fd << std::endl;
+#endif
+            ::close(pc.fd);
+            ++stale;
+            continue;
+        }
+
+#ifdef DGDEBUG
+        std::cout << "ProxyPool: reusing connection fd " << pc.fd << " idle for " << (time(NULL) - pc.idle_since) << "s" << std::endl;
+#endif
+        sock.adoptFD(pc.fd);
+        ++hits;
+        return true;
+    }
+
+    ++misses;
+    return false;
+}
+
+void ProxyPool::put(Socket &sock)
+{
+    if (o.proxy_pool_size < 1 || sock.getFD() < 0) {
+        sock.close();
+        return;
+    }
+#ifdef __SSLMITM
+    if (sock.isSsl()) {
+        sock.close();
+        return;
+    }
+#endif
+    // left over data means we lost track of the proxy's side of the exchange
+    if (sock.checkForInput()) {
+        sock.close();
+        ++stale;
+        return;
+    }
+
+    time_t now = time(NULL);
+    expire(now);
+    if ((int)idle.size() >= o.proxy_pool_size) {
+        // keep the most recently used connections
+        ::close(idle.front().fd);
+        idle.pop_front();
+        ++overflows;
+    }
+
+    PooledConnection pc;
+    pc.fd = sock.releaseFD();
+    pc.idle_since = now;
+    idle.push_back(pc);
+    ++parked;
+#ifdef DGDEBUG
+    std::cout << "ProxyPool: parked connection fd " << pc.fd << " (" << idle.size() << " idle)" << std::endl;
+#endif
+}
+
+void ProxyPool::logStats()
+{
+    if (o.proxy_pool_size < 1)
+        return;
+    syslog(LOG_INFO, "Proxy connection pool: %lu hits, %lu misses, %lu stale, %lu expired, %lu parked, %lu overflows",
+        hits, misses, stale, expired, parked, overflows);
+}
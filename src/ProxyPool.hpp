@@ -0,0 +1,61 @@
+// ProxyPool - per-child pool of idle persistent connections to the parent proxy
+
+// For all support, instructions and copyright go to:
+// http://e2guardian.org/
+// Released under the GPL v2, with the OpenSSL exception described in the README file.
+
+#ifndef __HPP_PROXYPOOL
+#define __HPP_PROXYPOOL
+
+// INCLUDES
+
+#include <deque>
+#include <ctime>
+
+#include "Socket.hpp"
+
+// DECLARATIONS
+
+// keeps connections to the proxy open once a client has finished with them,
+// so that the next client handled by this child can skip the TCP handshake
+class ProxyPool
+{
+    public:
+    // counters, logged when the child exits
+    unsigned long hits; // requests served from a pooled connection
+    unsigned long misses; // pool empty, had to connect
+    unsigned long stale; // pooled connections found closed or readable
+    unsigned long expired; // pooled connections idle for too long
+    unsigned long parked; // connections returned to the pool
+    unsigned long overflows; // connections closed because the pool was full
+
+    ProxyPool();
+    ~ProxyPool();
+
+    // hand a healthy idle connection over to sock
+    // returns false (leaving sock alone) if there is none
+    bool get(Socket &sock);
+
+    // park sock's connection for reuse - sock is left closed either way
+    void put(Socket &sock);
+
+    // close all idle connections
+    void reset();
+
+    // write the counters to syslog
+    void logStats();
+
+    private:
+    struct PooledConnection {
+        int fd;
+        time_t idle_since;
+    };
+
+    // most recently parked connections are at the back
+    std::deque<PooledConnection> idle;
+
+    // close pooled connections which have been idle for too long
+    void expire(time_t now);
+};
+
+#endif
@@ -0,0 +1,322 @@
+// SSL session resumption for both MITM legs
+//
+// Client facing leg: session tickets, encrypted with a key held in shared
+// memory so that a ticket issued by one child is accepted by any other.
+// The parent replaces the key every sslticketkeylifetime seconds.
+//
+// Upstream leg: sessions are serialised into a fixed size, hostname hashed
+// table in shared memory so that any child can resume a session another
+// child set up with the same site.
+
+// For all support, instructions and copyright go to:
+// http://e2guardian.org/
+// Released under the GPL v2, with the OpenSSL exception described in the README file.
+
+// INCLUDES
+
+#ifdef HAVE_CONFIG_H
+#include "dgconfig.h"
+#endif
+
+#ifdef __SSLMITM
+
+#include <string.h>
+#include <syslog.h>
+#include <sys/mman.h>
+
+#include "openssl/ssl.h"
+#include "openssl/rand.h"
+#include "openssl/evp.h"
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include "openssl/core_names.h"
+#include "openssl/params.h"
+#else
+#include "openssl/hmac.h"
+#endif
+
+#include "SSLSessionCache.hpp"
+
+// DEFINES
+
+#define SSL_TICKET_KEYS 3
+// serialised sessions bigger than this (they include the peer certificate) are not cached
+#define SSL_SESSION_SLOT_SIZE 4096
+#define SSL_SESSION_HOST_SIZE 256
+
+// DECLARATIONS
+
+struct ssl_ticket_key {
+    time_t created; // 0 = never set, don't accept tickets named after it
+    unsigned char name[16];
+    unsigned char hmac_key[32];
+    unsigned char aes_key[32];
+};
+
+struct ssl_session_slot {
+    volatile int lock;
+    time_t expires;
+    char host[SSL_SESSION_HOST_SIZE];
+    int length;
+    unsigned char der[SSL_SESSION_SLOT_SIZE];
+};
+
+struct ssl_shared_state {
+    int key_lifetime;
+    volatile int current_key;
+    ssl_ticket_key keys[SSL_TICKET_KEYS];
+    volatile unsigned long server_resumed;
+    volatile unsigned long server_full;
+    volatile unsigned long client_resumed;
+    volatile unsigned long client_full;
+    int slots;
+    // ssl_session_slot[slots] follows
+};
+
+static ssl_shared_state *shared = NULL;
+static ssl_session_slot *slots = NULL;
+
+// IMPLEMENTATION
+
+static bool newTicketKey(int which, time_t now)
+{
+    ssl_ticket_key *k = &shared->keys[which];
+    k->created = 0;
+    if (RAND_bytes(k->name, sizeof(k->name)) < 1
+        || RAND_bytes(k->hmac_key, sizeof(k->hmac_key)) < 1
+        || RAND_bytes(k->aes_key, sizeof(k->aes_key)) < 1) {
+        syslog(LOG_ERR, "Unable to generate SSL session ticket key");
+        return false;
+    }
+    k->created = now;
+    return true;
+}
+
+bool initSslSessionCache(int nslots, int key_lifetime)
+{
+    if (shared != NULL && shared->slots == nslots) {
+        shared->key_lifetime = key_lifetime;
+        return true;
+    }
+
+    size_t len = sizeof(ssl_shared_state) + nslots * sizeof(ssl_session_slot);
+    void *mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        syslog(LOG_ERR, "Unable to allocate %lu bytes of shared memory for SSL session cache", (unsigned long)len);
+        if (shared == NULL)
+            return false;
+        // carry on with the table we have
+        shared->key_lifetime = key_lifetime;
+        return true;
+    }
+    ssl_shared_state *old = shared;
+    shared = (ssl_shared_state *)mem;
+    slots = (ssl_session_slot *)(shared + 1);
+    if (old != NULL) {
+        // resized on reload - the cached sessions are dropped, but the ticket keys
+        // are kept so that clients' tickets still work.  children forked before
+        // now keep using the old table until they exit
+        *shared = *old;
+        munmap(old, sizeof(ssl_shared_state) + old->slots * sizeof(ssl_session_slot));
+        shared->slots = nslots;
+        shared->key_lifetime = key_lifetime;
+        return true;
+    }
+    shared->slots = nslots;
+    shared->key_lifetime = key_lifetime;
+    shared->current_key = 0;
+    newTicketKey(0, time(NULL));
+    return true;
+}
+
+void rotateSslTicketKey(time_t now)
+{
+    if (shared == NULL || shared->key_lifetime < 1)
+        return;
+    int current = shared->current_key;
+    if ((now - shared->keys[current].created) < shared->key_lifetime)
+        return;
+
+    // overwrite the oldest key - current & previous stay usable meanwhile
+    int next = (current + 1) % SSL_TICKET_KEYS;
+    if (!newTicketKey(next, now))
+        return;
+    __sync_synchronize();
+    shared->current_key = next;
+}
+
+// OpenSSL 3 hands the ticket callback an EVP_MAC context, older versions an HMAC_CTX
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+typedef EVP_MAC_CTX ticket_mac_ctx;
+
+static bool ticketMacInit(EVP_MAC_CTX *mctx, ssl_ticket_key *k)
+{
+    OSSL_PARAM params[3];
+    params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, k->hmac_key, sizeof(k->hmac_key));
+    params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, (char *)"SHA256", 0);
+    params[2] = OSSL_PARAM_construct_end();
+    return EVP_MAC_CTX_set_params(mctx, params) == 1;
+}
+#else
+typedef HMAC_CTX ticket_mac_ctx;
+
+static bool ticketMacInit(HMAC_CTX *hctx, ssl_ticket_key *k)
+{
+    return HMAC_Init_ex(hctx, k->hmac_key, sizeof(k->hmac_key), EVP_sha256(), NULL) == 1;
+}
+#endif
+
+static int ticketKeyCallback(SSL *ssl, unsigned char *key_name, unsigned char *iv,
+    EVP_CIPHER_CTX *ectx, ticket_mac_ctx *mctx, int enc)
+{
+    int current = shared->current_key;
+
+    if (enc) {
+        ssl_ticket_key *k = &shared->keys[current];
+        if (k->created == 0)
+            return 0; // no key, so no ticket
+        memcpy(key_name, k->name, sizeof(k->name));
+        if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) < 1)
+            return -1;
+        if (!EVP_EncryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, k->aes_key, iv)
+            || !ticketMacInit(mctx, k))
+            return -1;
+        return 1;
+    }
+
+    // accept the current and the previous key, asking for a fresh ticket for the latter
+    for (int i = 0; i < 2; i++) {
+        ssl_ticket_key *k = &shared->keys[(current + SSL_TICKET_KEYS - i) % SSL_TICKET_KEYS];
+        if (k->created == 0 || memcmp(key_name, k->name, sizeof(k->name)))
+            continue;
+        if (!ticketMacInit(mctx, k)
+            || !EVP_DecryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, k->aes_key, iv))
+            return -1;
+        return (i == 0) ? 1 : 2;
+    }
+    return 0; // unknown key - full handshake
+}
+
+static ssl_session_slot *hostSlot(const char *hostname)
+{
+    // FNV-1a
+    unsigned long h = 2166136261UL;
+    for (const char *c = hostname; *c; c++) {
+        h ^= (unsigned char)*c;
+        h *= 16777619UL;
+    }
+    return &slots[h % shared->slots];
+}
+
+// slots are never waited for - if another child has one locked, just skip the cache
+static bool lockSlot(ssl_session_slot *slot)
+{
+    return __sync_lock_test_and_set(&slot->lock, 1) == 0;
+}
+
+static void unlockSlot(ssl_session_slot *slot)
+{
+    __sync_lock_release(&slot->lock);
+}
+
+// new upstream session (or TLS 1.3 ticket) - store it against the SNI hostname
+static int newClientSession(SSL *ssl, SSL_SESSION *sess)
+{
+    const char *hostname = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+    if (hostname == NULL || strlen(hostname) >= SSL_SESSION_HOST_SIZE)
+        return 0;
+
+    int len = i2d_SSL_SESSION(sess, NULL);
+    if (len <= 0 || len > SSL_SESSION_SLOT_SIZE)
+        return 0;
+
+    ssl_session_slot *slot = hostSlot(hostname);
+    if (!lockSlot(slot))
+        return 0;
+    unsigned char *p = slot->der;
+    slot->length = i2d_SSL_SESSION(sess, &p);
+    slot->expires = SSL_SESSION_get_time(sess) + SSL_SESSION_get_timeout(sess);
+    strcpy(slot->host, hostname);
+    unlockSlot(slot);
+
+    return 0; // we didn't keep a reference
+}
+
+void setupSslSessionCache(SSL_CTX *client_ctx, SSL_CTX *server_ctx)
+{
+    if (shared == NULL)
+        return;
+
+    if (client_ctx != NULL && shared->slots > 0) {
+        SSL_CTX_set_session_cache_mode(client_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(client_ctx, newClientSession);
+    }
+
+    if (server_ctx != NULL) {
+        if (shared->key_lifetime > 0)
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+            SSL_CTX_set_tlsext_ticket_key_evp_cb(server_ctx, ticketKeyCallback);
+#else
+            SSL_CTX_set_tlsext_ticket_key_cb(server_ctx, ticketKeyCallback);
+#endif
+        else
+            SSL_CTX_set_options(server_ctx, SSL_OP_NO_TICKET);
+    }
+}
+
+void restoreSslClientSession(SSL *ssl, const char *hostname)
+{
+    if (shared == NULL || shared->slots < 1)
+        return;
+
+    unsigned char der[SSL_SESSION_SLOT_SIZE];
+    int len = 0;
+    ssl_session_slot *slot = hostSlot(hostname);
+    if (!lockSlot(slot))
+        return;
+    if (slot->length > 0 && slot->expires > time(NULL) && !strcmp(slot->host, hostname)) {
+        len = slot->length;
+        memcpy(der, slot->der, len);
+    }
+    unlockSlot(slot);
+    if (len == 0)
+        return;
+
+    const unsigned char *p = der;
+    SSL_SESSION *sess = d2i_SSL_SESSION(NULL, &p, len);
+    if (sess != NULL) {
+        SSL_set_session(ssl, sess);
+        SSL_SESSION_free(sess);
+    }
+}
+
+void countSslHandshake(SSL *ssl, bool server)
+{
+    if (shared == NULL)
+        return;
+    bool resumed = SSL_session_reused(ssl);
+    if (server)
+        __sync_fetch_and_add(resumed ? &shared->server_resumed : &shared->server_full, 1);
+    else
+        __sync_fetch_and_add(resumed ? &shared->client_resumed : &shared->client_full, 1);
+}
+
+static unsigned long takeCounter(volatile unsigned long *counter)
+{
+    unsigned long val = *counter;
+    __sync_fetch_and_sub(counter, val);
+    return val;
+}
+
+void takeSslSessionStats(ssl_session_stats *stats)
+{
+    if (shared == NULL) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+    stats->server_resumed = takeCounter(&shared->server_resumed);
+    stats->server_full = takeCounter(&shared->server_full);
+    stats->client_resumed = takeCounter(&shared->client_resumed);
+    stats->client_full = takeCounter(&shared->client_full);
+}
+
+#endif //__SSLMITM
@@ -0,0 +1,48 @@
+// SSL session resumption for both MITM legs
+
+// For all support, instructions and copyright go to:
+// http://e2guardian.org/
+// Released under the GPL v2, with the OpenSSL exception described in the README file.
+
+#ifndef __HPP_SSLSESSIONCACHE
+#define __HPP_SSLSESSIONCACHE
+#ifdef __SSLMITM
+
+#include <ctime>
+#include "openssl/ssl.h"
+
+// resumption counters, as returned by takeSslSessionStats
+struct ssl_session_stats {
+    unsigned long server_resumed; // client -> e2guardian handshakes resumed from a ticket
+    unsigned long server_full;
+    unsigned long client_resumed; // e2guardian -> site handshakes resumed from the cache
+    unsigned long client_full;
+};
+
+// set up the shared memory holding the ticket keys, upstream session cache &
+// counters - must be called by the parent before forking children.
+// slots is the number of upstream sessions kept (0 disables the upstream cache),
+// key_lifetime how many seconds a ticket key is used for (0 disables tickets).
+// on reload the existing memory is kept and only key_lifetime is updated, unless
+// the number of slots has changed - then the sessions are dropped for a table
+// of the new size, which keeps the ticket keys
+bool initSslSessionCache(int slots, int key_lifetime);
+
+// install the ticket key & new session callbacks on the shared contexts
+void setupSslSessionCache(SSL_CTX *client_ctx, SSL_CTX *server_ctx);
+
+// called periodically by the parent - replaces the ticket key once its lifetime has passed
+// tickets made with the previous key are still accepted (and renewed)
+void rotateSslTicketKey(time_t now);
+
+// offer a cached session for hostname on an upstream connection before SSL_connect
+void restoreSslClientSession(SSL *ssl, const char *hostname);
+
+// count a completed handshake as resumed or full
+void countSslHandshake(SSL *ssl, bool server);
+
+// read the counters and reset them to zero
+void takeSslSessionStats(ssl_session_stats *stats);
+
+#endif //__SSLMITM
+#endif //__HPP_SSLSESSIONCACHE
@@ -0,0 +1,199 @@
+// Shared cache of content scanner results
+//
+// The same download - an installer, a popular library, an update - tends to be
+// fetched again and again, by different users and so by different children, and
+// each time it would be sent through every content scanner.  Results are kept
+// in a fixed size table in shared memory instead, hashed on the SHA-256 of the
+// content and the scanner that gave them.  Scanners name themselves along with
+// their signature version, so a result stops being found as soon as the
+// signatures it was based on have been updated.
+
+// For all support, instructions and copyright go to:
+// http://e2guardian.org/
+// Released under the GPL v2, with the OpenSSL exception described in the README file.
+
+// INCLUDES
+
+#ifdef HAVE_CONFIG_H
+#include "dgconfig.h"
+#endif
+
+#include <string.h>
+#include <syslog.h>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#ifdef __SSLMITM
+#include "openssl/evp.h"
+#endif
+
+#include "ScanVerdictCache.hpp"
+#include "FDFuncs.hpp"
+
+// DEFINES
+
+#define SCAN_VERDICT_ID_SIZE 128
+#define SCAN_VERDICT_READ_SIZE 65536
+
+// DECLARATIONS
+
+struct scan_verdict_slot {
+    volatile int lock;
+    time_t expires;
+    unsigned int generation;
+    unsigned char md[SCAN_VERDICT_HASH_SIZE];
+    char scanner[SCAN_VERDICT_ID_SIZE];
+    scan_verdict verdict;
+};
+
+struct scan_verdict_state {
+    int ttl;
+    int slots;
+    // scan_verdict_slot[slots] follows
+};
+
+static scan_verdict_state *shared = NULL;
+static scan_verdict_slot *slots = NULL;
+
+// bumped on every (re)initialisation. children keep the value from when they
+// were forked, so those still running the old plugins don't share results
+// with those running the new ones
+static unsigned int generation = 0;
+
+// IMPLEMENTATION
+
+bool initScanVerdictCache(int nslots, int ttl)
+{
+    generation++;
+#ifndef __SSLMITM
+    // nothing to hash content with
+    nslots = 0;
+#endif
+    if (nslots < 0)
+        nslots = 0;
+    if (shared != NULL) {
+        if (shared->slots == nslots) {
+            shared->ttl = ttl;
+            return true;
+        }
+        // resized or turned off - children forked before now keep the old table
+        munmap(shared, sizeof(scan_verdict_state) + shared->slots * sizeof(scan_verdict_slot));
+        shared = NULL;
+        slots = NULL;
+    }
+    if (nslots < 1)
+        return true;
+
+    size_t len = sizeof(scan_verdict_state) + nslots * sizeof(scan_verdict_slot);
+    void *mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        syslog(LOG_ERR, "Unable to allocate %lu bytes of shared memory for scan result cache", (unsigned long)len);
+        return false;
+    }
+    shared = (scan_verdict_state *)mem;
+    slots = (scan_verdict_slot *)(shared + 1);
+    shared->slots = nslots;
+    shared->ttl = ttl;
+    return true;
+}
+
+bool scanVerdictCacheEnabled()
+{
+    return shared != NULL && shared->ttl > 0;
+}
+
+bool hashScanContent(const char *data, off_t len, const char *filename, unsigned char *md)
+{
+#ifdef __SSLMITM
+    EVP_MD_CTX *ctx = EVP_MD_CTX_create();
+    if (ctx == NULL)
+        return false;
+    bool ok = EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+    if (ok && filename != NULL) {
+        int fd = open(filename, O_RDONLY);
+        if (fd < 0) {
+            ok = false;
+        } else {
+            char *block = new char[SCAN_VERDICT_READ_SIZE];
+            int rc = 0;
+            while (ok && (rc = readEINTR(fd, block, SCAN_VERDICT_READ_SIZE)) > 0)
+                ok = EVP_DigestUpdate(ctx, block, rc);
+            if (rc < 0)
+                ok = false;
+            delete[] block;
+            close(fd);
+        }
+    } else if (ok) {
+        ok = EVP_DigestUpdate(ctx, data, len);
+    }
+    unsigned int mdlen = 0;
+    if (ok)
+        ok = EVP_DigestFinal_ex(ctx, md, &mdlen) && mdlen == SCAN_VERDICT_HASH_SIZE;
+    EVP_MD_CTX_destroy(ctx);
+    return ok;
+#else
+    return false;
+#endif
+}
+
+static scan_verdict_slot *contentSlot(const unsigned char *md, const char *scanner)
+{
+    // FNV-1a
+    unsigned long h = 2166136261UL ^ generation;
+    for (int i = 0; i < SCAN_VERDICT_HASH_SIZE; i++) {
+        h ^= md[i];
+        h *= 16777619UL;
+    }
+    for (const char *c = scanner; *c; c++) {
+        h ^= (unsigned char)*c;
+        h *= 16777619UL;
+    }
+    return &slots[h % shared->slots];
+}
+
+// slots are never waited for - if another child has one locked, just skip the cache
+static bool lockSlot(scan_verdict_slot *slot)
+{
+    return __sync_lock_test_and_set(&slot->lock, 1) == 0;
+}
+
+static void unlockSlot(scan_verdict_slot *slot)
+{
+    __sync_lock_release(&slot->lock);
+}
+
+bool lookupScanVerdict(const unsigned char *md, const char *scanner, scan_verdict *verdict)
+{
+    if (!scanVerdictCacheEnabled() || strlen(scanner) >= SCAN_VERDICT_ID_SIZE)
+        return false;
+
+    bool found = false;
+    scan_verdict_slot *slot = contentSlot(md, scanner);
+    if (!lockSlot(slot))
+        return false;
+    if (slot->expires > time(NULL) && slot->generation == generation
+        && !memcmp(slot->md, md, SCAN_VERDICT_HASH_SIZE) && !strcmp(slot->scanner, scanner)) {
+        *verdict = slot->verdict;
+        found = true;
+    }
+    unlockSlot(slot);
+    return found;
+}
+
+void storeScanVerdict(const unsigned char *md, const char *scanner, const scan_verdict &verdict)
+{
+    if (!scanVerdictCacheEnabled() || strlen(scanner) >= SCAN_VERDICT_ID_SIZE)
+        return;
+
+    scan_verdict_slot *slot = contentSlot(md, scanner);
+    if (!lockSlot(slot))
+        return;
+    memcpy(slot->md, md, SCAN_VERDICT_HASH_SIZE);
+    strcpy(slot->scanner, scanner);
+    slot->generation = generation;
+    slot->verdict = verdict;
+    slot->expires = time(NULL) + shared->ttl;
+    unlockSlot(slot);
+}
@@ -0,0 +1,46 @@
+// Shared cache of content scanner results
+
+// For all support, instructions and copyright go to:
+// http://e2guardian.org/
+// Released under the GPL v2, with the OpenSSL exception described in the README file.
+
+#ifndef __HPP_SCANVERDICTCACHE
+#define __HPP_SCANVERDICTCACHE
+
+#include <sys/types.h>
+
+// DEFINES
+
+#define SCAN_VERDICT_HASH_SIZE 32 // SHA-256
+#define SCAN_VERDICT_TEXT_SIZE 256
+
+// outcome of scanning some content, enough to repeat it without the scanner
+struct scan_verdict {
+    int result; // DGCS_CLEAN or DGCS_INFECTED
+    int message_no;
+    char whatIsNaughty[SCAN_VERDICT_TEXT_SIZE];
+    char whatIsNaughtyLog[SCAN_VERDICT_TEXT_SIZE];
+    char whatIsNaughtyCategories[SCAN_VERDICT_TEXT_SIZE];
+};
+
+// set up the shared memory - must be called by the parent before forking children.
+// slots is the number of results remembered (0 disables the cache), ttl how many
+// seconds a result is trusted for. on reload the existing memory is kept unless
+// the size has changed, but results stored by children of the previous
+// configuration are no longer used
+bool initScanVerdictCache(int slots, int ttl);
+
+// whether there is any point hashing content for the cache
+bool scanVerdictCacheEnabled();
+
+// hash content - the file if filename is given, else len bytes of data
+bool hashScanContent(const char *data, off_t len, const char *filename, unsigned char *md);
+
+// find an unexpired result for content md from the named scanner, which should
+// include the scanner's signature version so that updates are never missed
+bool lookupScanVerdict(const unsigned char *md, const char *scanner, scan_verdict *verdict);
+
+// remember the result of scanning content md
+void storeScanVerdict(const unsigned char *md, const char *scanner, const scan_verdict &verdict);
+
+#endif //__HPP_SCANVERDICTCACHE
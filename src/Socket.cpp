@@ -28,6 +28,8 @@
 #include "openssl/err.h"
 #include "String.hpp"
 #include "CertificateAuthority.hpp"
+#include "SSLSessionCache.hpp"
+#include "FDFuncs.hpp"
 #endif
 
 #ifdef __SSLMITM
@@ -60,9 +62,9 @@ Socket::Socket()
 
 #ifdef __SSLMITM
     ssl = NULL;
-    ctx = NULL;
     isssl = false;
     issslserver = false;
+    want_write = false;
 #else
     isssl = false;
 #endif
@@ -85,9 +87,9 @@ Socket::Socket(int fd)
 
 #ifdef __SSLMITM
     ssl = NULL;
-    ctx = NULL;
     isssl = false;
     issslserver = false;
+    want_write = false;
 #else
     isssl = false;
 #endif
@@ -112,9 +114,9 @@ Socket::Socket(int newfd, struct sockaddr_in myip, struct sockaddr_in peerip)
 
 #ifdef __SSLMITM
     ssl = NULL;
-    ctx = NULL;
     isssl = false;
     issslserver = false;
+    want_write = false;
 #else
     isssl = false;
 #endif
@@ -225,16 +227,181 @@ Socket *Socket::accept()
         return NULL;
 }
 
-#ifdef __SSLMITM
-//use this socket as an ssl client
-int Socket::startSslClient(const std::string &certificate_path, String hostname)
+// TLS records are at most 16k plus the 5 byte header
+#define TLS_RECORD_MAX (16384 + 5)
+
+// pull the server name & ALPN extensions out of a ClientHello record, and
+// whether its signature algorithms allow an ECDSA certificate
+static bool parseClientHello(const unsigned char *p, int len, std::string &sni, std::string &alpn, bool *ecdsa)
 {
-    if (isssl) {
-        stopSsl();
+    // record header: handshake(22), version major 3, length
+    if (len < 5 || p[0] != 22 || p[1] != 3)
+        return false;
+    int reclen = (p[3] << 8) | p[4];
+    if (reclen + 5 > len)
+        return false;
+    const unsigned char *end = p + 5 + reclen;
+    p += 5;
+
+    // handshake header: client_hello(1), 24 bit length - must fit in this record
+    if (end - p < 4 || p[0] != 1)
+        return false;
+    int hslen = (p[1] << 16) | (p[2] << 8) | p[3];
+    p += 4;
+    if (hslen > end - p)
+        return false;
+    end = p + hslen;
+
+    // version, random, session id, cipher suites, compression methods
+    if (end - p < 35)
+        return false;
+    p += 34;
+    p += 1 + p[0];
+    if (end - p < 2)
+        return false;
+    p += 2 + ((p[0] << 8) | p[1]);
+    if (end - p < 1)
+        return false;
+    p += 1 + p[0];
+    if (end - p < 2) {
+        if (ecdsa != NULL)
+            *ecdsa = true; // no signature_algorithms - the cipher suites decide
+        return true; // no extensions
+    }
+    int extlen = (p[0] << 8) | p[1];
+    p += 2;
+    if (extlen > end - p)
+        return false;
+    end = p + extlen;
+    bool sigalgs = false, ecsig = false;
+
+    while (end - p >= 4) {
+        int type = (p[0] << 8) | p[1];
+        int elen = (p[2] << 8) | p[3];
+        p += 4;
+        if (elen > end - p)
+            return false;
+        const unsigned char *e = p, *eend = p + elen;
+        p = eend;
+
+        if (type == 0 && eend - e >= 2) { // server_name - list of type, length, name
+            e += 2;
+            while (eend - e >= 3) {
+                int nlen = (e[1] << 8) | e[2];
+                if (nlen > eend - e - 3)
+                    break;
+                if (e[0] == 0) { // host_name
+                    sni.assign((const char *)e + 3, nlen);
+                    break;
+                }
+                e += 3 + nlen;
+            }
+        } else if (type == 16 && eend - e >= 2) { // alpn - list of length, protocol
+            e += 2;
+            while (eend - e >= 1) {
+                int plen = e[0];
+                if (plen > eend - e - 1)
+                    break;
+                if (!alpn.empty())
+                    alpn += ",";
+                alpn.append((const char *)e + 1, plen);
+                e += 1 + plen;
+            }
+        } else if (type == 13 && eend - e >= 2) { // signature_algorithms - list of hash, signature
+            sigalgs = true;
+            for (e += 2; eend - e >= 2; e += 2) {
+                if (e[1] == 3) // ecdsa, and the TLS 1.3 ecdsa_secp*_sha* schemes
+                    ecsig = true;
+            }
+        }
     }
+    if (ecdsa != NULL)
+        *ecdsa = ecsig || !sigalgs;
+    return true;
+}
+
+bool Socket::peekSslClientHello(std::string &sni, std::string &alpn, int timeout, bool *ecdsa)
+{
+    sni.clear();
+    alpn.clear();
+    // anything already read into our buffer would be missing from the peek
+    if ((bufflen - buffstart) > 0)
+        return false;
 
+    unsigned char hello[TLS_RECORD_MAX];
+    struct timeval start, now;
+    gettimeofday(&start, NULL);
+    int wanted = 1;
+    bool found = false;
+
+    // the ClientHello may come in more than one segment, and the first part has to
+    // stay unread, so have select() hold off until the rest is here by raising the
+    // receive low-water mark to the length of the record
+    while (true) {
+        gettimeofday(&now, NULL);
+        int left = timeout - (now.tv_sec - start.tv_sec);
+        if (left < 1)
+            break;
+        try {
+            checkForInput(left);
+        } catch (std::exception &e) {
+            break;
+        }
+        int rc = recv(sck, hello, sizeof(hello), MSG_PEEK);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            break;
+        if (rc >= 5) {
+            if (hello[0] != 22 || hello[1] != 3)
+                break;
+            int need = ((hello[3] << 8) | hello[4]) + 5;
+            if (need > (int)sizeof(hello))
+                break;
+            if (rc >= need) {
+                found = parseClientHello(hello, rc, sni, alpn, ecdsa);
+                break;
+            }
+            wanted = need;
+        } else {
+            wanted = 5;
+        }
+        if (setsockopt(sck, SOL_SOCKET, SO_RCVLOWAT, &wanted, sizeof(wanted)) < 0)
+            break;
+    }
+
+    if (wanted > 1) {
+        wanted = 1;
+        setsockopt(sck, SOL_SOCKET, SO_RCVLOWAT, &wanted, sizeof(wanted));
+    }
+    return found;
+}
+
+#ifdef __SSLMITM
+// contexts shared by every SSL connection made by this process - built by
+// initSslContexts before the children are forked, so the CA store is only
+// loaded once rather than on every handshake
+static SSL_CTX *shared_client_ctx = NULL;
+static std::string shared_client_certpath;
+static SSL_CTX *shared_server_ctx = NULL;
+static std::string shared_server_ciphers;
+static bool shared_ktls = false;
+
+// ask OpenSSL to hand the record layer to the kernel after the handshake.
+// it quietly stays in user space if the kernel, cipher or library can't do it
+static void enableKtls(SSL_CTX *ctx)
+{
+#ifdef SSL_OP_ENABLE_KTLS
+    if (shared_ktls)
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+}
+
+// create a context for upstream connections, verifying against certificate_path
+static SSL_CTX *newSslClientCtx(const std::string &certificate_path)
+{
     ERR_clear_error();
-    ctx = SSL_CTX_new(SSLv23_client_method());
+    SSL_CTX *ctx = SSL_CTX_new(SSLv23_client_method());
     if (ctx == NULL) {
 //needed to get the errors when creating ctx
 //ERR_print_errors_fp(stderr);
@@ -243,14 +410,12 @@ int Socket::startSslClient(const std::string &certificate_path, String hostname)
         //syslog(LOG_ERR, "error creating ssl context\n");
         std::cout << "Error ssl context is null (check that openssl has been inited)" << std::endl;
 #endif
-        log_ssl_errors("Error ssl context is null for %s", hostname.c_str());
-        return -1;
+        log_ssl_errors("Error ssl context is null for %s", "client");
+        return NULL;
     }
 
     //set the timeout for the ssl session
-    if (SSL_CTX_set_timeout(ctx, 130l) < 1) {
-        return -1;
-    }
+    SSL_CTX_set_timeout(ctx, 130l);
 
     //load certs
     ERR_clear_error();
@@ -262,49 +427,159 @@ int Socket::startSslClient(const std::string &certificate_path, String hostname)
             log_ssl_errors("couldnt load certificates from %s", certificate_path.c_str());
             //tidy up
             SSL_CTX_free(ctx);
-            ctx = NULL;
-            return -2;
+            return NULL;
         }
     } else if (!SSL_CTX_set_default_verify_paths(ctx)) //use default if no certPpath given
     {
 #ifdef DGDEBUG
         std::cout << "couldnt load default certificates" << std::endl;
 #endif
-            log_ssl_errors("couldnt load default certificates for %s", hostname.c_str());
+        log_ssl_errors("couldnt load default certificates for %s", "client");
         //tidy up
         SSL_CTX_free(ctx);
-        ctx = NULL;
-        return -2;
+        return NULL;
     }
 
     // add validation params
     ERR_clear_error();
     X509_VERIFY_PARAM *x509_param = X509_VERIFY_PARAM_new();
     if (!x509_param) {
-        log_ssl_errors("couldnt add validation params for %s", hostname.c_str());
-        X509_VERIFY_PARAM_free(x509_param);
-        return -2;
+        log_ssl_errors("couldnt add validation params for %s", "client");
+        SSL_CTX_free(ctx);
+        return NULL;
     }
 
     ERR_clear_error();
-    if (!X509_VERIFY_PARAM_set_flags(x509_param, X509_V_FLAG_TRUSTED_FIRST)) {
-        log_ssl_errors("couldnt add validation params for %s", hostname.c_str());
+    if (!X509_VERIFY_PARAM_set_flags(x509_param, X509_V_FLAG_TRUSTED_FIRST)
+        || !SSL_CTX_set1_param(ctx, x509_param)) {
+        log_ssl_errors("couldnt add validation params for %s", "client");
         X509_VERIFY_PARAM_free(x509_param);
-        return -2;
+        SSL_CTX_free(ctx);
+        return NULL;
     }
 
+    X509_VERIFY_PARAM_free(x509_param);
+    enableKtls(ctx);
+    return ctx;
+}
+
+// staple an OCSP response for the forged certificate when the client asks for one,
+// saving browsers that insist on revocation info a trip to a responder that isn't there.
+// the CA to sign it is the connection's app data, set by startSslServer
+static int staple_ocsp_cb(SSL *ssl, void *arg)
+{
+    CertificateAuthority *ca = (CertificateAuthority *)SSL_get_app_data(ssl);
+    if (ca == NULL)
+        return SSL_TLSEXT_ERR_NOACK;
+
+    std::string der;
+    if (!ca->getOcspResponse(SSL_get_certificate(ssl), der))
+        return SSL_TLSEXT_ERR_NOACK;
+
+    // openssl takes ownership of the buffer
+    unsigned char *resp = (unsigned char *)OPENSSL_malloc(der.length());
+    if (resp == NULL)
+        return SSL_TLSEXT_ERR_NOACK;
+    memcpy(resp, der.data(), der.length());
+    SSL_set_tlsext_status_ocsp_resp(ssl, resp, der.length());
+    return SSL_TLSEXT_ERR_OK;
+}
+
+// send the CA chain along with whichever forged certificate was just loaded
+static void useCaChain(SSL *ssl, CertificateAuthority *ca)
+{
+#ifdef SSL_set1_chain
+    STACK_OF(X509) *chain = (ca != NULL) ? ca->getCaChain() : NULL;
+    if (chain != NULL && !SSL_set1_chain(ssl, chain))
+        log_ssl_errors("couldnt set ca chain for client %s", "");
+#endif
+}
+
+// create a context for MITM'd client connections - certificate & key are set per connection
+static SSL_CTX *newSslServerCtx(const std::string &cipher_list)
+{
     ERR_clear_error();
-    if (!SSL_CTX_set1_param(ctx, x509_param)) {
-        log_ssl_errors("couldnt add validation params for %s", hostname.c_str());
-        X509_VERIFY_PARAM_free(x509_param);
-        return -2;
+    SSL_CTX *ctx = SSL_CTX_new(SSLv23_server_method());
+    if (ctx == NULL) {
+#ifdef DGDEBUG
+        //syslog(LOG_ERR, "error creating ssl context\n");
+        std::cout << "Error ssl context is null (check that openssl has been inited)" << std::endl;
+#endif
+        log_ssl_errors("Error ssl context is null for %s", "server");
+        return NULL;
     }
 
-    X509_VERIFY_PARAM_free(x509_param);
+    //set the timeout to match firefox
+    SSL_CTX_set_timeout(ctx, 130l);
+
+    if (cipher_list.length() > 0)
+        SSL_CTX_set_cipher_list(ctx, cipher_list.c_str());
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L && defined(SSL_CTX_set_ecdh_auto)
+    // ECDHE is needed for the ECDSA certificates and is not on by default before 1.1
+    SSL_CTX_set_ecdh_auto(ctx, 1);
+#endif
+
+    SSL_CTX_set_tlsext_status_cb(ctx, staple_ocsp_cb);
+
+    enableKtls(ctx);
+    return ctx;
+}
+
+// (re)build the shared contexts - call at startup and after a config reload
+bool Socket::initSslContexts(const std::string &certificate_path, const std::string &cipher_list, bool ktls)
+{
+    freeSslContexts();
+    shared_ktls = ktls;
+
+    shared_client_ctx = newSslClientCtx(certificate_path);
+    shared_client_certpath = certificate_path;
+    shared_server_ctx = newSslServerCtx(cipher_list);
+    shared_server_ciphers = cipher_list;
+    setupSslSessionCache(shared_client_ctx, shared_server_ctx);
+
+    return (shared_client_ctx != NULL) && (shared_server_ctx != NULL);
+}
+
+// free the shared contexts - connections still using them keep their own reference
+void Socket::freeSslContexts()
+{
+    if (shared_client_ctx != NULL) {
+        SSL_CTX_free(shared_client_ctx);
+        shared_client_ctx = NULL;
+    }
+    if (shared_server_ctx != NULL) {
+        SSL_CTX_free(shared_server_ctx);
+        shared_server_ctx = NULL;
+    }
+}
+
+//use this socket as an ssl client
+int Socket::startSslClient(const std::string &certificate_path, String hostname)
+{
+    if (isssl) {
+        stopSsl();
+    }
+
+    // only build a context here if the shared one is missing or for another CA path
+    if (shared_client_ctx == NULL || certificate_path != shared_client_certpath) {
+        if (shared_client_ctx != NULL)
+            SSL_CTX_free(shared_client_ctx);
+        shared_client_ctx = newSslClientCtx(certificate_path);
+        shared_client_certpath = certificate_path;
+        if (shared_client_ctx == NULL) {
+            return -2;
+        }
+        setupSslSessionCache(shared_client_ctx, NULL);
+    }
 
     //hand socket over to ssl lib
     ERR_clear_error();
-    ssl = SSL_new(ctx);
+    ssl = SSL_new(shared_client_ctx);
+    if (ssl == NULL) {
+        log_ssl_errors("couldnt create ssl session for %s", hostname.c_str());
+        return -1;
+    }
     SSL_set_options(ssl, SSL_OP_ALL);
     SSL_set_mode(ssl, SSL_MODE_AUTO_RETRY);
     SSL_set_connect_state(ssl);
@@ -312,6 +587,7 @@ int Socket::startSslClient(const std::string &certificate_path, String hostname)
     //fcntl(this->getFD() ,F_SETFL, O_NONBLOCK);
     SSL_set_fd(ssl, this->getFD());
     SSL_set_tlsext_host_name(ssl, hostname.c_str());
+    restoreSslClientSession(ssl, hostname.c_str());
 
     //make io non blocking as select wont tell us if we can do a read without blocking
     //BIO_set_nbio(SSL_get_rbio(ssl),1l);
@@ -328,10 +604,12 @@ int Socket::startSslClient(const std::string &certificate_path, String hostname)
         // tidy up
         SSL_free(ssl);
         ssl = NULL;
-        SSL_CTX_free(ctx);
-        ctx = NULL;
         return -3;
     }
+    countSslHandshake(ssl, false);
+#ifdef DGDEBUG
+    std::cout << "ssl client kTLS send: " << isKtlsSend() << std::endl;
+#endif
 
     //should be safer to do this last as nothing will ever try to use a ssl socket that isnt fully setup
     isssl = true;
@@ -413,10 +691,6 @@ void Socket::stopSsl()
     }
 
     issslserver = false;
-    if (ctx != NULL) {
-        SSL_CTX_free(ctx);
-        ctx = NULL;
-    }
 }
 
 //check that everything in this certificate is correct appart from the hostname
@@ -431,6 +705,13 @@ long Socket::checkCertValid()
     return SSL_get_verify_result(ssl);
 }
 
+X509 *Socket::getPeerCertificate()
+{
+    if (ssl == NULL)
+        return NULL;
+    return SSL_get_peer_certificate(ssl);
+}
+
 //check the common name and altnames of a certificate against hostname
 int Socket::checkCertHostname(const std::string &_hostname)
 {
@@ -585,7 +866,8 @@ void Socket::close()
 
 #ifdef __SSLMITM
 //use this socket as an ssl server
-int Socket::startSslServer(X509 *x, EVP_PKEY *privKey, std::string &set_cipher_list)
+int Socket::startSslServer(X509 *x, EVP_PKEY *privKey, std::string &set_cipher_list, X509 *ecx, EVP_PKEY *ecPrivKey,
+    CertificateAuthority *ca, bool ocspstaple)
 {
 
     if (isssl) {
@@ -595,48 +877,67 @@ int Socket::startSslServer(X509 *x, EVP_PKEY *privKey, std::string &set_cipher_l
     // set ssl to NULL
     ssl = NULL;
 
-    //setup the ssl server ctx
-    ctx = SSL_CTX_new(SSLv23_server_method());
-    if (ctx == NULL) {
-#ifdef DGDEBUG
-        //syslog(LOG_ERR, "error creating ssl context\n");
-        std::cout << "Error ssl context is null (check that openssl has been inited)" << std::endl;
-#endif
-        return -1;
+    if (shared_server_ctx == NULL) {
+        shared_server_ctx = newSslServerCtx(set_cipher_list);
+        shared_server_ciphers = set_cipher_list;
+        if (shared_server_ctx == NULL) {
+            return -1;
+        }
+        setupSslSessionCache(NULL, shared_server_ctx);
     }
 
-    //set the timeout to match firefox
-    if (SSL_CTX_set_timeout(ctx, 130l) < 1) {
+    //setup the ssl session
+    ERR_clear_error();
+    ssl = SSL_new(shared_server_ctx);
+    if (ssl == NULL) {
+        log_ssl_errors("couldnt create ssl session for client %s", "");
         return -1;
     }
+    SSL_set_options(ssl, SSL_OP_ALL);
+    SSL_set_mode(ssl, SSL_MODE_AUTO_RETRY);
+    SSL_set_accept_state(ssl);
 
-    //set the ctx to use the certificate
-    if (SSL_CTX_use_certificate(ctx, x) < 1) {
+    if (set_cipher_list != shared_server_ciphers && set_cipher_list.length() > 0)
+        SSL_set_cipher_list(ssl, set_cipher_list.c_str());
+
+    //set the session to use the certificate
+    if (SSL_use_certificate(ssl, x) < 1) {
 #ifdef DGDEBUG
         //syslog(LOG_ERR, "error creating ssl context\n");
         std::cout << "Error using certificate" << std::endl;
 #endif
+        SSL_free(ssl);
+        ssl = NULL;
         return -1;
     }
 
-    if (set_cipher_list.length() > 0)
-        SSL_CTX_set_cipher_list(ctx, set_cipher_list.c_str());
-
-    //set the ctx to use the private key
-    if (SSL_CTX_use_PrivateKey(ctx, privKey) < 1) {
+    //set the session to use the private key
+    if (SSL_use_PrivateKey(ssl, privKey) < 1) {
 #ifdef DGDEBUG
         //syslog(LOG_ERR, "error creating ssl context\n");
         std::cout << "Error using private key" << std::endl;
 #endif
+        SSL_free(ssl);
+        ssl = NULL;
         return -1;
     }
+    useCaChain(ssl, ca);
+    if (ocspstaple)
+        SSL_set_app_data(ssl, ca);
 
-    //setup the ssl session
-    ERR_clear_error();
-    ssl = SSL_new(ctx);
-    SSL_set_options(ssl, SSL_OP_ALL);
-    SSL_set_mode(ssl, SSL_MODE_AUTO_RETRY);
-    SSL_set_accept_state(ssl);
+    // an ECDSA certificate is optional - with both loaded openssl picks per client
+    // from the signature algorithms & ciphers it advertises, RSA being the fallback
+    if (ecx != NULL && ecPrivKey != NULL) {
+        ERR_clear_error();
+        if (SSL_use_certificate(ssl, ecx) < 1 || SSL_use_PrivateKey(ssl, ecPrivKey) < 1) {
+#ifdef DGDEBUG
+            std::cout << "Error using ec certificate, continuing with rsa only" << std::endl;
+#endif
+            log_ssl_errors("couldnt use ec certificate for client %s", "");
+        } else {
+            useCaChain(ssl, ca);
+        }
+    }
 
     ERR_clear_error();
     SSL_set_fd(ssl, this->getFD());
@@ -664,11 +965,25 @@ int Socket::startSslServer(X509 *x, EVP_PKEY *privKey, std::string &set_cipher_l
         stopSsl();
         return -1;
     }
+    countSslHandshake(ssl, true);
     isssl = true;
     issslserver = true;
+#ifdef DGDEBUG
+    std::cout << "ssl server kTLS send: " << isKtlsSend() << std::endl;
+#endif
     return 0;
 }
 
+// has the kernel taken over encrypting what we send?
+bool Socket::isKtlsSend()
+{
+#ifdef SSL_OP_ENABLE_KTLS
+    return (ssl != NULL) && BIO_get_ktls_send(SSL_get_wbio(ssl));
+#else
+    return false;
+#endif
+}
+
 //modify all of these to use SSL_write(ssl,buf,len) and SSL_read(ssl,buf,buflen)
 
 //have to replace checkforinput as the ssl session will constantly generate traffic even if theres no real data
@@ -871,6 +1186,51 @@ bool Socket::writeToSocket(const char *buff, int len, unsigned int flags, int ti
     return true;
 }
 
+// send part of a file - sendfile() for plain connections and for SSL ones
+// where the kernel is doing the encryption, otherwise read it in and push
+// it through SSL_write
+off_t Socket::writeFromFile(int fd, off_t offset, off_t len, int timeout)
+{
+    if (!isssl) {
+        return BaseSocket::writeFromFile(fd, offset, len, timeout);
+    }
+
+    off_t sent = 0;
+#ifdef SSL_OP_ENABLE_KTLS
+    if (isKtlsSend()) {
+        while (sent < len) {
+            try {
+                BaseSocket::readyForOutput(timeout); // throws exception on error or timeout
+            } catch (std::exception &e) {
+                return -1;
+            }
+            size_t chunk = ((len - sent) > 0x7ffff000) ? 0x7ffff000 : (len - sent);
+            ossl_ssize_t rc = SSL_sendfile(ssl, fd, offset + sent, chunk, 0);
+            if (rc < 0) {
+                int err = SSL_get_error(ssl, rc);
+                if (err == SSL_ERROR_WANT_WRITE || (err == SSL_ERROR_SYSCALL && (errno == EINTR || errno == EAGAIN))) {
+                    continue;
+                }
+                if (sent == 0) {
+                    ERR_clear_error();
+                    break; // copy by hand instead
+                }
+                return -1;
+            }
+            if (rc == 0) {
+                return sent; // file shorter than expected
+            }
+            sent += rc;
+        }
+        if (sent >= len) {
+            return sent;
+        }
+    }
+#endif
+
+    return copyFromFile(fd, offset, sent, len, timeout);
+}
+
 // read a specified expected amount and return what actually read
 int Socket::readFromSocketn(char *buff, int len, unsigned int flags, int timeout)
 {
@@ -974,4 +1334,108 @@ int Socket::readFromSocket(char *buff, int len, unsigned int flags, int timeout,
     return rc + tocopy;
 }
 
+// non-blocking transfers for FDTunnel
+void Socket::setNonBlocking(bool nb)
+{
+    int flags = fcntl(sck, F_GETFL);
+    if (flags < 0)
+        return;
+    fcntl(sck, F_SETFL, nb ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK));
+    want_write = false;
+}
+
+bool Socket::waitingToWrite()
+{
+    return want_write;
+}
+
+bool Socket::hasBufferedInput()
+{
+    return ((bufflen - buffstart) > 0) || (isssl && SSL_pending(ssl) > 0);
+}
+
+int Socket::readNonBlocking(char *buff, int len)
+{
+    if ((bufflen - buffstart) > 0) {
+        int tocopy = ((bufflen - buffstart) < len) ? (bufflen - buffstart) : len;
+        memcpy(buff, buffer + buffstart, tocopy);
+        buffstart += tocopy;
+        return tocopy;
+    }
+
+    want_write = false;
+    int rc;
+    if (!isssl) {
+        do {
+            rc = recv(sck, buff, len, 0);
+        } while (rc < 0 && errno == EINTR);
+        if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return SOCKET_WOULD_BLOCK;
+        return rc;
+    }
+
+    ERR_clear_error();
+    rc = SSL_read(ssl, buff, len);
+    if (rc > 0)
+        return rc;
+    switch (SSL_get_error(ssl, rc)) {
+    case SSL_ERROR_WANT_READ:
+        return SOCKET_WOULD_BLOCK;
+    case SSL_ERROR_WANT_WRITE: // e.g. replying to a key update
+        want_write = true;
+        return SOCKET_WOULD_BLOCK;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    case SSL_ERROR_SYSCALL:
+        if (errno == EINTR)
+            return SOCKET_WOULD_BLOCK;
+        if (rc == 0)
+            return 0; // closed without a close_notify
+        // fall through
+    default:
+        log_ssl_errors("ssl_read failed %s", "");
+        return -1;
+    }
+}
+
+// with SSL, a write that would block must be repeated with the same buffer & length
+int Socket::writeNonBlocking(const char *buff, int len)
+{
+    want_write = false;
+    int rc;
+    if (!isssl) {
+        do {
+            rc = send(sck, buff, len, MSG_NOSIGNAL);
+        } while (rc < 0 && errno == EINTR);
+        if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            want_write = true;
+            return SOCKET_WOULD_BLOCK;
+        }
+        return rc;
+    }
+
+    ERR_clear_error();
+    rc = SSL_write(ssl, buff, len);
+    if (rc > 0)
+        return rc;
+    switch (SSL_get_error(ssl, rc)) {
+    case SSL_ERROR_WANT_WRITE:
+        want_write = true;
+        return SOCKET_WOULD_BLOCK;
+    case SSL_ERROR_WANT_READ:
+        return SOCKET_WOULD_BLOCK;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    case SSL_ERROR_SYSCALL:
+        if (errno == EINTR) {
+            want_write = true;
+            return SOCKET_WOULD_BLOCK;
+        }
+        // fall through
+    default:
+        log_ssl_errors("ssl_write failed %s", "");
+        return -1;
+    }
+}
+
 #endif //__SSLMITM
@@ -14,8 +14,15 @@
 #ifdef __SSLMITM
 #include "openssl/ssl.h"
 #include "String.hpp"
+
+class CertificateAuthority;
 #endif
 
+// DEFINES
+
+// returned by the non-blocking transfers when the socket isn't ready
+#define SOCKET_WOULD_BLOCK -2
+
 // DECLARATIONS
 
 class Socket : public BaseSocket
@@ -55,7 +62,19 @@ class Socket : public BaseSocket
     std::string getLocalIP();
     int getLocalPort();
 
+    // look at, without consuming, the TLS ClientHello sent by the client for the
+    // server name and ALPN protocols (comma separated) it asks for, and whether
+    // it can take an ECDSA certificate.
+    // returns false if what arrives within timeout seconds isn't a ClientHello
+    bool peekSslClientHello(std::string &sni, std::string &alpn, int timeout, bool *ecdsa = NULL);
+
 #ifdef __SSLMITM
+    // build the client & server SSL contexts shared by all connections in this process
+    // call at startup and after a config reload; returns false if either failed
+    // ktls lets the kernel do the record encryption once handshakes are done, where it can
+    static bool initSslContexts(const std::string &certPath, const std::string &cipherList, bool ktls = false);
+    static void freeSslContexts();
+
     //use this socket as an ssl server
     int startSslClient(const std::string &certPath, String hostname);
 
@@ -73,12 +92,21 @@ class Socket : public BaseSocket
     //check the common name and altnames of a certificate against hostname
     int checkCertHostname(const std::string &hostame);
 
+    //the server's certificate (NULL if none) - free with X509_free
+    X509 *getPeerCertificate();
+
+    //is kernel TLS doing the encryption of data we send
+    bool isKtlsSend();
+
     void close();
 #endif //__SSLMITM
 
 #ifdef __SSLMITM
     //use this socket as an ssl server
-    int startSslServer(X509 *x, EVP_PKEY *privKey, std::string &set_cipher);
+    //ecx & ecPrivKey optionally add an ECDSA certificate alongside the RSA one
+    //ca, if given, supplies the chain sent after them & (with ocspstaple) OCSP responses
+    int startSslServer(X509 *x, EVP_PKEY *privKey, std::string &set_cipher, X509 *ecx = NULL, EVP_PKEY *ecPrivKey = NULL,
+        CertificateAuthority *ca = NULL, bool ocspstaple = false);
 
     // non-blocking check for writable socket
     bool readyForOutput();
@@ -104,14 +132,28 @@ class Socket : public BaseSocket
     int readFromSocket(char *buff, int len, unsigned int flags, int timeout, bool check_first = true, bool honour_reloadconfig = false);
     // write to socket, throwing std::exception on error - can be told to break on -r
     void writeToSockete(const char *buff, int len, unsigned int flags, int timeout, bool honour_reloadconfig = false) throw(std::exception);
+    // send part of an open file - sendfile() is only used on SSL connections under kernel TLS
+    off_t writeFromFile(int fd, off_t offset, off_t len, int timeout);
+
+    // non-blocking transfers, for tunnels which have to wait on both ends at once.
+    // the socket must have been put in non-blocking mode with setNonBlocking.
+    // return the bytes moved, 0 once the other end has closed, -1 on error or
+    // SOCKET_WOULD_BLOCK, after which waitingToWrite() says whether the socket
+    // needs to be writable (rather than readable) before trying again
+    void setNonBlocking(bool nb);
+    int readNonBlocking(char *buff, int len);
+    int writeNonBlocking(const char *buff, int len);
+    bool waitingToWrite();
+    // data which can be read without waiting on the network (our buffer or decrypted SSL records)
+    bool hasBufferedInput();
 #endif //__SSLMITM
 
     private:
 #ifdef __SSLMITM
     SSL *ssl;
-    SSL_CTX *ctx;
     bool isssl;
     bool issslserver;
+    bool want_write; // last non-blocking operation was waiting for the socket to be writable
 #else
     bool isssl;
 #endif //__SSLMITM
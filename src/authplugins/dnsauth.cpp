@@ -38,6 +38,11 @@
 #include <netdb.h>
 #include <arpa/nameser.h>
 #include <resolv.h>
+#include <string.h>
+#include <ctime>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 // GLOBALS
 
@@ -45,6 +50,22 @@ extern bool is_daemonised;
 extern OptionContainer o;
 extern int h_errno;
 
+// DEFINES
+
+#define DNSAUTH_IPPATH_SIZE 128
+#define DNSAUTH_USER_SIZE 256
+#define DNSAUTH_REFRESH_TIMEOUT 30 // a refresh not done by then is assumed lost
+
+// results of a TXT lookup
+#define DNSAUTH_FOUND 0
+#define DNSAUTH_NOTFOUND 1 // no such name, or no TXT record - may be cached
+#define DNSAUTH_FAILED 2 // resolver failure - not cached
+
+// results of a cache lookup
+#define DNSAUTH_CACHE_MISS 0
+#define DNSAUTH_CACHE_HIT 1
+#define DNSAUTH_CACHE_STALE 2 // expired, but may be used while it is refreshed
+
 // DECLARATIONS
 
 // user record struct
@@ -62,6 +83,39 @@ String authprefix;
 
 bool redirect_to_auth;
 
+// lookup cache, shared between all the children: for each ippath, the user &
+// group found in DNS - or that there was none - until the record's TTL is up
+struct dnsauth_cache_slot {
+    volatile int lock;
+    volatile time_t refreshing; // when a child started refreshing this entry, 0 if none is
+    time_t expires;
+    bool found;
+    int group;
+    char ippath[DNSAUTH_IPPATH_SIZE];
+    char user[DNSAUTH_USER_SIZE];
+};
+
+struct dnsauth_cache_state {
+    volatile unsigned long hits;
+    volatile unsigned long negative_hits;
+    volatile unsigned long stale_hits;
+    volatile unsigned long misses;
+    int slots;
+    // dnsauth_cache_slot[slots] follows
+};
+
+dnsauth_cache_state *dnscache = NULL;
+dnsauth_cache_slot *dnscacheslots = NULL;
+
+// the longest a record is trusted for, however long its TTL
+int cachemaxttl;
+
+// how long to remember that an ippath has no record
+int negativettl;
+
+// how long after expiry an entry may still be used while it is refreshed
+int stalettl;
+
 // class name is relevant!
 class dnsauthinstance : public AuthPlugin
 {
@@ -83,11 +137,17 @@ class dnsauthinstance : public AuthPlugin
 
     private:
     userstruct userst;
-    bool getdnstxt(String &ippath);
-    String dns_error(int herror);
     bool inAuthByPassLists(HTTPHeader &h);
 };
 
+static int getdnstxt(const String &ippath, userstruct &userst, int &ttl);
+#ifdef DGDEBUG
+static String dns_error(int herror);
+#endif
+static int lookupCache(const String &ippath, userstruct &userst, bool &found);
+static void storeCache(const String &ippath, int result, const userstruct &userst, int ttl);
+static void refreshCache(const String &ippath);
+
 // IMPLEMENTATION
 
 // class factory code *MUST* be included in every plugin
@@ -105,9 +165,14 @@ AuthPlugin *dnsauthcreate(ConfigVar &definition)
 //
 //
 
-// plugin quit - clear IP, subnet & range lists
+// plugin quit - release the lookup cache
 int dnsauthinstance::quit()
 {
+    if (dnscache != NULL) {
+        munmap(dnscache, sizeof(dnsauth_cache_state) + dnscache->slots * sizeof(dnsauth_cache_slot));
+        dnscache = NULL;
+        dnscacheslots = NULL;
+    }
     return 0;
 }
 
@@ -143,6 +208,31 @@ int dnsauthinstance::init(void *args)
         return -1;
     }
 
+    // lookup cache - before forking, so that all the children share it
+    int slots = 1024;
+    if (cv["cachesize"] != "")
+        slots = cv["cachesize"].toInteger();
+    cachemaxttl = 3600;
+    if (cv["cachemaxttl"] != "")
+        cachemaxttl = cv["cachemaxttl"].toInteger();
+    negativettl = 30;
+    if (cv["negativettl"] != "")
+        negativettl = cv["negativettl"].toInteger();
+    stalettl = 60;
+    if (cv["stalettl"] != "")
+        stalettl = cv["stalettl"].toInteger();
+    if (dnscache == NULL && slots > 0 && cachemaxttl > 0) {
+        size_t len = sizeof(dnsauth_cache_state) + slots * sizeof(dnsauth_cache_slot);
+        void *mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            syslog(LOG_ERR, "Unable to allocate shared memory for DNS auth cache - not caching");
+        } else {
+            dnscache = (dnsauth_cache_state *)mem;
+            dnscacheslots = (dnsauth_cache_slot *)(dnscache + 1);
+            dnscache->slots = slots;
+        }
+    }
+
 #ifdef DGDEBUG
     std::cout << "basedomain is " << basedomain << std::endl;
     std::cout << "authurl is " << authurl << std::endl;
@@ -180,7 +270,18 @@ int dnsauthinstance::identify(Socket &peercon, Socket &proxycon, HTTPHeader &h,
 #ifdef DGDEBUG
     std::cout << "IPPath is " << ippath << std::endl;
 #endif
-    if (getdnstxt(ippath)) {
+    bool found = false;
+    int cached = lookupCache(ippath, userst, found);
+    if (cached == DNSAUTH_CACHE_STALE) {
+        // keep using it for now, and look the record up again in the background
+        refreshCache(ippath);
+    } else if (cached == DNSAUTH_CACHE_MISS) {
+        int ttl = 0;
+        int rc = getdnstxt(ippath, userst, ttl);
+        storeCache(ippath, rc, userst, ttl);
+        found = (rc == DNSAUTH_FOUND);
+    }
+    if (found) {
         string = userst.user;
         return DGAUTH_OK;
     } else {
@@ -213,7 +314,9 @@ int dnsauthinstance::determineGroup(std::string &user, int &fg)
     return DGAUTH_OK;
 }
 
-bool dnsauthinstance::getdnstxt(String &ippath)
+// look up the TXT record for ippath - "user,group" - giving its TTL.
+// called from refresh threads as well as the child itself
+static int getdnstxt(const String &ippath, userstruct &userst, int &ttl)
 {
     // get info from DNS
     union {
@@ -228,13 +331,15 @@ bool dnsauthinstance::getdnstxt(String &ippath)
 #ifdef DGDEBUG
         std::cout << "DNS query returned error " << dns_error(h_errno) << std::endl;
 #endif
-        return false;
+        if (h_errno == HOST_NOT_FOUND || h_errno == NO_DATA)
+            return DNSAUTH_NOTFOUND;
+        return DNSAUTH_FAILED;
     }
     if (ns_initparse(response.buf, responseLen, &handle) < 0) {
 #ifdef DGDEBUG
         std::cout << "ns_initparse returned error " << strerror(errno) << std::endl;
 #endif
-        return false;
+        return DNSAUTH_FAILED;
     }
 
     int rrnum; /* resource record number */
@@ -248,7 +353,7 @@ bool dnsauthinstance::getdnstxt(String &ippath)
 #ifdef DGDEBUG
             std::cout << "ns_paserr returned error " << strerror(errno) << std::endl;
 #endif
-            return false;
+            return DNSAUTH_FAILED;
         } else {
             if (ns_rr_type(rr) == ns_t_txt) {
 #ifdef DGDEBUG
@@ -267,14 +372,16 @@ bool dnsauthinstance::getdnstxt(String &ippath)
                 String dnstxt(p);
                 userst.user = dnstxt.before(",");
                 userst.group = (dnstxt.after(",")).toInteger() - 1;
-                return true;
+                ttl = ns_rr_ttl(rr);
+                return DNSAUTH_FOUND;
             }
         }
     }
-    return true;
+    return DNSAUTH_NOTFOUND;
 }
 
-String dnsauthinstance::dns_error(int herror)
+#ifdef DGDEBUG
+static String dns_error(int herror)
 {
 
     String s;
@@ -296,6 +403,7 @@ String dnsauthinstance::dns_error(int herror)
     }
     return s;
 }
+#endif
 
 bool dnsauthinstance::inAuthByPassLists(HTTPHeader &h)
 {
@@ -317,3 +425,156 @@ bool dnsauthinstance::inAuthByPassLists(HTTPHeader &h)
     }
     return false;
 }
+
+// lookup cache
+
+static dnsauth_cache_slot *cacheSlot(const String &ippath)
+{
+    // FNV-1a
+    unsigned long h = 2166136261UL;
+    for (const char *c = ippath.c_str(); *c; c++) {
+        h ^= (unsigned char)*c;
+        h *= 16777619UL;
+    }
+    return &dnscacheslots[h % dnscache->slots];
+}
+
+// slots are never waited for - if another child has one locked, just skip the cache
+static bool lockSlot(dnsauth_cache_slot *slot)
+{
+    return __sync_lock_test_and_set(&slot->lock, 1) == 0;
+}
+
+static void unlockSlot(dnsauth_cache_slot *slot)
+{
+    __sync_lock_release(&slot->lock);
+}
+
+// find ippath in the cache, filling in userst if a user was found for it.
+// a stale result is only given to the child that is to refresh it; others
+// just keep using it until it is replaced
+static int lookupCache(const String &ippath, userstruct &userst, bool &found)
+{
+    if (dnscache == NULL)
+        return DNSAUTH_CACHE_MISS;
+
+    int rc = DNSAUTH_CACHE_MISS;
+    dnsauth_cache_slot *slot = cacheSlot(ippath);
+    if (!lockSlot(slot)) {
+        __sync_fetch_and_add(&dnscache->misses, 1);
+        return rc;
+    }
+    time_t now = time(NULL);
+    if (ippath == slot->ippath && slot->expires + stalettl > now) {
+        found = slot->found;
+        if (found) {
+            userst.ippath = ippath;
+            userst.user = slot->user;
+            userst.group = slot->group;
+        }
+        rc = DNSAUTH_CACHE_HIT;
+        if (slot->expires <= now) {
+            if (slot->refreshing + DNSAUTH_REFRESH_TIMEOUT <= now) {
+                slot->refreshing = now;
+                rc = DNSAUTH_CACHE_STALE;
+            }
+            __sync_fetch_and_add(&dnscache->stale_hits, 1);
+        } else if (found) {
+            __sync_fetch_and_add(&dnscache->hits, 1);
+        } else {
+            __sync_fetch_and_add(&dnscache->negative_hits, 1);
+        }
+    } else {
+        __sync_fetch_and_add(&dnscache->misses, 1);
+    }
+    unlockSlot(slot);
+    return rc;
+}
+
+// remember the result of looking up ippath: for its TTL (up to cachemaxttl) if a
+// user was found, negativettl if not. failures are not remembered, but leave
+// any stale entry to be used - and refreshed - again
+static void storeCache(const String &ippath, int result, const userstruct &userst, int ttl)
+{
+    if (dnscache == NULL || ippath.length() >= DNSAUTH_IPPATH_SIZE)
+        return;
+    if (result == DNSAUTH_FOUND && userst.user.length() >= DNSAUTH_USER_SIZE)
+        return;
+
+    dnsauth_cache_slot *slot = cacheSlot(ippath);
+    if (!lockSlot(slot))
+        return;
+    if (result == DNSAUTH_FAILED) {
+        if (ippath == slot->ippath)
+            slot->refreshing = 0;
+        unlockSlot(slot);
+        return;
+    }
+    if (result == DNSAUTH_FOUND) {
+        if (ttl > cachemaxttl)
+            ttl = cachemaxttl;
+        strcpy(slot->user, userst.user.c_str());
+        slot->group = userst.group;
+    } else {
+        ttl = negativettl;
+        slot->user[0] = '\0';
+        slot->group = 0;
+    }
+    strcpy(slot->ippath, ippath.c_str());
+    slot->found = (result == DNSAUTH_FOUND);
+    slot->expires = time(NULL) + ttl;
+    slot->refreshing = 0;
+    unlockSlot(slot);
+}
+
+static void *refreshThread(void *arg)
+{
+    String *ippath = (String *)arg;
+    userstruct userst;
+    int ttl = 0;
+    int rc = getdnstxt(*ippath, userst, ttl);
+    storeCache(*ippath, rc, userst, ttl);
+    delete ippath;
+    return NULL;
+}
+
+// look ippath up again without waiting for the answer. signals are left to the
+// child's own thread
+static void refreshCache(const String &ippath)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+    sigset_t all, old;
+    String *arg = new String(ippath);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    int rc = pthread_create(&thread, &attr, refreshThread, arg);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    pthread_attr_destroy(&attr);
+    if (rc != 0) {
+        // do it now instead
+        refreshThread(arg);
+    }
+}
+
+static unsigned long takeCounter(volatile unsigned long *counter)
+{
+    unsigned long val = *counter;
+    __sync_fetch_and_sub(counter, val);
+    return val;
+}
+
+void takeDnsAuthStats(dnsauth_stats *stats)
+{
+    if (dnscache == NULL) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+    stats->hits = takeCounter(&dnscache->hits);
+    stats->negative_hits = takeCounter(&dnscache->negative_hits);
+    stats->stale_hits = takeCounter(&dnscache->stale_hits);
+    stats->misses = takeCounter(&dnscache->misses);
+}
@@ -10,8 +10,8 @@
 #endif
 
 #include "../Auth.hpp"
-#include "../RegExp.hpp"
 #include "../OptionContainer.hpp"
+#include "../IPPrefixTree.hpp"
 
 #include <syslog.h>
 #include <algorithm>
@@ -26,45 +26,6 @@ extern OptionContainer o;
 
 // DECLARATIONS
 
-// structs linking subnets and IP ranges to filter groups
-struct subnetstruct {
-    uint32_t maskedaddr;
-    uint32_t mask;
-    int group;
-};
-
-struct rangestruct {
-    uint32_t startaddr;
-    uint32_t endaddr;
-    int group;
-};
-
-// class for linking IPs to filter groups, complete with comparison operators
-// allowing standard C++ sort to work
-class ip
-{
-    public:
-    ip(uint32_t a, int g)
-    {
-        addr = a;
-        group = g;
-    };
-    uint32_t addr;
-    int group;
-    int operator<(const ip &a) const
-    {
-        return addr < a.addr;
-    };
-    int operator<(const uint32_t &a) const
-    {
-        return addr < a;
-    };
-    int operator==(const uint32_t &a) const
-    {
-        return a == addr;
-    };
-};
-
 // class name is relevant!
 class ipinstance : public AuthPlugin
 {
@@ -85,15 +46,10 @@ class ipinstance : public AuthPlugin
     int quit();
 
     private:
-    std::vector<ip> iplist;
-    std::list<subnetstruct> ipsubnetlist;
-    std::list<rangestruct> iprangelist;
+    // IPs, subnets and ranges, with their filter groups
+    IPPrefixTree iptree;
 
     int readIPMelangeList(const char *filename);
-    int searchList(int a, int s, const uint32_t &ip);
-    int inList(const uint32_t &ip);
-    int inSubnet(const uint32_t &ip);
-    int inRange(const uint32_t &ip);
 };
 
 // IMPLEMENTATION
@@ -116,9 +72,7 @@ AuthPlugin *ipcreate(ConfigVar &definition)
 // plugin quit - clear IP, subnet & range lists
 int ipinstance::quit()
 {
-    iplist.clear();
-    ipsubnetlist.clear();
-    iprangelist.clear();
+    iptree.reset();
     return 0;
 }
 
@@ -172,28 +126,11 @@ int ipinstance::identify(Socket &peercon, Socket &proxycon, HTTPHeader &h, std::
 
 int ipinstance::determineGroup(std::string &user, int &fg)
 {
-    struct in_addr sin;
-    inet_aton(user.c_str(), &sin);
-    uint32_t addr = ntohl(sin.s_addr);
-    // check straight IPs, subnets, and ranges
-    fg = inList(addr);
+    // the most specific IP, subnet or range containing the address
+    fg = iptree.find(user);
     if (fg >= 0) {
 #ifdef DGDEBUG
-        std::cout << "Matched IP " << user << " to straight IP list" << std::endl;
-#endif
-        return DGAUTH_OK;
-    }
-    fg = inSubnet(addr);
-    if (fg >= 0) {
-#ifdef DGDEBUG
-        std::cout << "Matched IP " << user << " to subnet" << std::endl;
-#endif
-        return DGAUTH_OK;
-    }
-    fg = inRange(addr);
-    if (fg >= 0) {
-#ifdef DGDEBUG
-        std::cout << "Matched IP " << user << " to range" << std::endl;
+        std::cout << "Matched IP " << user << " to group " << fg << std::endl;
 #endif
         return DGAUTH_OK;
     }
@@ -203,58 +140,6 @@ int ipinstance::determineGroup(std::string &user, int &fg)
     return DGAUTH_NOMATCH;
 }
 
-//
-//
-// IP list functions (straight match, range match, subnet match)
-//
-//
-
-// search for IP in list & return filter group on success, -1 on failure
-int ipinstance::inList(const uint32_t &ip)
-{
-    if (iplist.size() > 0) {
-        return searchList(0, iplist.size(), ip);
-    }
-    return -1;
-}
-
-// binary search list for given IP & return filter group, or -1 on failure
-int ipinstance::searchList(int a, int s, const uint32_t &ip)
-{
-    if (a > s)
-        return -1;
-    int m = (a + s) / 2;
-    if (iplist[m] == ip)
-        return iplist[m].group;
-    if (iplist[m] < ip)
-        return searchList(m + 1, s, ip);
-    if (a == s)
-        return -1;
-    return searchList(a, m - 1, ip);
-}
-
-// search subnet list for given IP & return filter group or -1
-int ipinstance::inSubnet(const uint32_t &ip)
-{
-    for (std::list<subnetstruct>::const_iterator i = ipsubnetlist.begin(); i != ipsubnetlist.end(); ++i) {
-        if (i->maskedaddr == (ip & i->mask)) {
-            return i->group;
-        }
-    }
-    return -1;
-}
-
-// search range list for a range containing given IP & return filter group or -1
-int ipinstance::inRange(const uint32_t &ip)
-{
-    for (std::list<rangestruct>::const_iterator i = iprangelist.begin(); i != iprangelist.end(); ++i) {
-        if ((ip >= i->startaddr) && (ip <= i->endaddr)) {
-            return i->group;
-        }
-    }
-    return -1;
-}
-
 // read in a list linking IPs, subnets & IP ranges to filter groups
 // return 0 for success, -1 for failure, 1 for warning
 int ipinstance::readIPMelangeList(const char *filename)
@@ -269,20 +154,6 @@ int ipinstance::readIPMelangeList(const char *filename)
         return -1;
     }
 
-    // compile regexps for determining whether a list entry is an IP, a subnet (IP + mask), or a range
-    RegExp matchIP, matchSubnet, matchRange, matchCIDR;
-#ifdef HAVE_PCRE
-    matchIP.comp("^\\d{1,3}\\.\\d{1,3}\\.\\d{1,3}\\.\\d{1,3}$");
-    matchSubnet.comp("^\\d{1,3}\\.\\d{1,3}\\.\\d{1,3}\\.\\d{1,3}/\\d{1,3}\\.\\d{1,3}\\.\\d{1,3}\\.\\d{1,3}$");
-    matchCIDR.comp("^\\d{1,3}\\.\\d{1,3}\\.\\d{1,3}\\.\\d{1,3}/\\d{1,2}$");
-    matchRange.comp("^\\d{1,3}\\.\\d{1,3}\\.\\d{1,3}\\.\\d{1,3}-\\d{1,3}\\.\\d{1,3}\\.\\d{1,3}\\.\\d{1,3}$");
-#else
-    matchIP.comp("^[0-9]{1,3}.[0-9]{1,3}.[0-9]{1,3}.[0-9]{1,3}$");
-    matchSubnet.comp("^[0-9]{1,3}.[0-9]{1,3}.[0-9]{1,3}.[0-9]{1,3}/[0-9]{1,3}.[0-9]{1,3}.[0-9]{1,3}.[0-9]{1,3}$");
-    matchCIDR.comp("^[0-9]{1,3}.[0-9]{1,3}.[0-9]{1,3}.[0-9]{1,3}/[0-9]{1,2}$");
-    matchRange.comp("^[0-9]{1,3}.[0-9]{1,3}.[0-9]{1,3}.[0-9]{1,3}-[0-9]{1,3}.[0-9]{1,3}.[0-9]{1,3}.[0-9]{1,3}$");
-#endif
-
     // read in the file
     String line;
     String key, value;
@@ -322,60 +193,8 @@ int ipinstance::readIPMelangeList(const char *filename)
             warn = true;
             continue;
         }
-        // store the IP address (numerically, not as a string) and filter group in either the IP list, subnet list or range list
-        if (matchIP.match(key.toCharArray())) {
-            struct in_addr address;
-            if (inet_aton(key.toCharArray(), &address)) {
-                iplist.push_back(ip(ntohl(address.s_addr), value.toInteger() - 1));
-            }
-        } else if (matchSubnet.match(key.toCharArray())) {
-            struct in_addr address;
-            struct in_addr addressmask;
-            String subnet(key.before("/"));
-            String mask(key.after("/"));
-            if (inet_aton(subnet.toCharArray(), &address) && inet_aton(mask.toCharArray(), &addressmask)) {
-                subnetstruct s;
-                int addr = ntohl(address.s_addr);
-                s.mask = ntohl(addressmask.s_addr);
-                // pre-mask the address for quick comparison
-                s.maskedaddr = addr & s.mask;
-                s.group = value.toInteger() - 1;
-                ipsubnetlist.push_back(s);
-            }
-        } else if (matchCIDR.match(key.toCharArray())) {
-            struct in_addr address;
-            struct in_addr addressmask;
-            String subnet(key.before("/"));
-            String cidr(key.after("/"));
-            int m = cidr.toInteger();
-            int host_part = 32 - m;
-            if (host_part > -1) {
-                String mask = (0xFFFFFFFF << host_part);
-                if (inet_aton(subnet.toCharArray(), &address) && inet_aton(mask.toCharArray(), &addressmask)) {
-                    subnetstruct s;
-                    uint32_t addr = ntohl(address.s_addr);
-                    s.mask = ntohl(addressmask.s_addr);
-                    // pre-mask the address for quick comparison
-                    s.maskedaddr = addr & s.mask;
-                    s.group = value.toInteger() - 1;
-                    ipsubnetlist.push_back(s);
-                }
-            }
-        } else if (matchRange.match(key.toCharArray())) {
-            struct in_addr addressstart;
-            struct in_addr addressend;
-            String start(key.before("-"));
-            String end(key.after("-"));
-            if (inet_aton(start.toCharArray(), &addressstart) && inet_aton(end.toCharArray(), &addressend)) {
-                rangestruct r;
-                r.startaddr = ntohl(addressstart.s_addr);
-                r.endaddr = ntohl(addressend.s_addr);
-                r.group = value.toInteger() - 1;
-                iprangelist.push_back(r);
-            }
-        }
-        // hmmm. the key didn't match any of our regular expressions. output message & return a warning value.
-        else {
+        // store the IP address, subnet or range (numerically, not as a string) with its filter group
+        if (iptree.addEntry(key, value.toInteger() - 1) < 1) {
             if (!is_daemonised)
                 std::cerr << "Entry " << line << " in " << filename << " was not recognised as an IP address, subnet or range" << std::endl;
             syslog(LOG_ERR, "Entry %s in %s was not recognised as an IP address, subnet or range", line.toCharArray(), filename);
@@ -384,29 +203,7 @@ int ipinstance::readIPMelangeList(const char *filename)
     }
     input.close();
 #ifdef DGDEBUG
-    std::cout << "starting sort" << std::endl;
-#endif
-    std::sort(iplist.begin(), iplist.end());
-#ifdef DGDEBUG
-    std::cout << "sort complete" << std::endl;
-    std::cout << "ip list dump:" << std::endl;
-    std::vector<ip>::const_iterator i = iplist.begin();
-    while (i != iplist.end()) {
-        std::cout << "IP: " << i->addr << " Group: " << i->group << std::endl;
-        ++i;
-    }
-    std::cout << "subnet list dump:" << std::endl;
-    std::list<subnetstruct>::const_iterator j = ipsubnetlist.begin();
-    while (j != ipsubnetlist.end()) {
-        std::cout << "Masked IP: " << j->maskedaddr << " Mask: " << j->mask << " Group: " << j->group << std::endl;
-        ++j;
-    }
-    std::cout << "range list dump:" << std::endl;
-    std::list<rangestruct>::const_iterator k = iprangelist.begin();
-    while (k != iprangelist.end()) {
-        std::cout << "Start IP: " << k->startaddr << " End IP: " << k->endaddr << " Group: " << k->group << std::endl;
-        ++k;
-    }
+    std::cout << "IPs, subnets & ranges: " << iptree.size() << " prefixes" << std::endl;
 #endif
     // return either warning or success
     return warn ? 1 : 0;
@@ -17,10 +17,13 @@
 #include <stddef.h>
 #include <syslog.h>
 #include <iconv.h>
+#include <ctime>
+#include <sys/mman.h>
 
 // DEFINES
 
 extern OptionContainer o;
+extern bool is_daemonised;
 
 // NTLM username grabbing needs to be independent of endianness
 
@@ -45,14 +48,34 @@ extern OptionContainer o;
 #define WSWAP(x) (x)
 #endif
 
+#define NTLM_CACHE_USERS 4 // users remembered per client IP
+#define NTLM_CACHE_IP_SIZE 46 // INET6_ADDRSTRLEN
+#define NTLM_CACHE_USER_SIZE 256
+
 // DECLARATIONS
 
+// identity cache, shared between all the children: the users who have recently
+// completed NTLM authentication from each client IP, and their filter groups
+struct ntlm_cache_user {
+    unsigned long userhash;
+    time_t stored;
+    int fg;
+    char user[NTLM_CACHE_USER_SIZE];
+};
+
+struct ntlm_cache_slot {
+    volatile int lock;
+    char ip[NTLM_CACHE_IP_SIZE];
+    bool shared; // more than one user has authenticated from this IP
+    ntlm_cache_user users[NTLM_CACHE_USERS];
+};
+
 // class name is relevant!
 class ntlminstance : public AuthPlugin
 {
     public:
     ntlminstance(ConfigVar &definition)
-        : AuthPlugin(definition), no_auth_list(-1)
+        : AuthPlugin(definition), no_auth_list(-1), cache(NULL), cacheslots(0), cachettl(0), cachestrict(true), lastfg(-1)
     {
         // keep credentials for all requests on a given persistent connection;
         // NTLM proxy auth is designed to be used in this manner and won't re-send credentials.
@@ -80,6 +103,7 @@ class ntlminstance : public AuthPlugin
     };
 
     int identify(Socket &peercon, Socket &proxycon, HTTPHeader &h, std::string &string);
+    int determineGroup(std::string &user, int &fg);
 
     int init(void *args);
     int quit();
@@ -91,6 +115,20 @@ class ntlminstance : public AuthPlugin
     int transparent_port;
     char hostname[256];
     int no_auth_list;
+
+    // identity cache - see identitycachettl in proxy-ntlm.conf
+    ntlm_cache_slot *cache;
+    int cacheslots;
+    int cachettl;
+    bool cachestrict;
+
+    // user given out by the last call to identify, and their group if known
+    std::string lastuser;
+    int lastfg;
+
+    ntlm_cache_slot *cacheSlot(const std::string &ip);
+    bool lookupIdentity(const std::string &ip, std::string &user, int &fg);
+    void rememberIdentity(const std::string &ip, std::string &user);
 };
 
 // things need to be on byte boundaries here
@@ -157,6 +195,27 @@ int ntlminstance::identify(Socket &peercon, Socket &proxycon, HTTPHeader &h, std
     Socket *upstreamcon;
     Socket ntlmcon;
     String url;
+    std::string cacheip;
+
+    lastfg = -1;
+    if (cache != NULL) {
+        // never from X-Forwarded-For - anyone could claim a cached user's IP
+        cacheip = peercon.getPeerIP();
+        // no negotiation under way on this connection - if this client has
+        // authenticated recently, take their word for it rather than starting one.
+        // when strict, only until they negotiate again, which may be as someone else
+        int fg;
+        if (h.getAuthType().length() == 0 && !(transparent && h.getUrl().contains("?sgtransntlmdest="))
+            && lookupIdentity(cacheip, string, fg)) {
+#ifdef DGDEBUG
+            std::cout << "NTLM - cached identity " << string << " for " << cacheip << std::endl;
+#endif
+            lastuser = string;
+            lastfg = fg;
+            return cachestrict ? DGAUTH_OK_NOPERSIST : DGAUTH_OK;
+        }
+    }
+
     if (transparent) {
         // we are actually sending to a second Squid, which just does NTLM
         ntlmcon.connect(transparent_ip, transparent_port);
@@ -467,6 +526,8 @@ int ntlminstance::identify(Socket &peercon, Socket &proxycon, HTTPHeader &h, std
 #endif
                     string = username;
                 }
+                if (cache != NULL)
+                    rememberIdentity(cacheip, string);
                 if (!transparent)
                     return DGAUTH_OK;
                 // if in transparent mode, send a redirect to the client's original requested URL,
@@ -501,6 +562,28 @@ int ntlminstance::identify(Socket &peercon, Socket &proxycon, HTTPHeader &h, std
 
 int ntlminstance::init(void *args)
 {
+    // remember who has authenticated from where, for identitycachettl seconds
+    cachettl = cv["identitycachettl"].toInteger();
+    if (cv["identitycachesize"] == "")
+        cacheslots = 1024;
+    else
+        cacheslots = cv["identitycachesize"].toInteger();
+    if (cv["identitycachebinding"] == "ip")
+        cachestrict = false;
+    else if (cv["identitycachebinding"] != "" && cv["identitycachebinding"] != "strict") {
+        if (!is_daemonised)
+            std::cerr << "NTLM: identitycachebinding must be 'strict' or 'ip'" << std::endl;
+        syslog(LOG_ERR, "NTLM: identitycachebinding must be 'strict' or 'ip'");
+        return -1;
+    }
+    if (cache == NULL && cachettl > 0 && cacheslots > 0) {
+        void *mem = mmap(NULL, cacheslots * sizeof(ntlm_cache_slot), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+            syslog(LOG_ERR, "NTLM: Unable to allocate shared memory for identity cache - not caching");
+        else
+            cache = (ntlm_cache_slot *)mem;
+    }
+
     // Load up the list of no-auth domains, if enabled
 /*    if (!cv["noauthdomains"].empty()) {
 #ifdef DGDEBUG
@@ -523,6 +606,10 @@ int ntlminstance::init(void *args)
 
 int ntlminstance::quit()
 {
+    if (cache != NULL) {
+        munmap(cache, cacheslots * sizeof(ntlm_cache_slot));
+        cache = NULL;
+    }
 /*
     if (no_auth_list >= 0)
         o.lm.deRefList(no_auth_list);
@@ -535,3 +622,103 @@ bool ntlminstance::isTransparent()
 {
     return transparent;
 }
+
+// group of a user - known already if identify has just given them out
+int ntlminstance::determineGroup(std::string &user, int &fg)
+{
+    if (lastfg >= 0 && user == lastuser) {
+        fg = lastfg;
+        return DGAUTH_OK;
+    }
+    return AuthPlugin::determineGroup(user, fg);
+}
+
+static unsigned long hashString(const char *s)
+{
+    // FNV-1a
+    unsigned long h = 2166136261UL;
+    for (; *s; s++) {
+        h ^= (unsigned char)*s;
+        h *= 16777619UL;
+    }
+    return h;
+}
+
+ntlm_cache_slot *ntlminstance::cacheSlot(const std::string &ip)
+{
+    return &cache[hashString(ip.c_str()) % cacheslots];
+}
+
+// find who has authenticated from this IP within the last identitycachettl seconds.
+// when strict, only if it was just the one user. in transparent mode nobody is
+// ever made to negotiate once found here, so a shared machine is never looked up
+// at all. slots are never waited for - if another child has this one locked,
+// negotiate as if nothing were cached
+bool ntlminstance::lookupIdentity(const std::string &ip, std::string &user, int &fg)
+{
+    ntlm_cache_slot *slot = cacheSlot(ip);
+    if (__sync_lock_test_and_set(&slot->lock, 1) != 0)
+        return false;
+    bool found = false;
+    if (ip == slot->ip && !(transparent && slot->shared)) {
+        time_t now = time(NULL);
+        ntlm_cache_user *latest = NULL;
+        int users = 0;
+        for (int i = 0; i < NTLM_CACHE_USERS; i++) {
+            ntlm_cache_user *u = &slot->users[i];
+            if (u->stored + cachettl > now) {
+                users++;
+                if (latest == NULL || u->stored > latest->stored)
+                    latest = u;
+            }
+        }
+        if (latest != NULL && (users == 1 || !cachestrict)) {
+            user = latest->user;
+            fg = latest->fg;
+            found = true;
+        }
+    }
+    __sync_lock_release(&slot->lock);
+    return found;
+}
+
+// a user has completed NTLM authentication from this IP: look up their group and
+// remember both, replacing whoever has been there least recently if the IP has
+// already had NTLM_CACHE_USERS. the username is lowercased, as determineGroup does
+void ntlminstance::rememberIdentity(const std::string &ip, std::string &user)
+{
+    int fg = 0;
+    if (AuthPlugin::determineGroup(user, fg) != DGAUTH_OK)
+        fg = 0; // as ConnectionHandler does for users with no group
+    lastuser = user;
+    lastfg = fg;
+    if (ip.length() >= NTLM_CACHE_IP_SIZE || user.length() >= NTLM_CACHE_USER_SIZE || user.length() == 0)
+        return;
+
+    ntlm_cache_slot *slot = cacheSlot(ip);
+    if (__sync_lock_test_and_set(&slot->lock, 1) != 0)
+        return;
+    if (ip != slot->ip) {
+        memset(slot->users, 0, sizeof(slot->users));
+        strcpy(slot->ip, ip.c_str());
+        slot->shared = false;
+    }
+    unsigned long userhash = hashString(user.c_str());
+    ntlm_cache_user *u = NULL;
+    ntlm_cache_user *oldest = &slot->users[0];
+    for (int i = 0; i < NTLM_CACHE_USERS; i++) {
+        if (slot->users[i].userhash == userhash && user == slot->users[i].user)
+            u = &slot->users[i];
+        else if (slot->users[i].stored != 0)
+            slot->shared = true;
+        if (slot->users[i].stored < oldest->stored)
+            oldest = &slot->users[i];
+    }
+    if (u == NULL)
+        u = oldest;
+    u->userhash = userhash;
+    u->stored = time(NULL);
+    u->fg = fg;
+    strcpy(u->user, user.c_str());
+    __sync_lock_release(&slot->lock);
+}
@@ -143,6 +143,7 @@ int avastdinstance::scanFile(HTTPHeader *requestheader, HTTPHeader *docheader, c
         syslog(LOG_ERR, "Error connecting to AvastD socket");
         return DGCS_SCANERROR;
     }
+    setCancellable(stripedsocks.getFD());
 
     char buffer[4096];
     int rc;
@@ -153,7 +154,7 @@ int avastdinstance::scanFile(HTTPHeader *requestheader, HTTPHeader *docheader, c
     try {
         // After connecting, the daemon sends the following welcome message:
         // 220 Welcome to avast! Virus scanning daemon x.x (VPS yy-yy dd.mm.yyyy)
-        rc = stripedsocks.getLine(buffer, sizeof(buffer), o.content_scanner_timeout);
+        rc = stripedsocks.getLine(buffer, sizeof(buffer), scanTimeout());
 #ifdef DGDEBUG
         std::cout << "Got from avastd: " << encode(buffer) << std::endl;
 #endif
@@ -162,6 +163,7 @@ int avastdinstance::scanFile(HTTPHeader *requestheader, HTTPHeader *docheader, c
             String ebuffer(encode(buffer));
             lastmessage += ebuffer;
             syslog(LOG_ERR, "Unexpected reply during AvastD handshake: %s", ebuffer.toCharArray());
+            clearCancellable();
             return DGCS_SCANERROR;
         }
         // Syntax:
@@ -180,7 +182,7 @@ int avastdinstance::scanFile(HTTPHeader *requestheader, HTTPHeader *docheader, c
         //         451 Engine error %d
         //         200 OK
 
-        rc = stripedsocks.getLine(buffer, sizeof(buffer), o.content_scanner_timeout);
+        rc = stripedsocks.getLine(buffer, sizeof(buffer), scanTimeout());
 #ifdef DGDEBUG
         std::cout << "Got from avastd: " << encode(buffer) << std::endl;
 #endif
@@ -189,6 +191,7 @@ int avastdinstance::scanFile(HTTPHeader *requestheader, HTTPHeader *docheader, c
             String ebuffer(encode(buffer));
             lastmessage += ebuffer;
             syslog(LOG_ERR, "Unexpected reply to scan command: %s", ebuffer.toCharArray());
+            clearCancellable();
             return DGCS_SCANERROR;
         }
 
@@ -204,10 +207,10 @@ int avastdinstance::scanFile(HTTPHeader *requestheader, HTTPHeader *docheader, c
         // Following these lines there is a blank line which signals the end of data
         // transter from the daemon side.
 
-        for (rc = stripedsocks.getLine(buffer, sizeof(buffer), o.content_scanner_timeout, false, NULL, &truncated);
+        for (rc = stripedsocks.getLine(buffer, sizeof(buffer), scanTimeout(), false, NULL, &truncated);
              rc > 0 && !truncated && buffer[0] != '\r';
 
-             rc = stripedsocks.getLine(buffer, sizeof(buffer), o.content_scanner_timeout, false, NULL, &truncated)) {
+             rc = stripedsocks.getLine(buffer, sizeof(buffer), scanTimeout(), false, NULL, &truncated)) {
 #ifdef DGDEBUG
             std::cout << "Got from avastd: " << encode(buffer) << std::endl;
 #endif
@@ -216,6 +219,7 @@ int avastdinstance::scanFile(HTTPHeader *requestheader, HTTPHeader *docheader, c
             if (buffer[rc - 1] != '\r') {
                 lastmessage = "Error whilst reading AvastD socket: can't fit line in buffer.";
                 syslog(LOG_ERR, "Error whilst reading AvastD socket: can't fit line in buffer.");
+                clearCancellable();
                 return DGCS_SCANERROR;
             }
 
@@ -232,6 +236,7 @@ int avastdinstance::scanFile(HTTPHeader *requestheader, HTTPHeader *docheader, c
                     String ebuffer(encode(buffer));
                     lastmessage += ebuffer;
                     syslog(LOG_ERR, "Unexpected reply in scan results: %s", ebuffer.toCharArray());
+                    clearCancellable();
                     return DGCS_SCANERROR;
                 }
                 *result = '\0';
@@ -275,8 +280,10 @@ int avastdinstance::scanFile(HTTPHeader *requestheader, HTTPHeader *docheader, c
         lastmessage = "Exception whilst reading AvastD socket: ";
         lastmessage += e.what();
         syslog(LOG_ERR, "Exception whilst reading AvastD socket: %s", e.what());
+        clearCancellable();
         return DGCS_SCANERROR;
     }
+    clearCancellable();
 #ifdef DGDEBUG
     std::cout << "avastd final result: infected: " << infected << "\twarning: " << warning << "\tlastvirusname: " << lastvirusname << "\ttruncated: " << truncated << std::endl;
 #endif
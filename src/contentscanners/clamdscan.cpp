@@ -19,8 +19,18 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
 #include <unistd.h>
 
+// DEFINES
+
+// largest chunk sent in one go with INSTREAM
+#define CLAMD_STREAM_CHUNK 65536
+// how often to ask ClamD which signatures it has loaded
+#define CLAMD_VERSION_CHECK 60
+
 // GLOBALS
 
 extern OptionContainer o;
@@ -33,15 +43,23 @@ class clamdinstance : public CSPlugin
 {
     public:
     clamdinstance(ConfigVar &definition)
-        : CSPlugin(definition), archivewarn(false){};
+        : CSPlugin(definition), archivewarn(false), scanmode(CLAMD_FILDES), usesession(false),
+          session(NULL), sessionid(0), versionchecked(0){};
 
-    // we are not replacing scanTest or scanMemory
-    // but for scanFile and the default scanMemory to work, we need a working scanFile implementation
+    // memory is streamed straight to ClamD rather than written to a temp file first
+    // (unless scanmode is "scan", when the default scanMemory does just that)
+    int scanMemory(HTTPHeader *requestheader, HTTPHeader *docheader, const char *user, int filtergroup,
+        const char *ip, const char *object, unsigned int objectsize, NaughtyFilter *checkme,
+        const String *disposition, const String *mimetype);
     int scanFile(HTTPHeader *requestheader, HTTPHeader *docheader, const char *user, int filtergroup,
         const char *ip, const char *filename, NaughtyFilter *checkme,
         const String *disposition, const String *mimetype);
 
+    // ClamD's VERSION reply, which includes the signature database version & date
+    String getScannerVersion();
+
     int init(void *args);
+    int quit();
 
     private:
     // ClamD UNIX domain socket path
@@ -50,6 +68,27 @@ class clamdinstance : public CSPlugin
     String pathprefix;
     // Whether or not to just issue a warning on archive limit/encryption warnings
     bool archivewarn;
+
+    // how data gets to ClamD - by file name (SCAN), by passing it an open
+    // file descriptor (FILDES), or over the socket itself (INSTREAM)
+    enum { CLAMD_SCAN, CLAMD_FILDES, CLAMD_INSTREAM } scanmode;
+    // keep an IDSESSION open so that one connection serves many scans
+    bool usesession;
+    UDSocket *session;
+    unsigned int sessionid;
+
+    String version;
+    time_t versionchecked;
+
+    // a connection to ClamD - the open session if there is one
+    UDSocket *getSocket(bool &reused);
+    void releaseSocket(UDSocket *sock, bool ok);
+    // send the data with the configured command & get ClamD's reply,
+    // trying again on a new connection if a kept session has gone
+    int runScan(const char *filename, int fd, const char *object, off_t objectsize, NaughtyFilter *checkme);
+    bool sendScan(UDSocket &sock, const char *filename, int fd, const char *object, off_t objectsize);
+    bool sendStream(UDSocket &sock, const char *block, int len);
+    int interpretReply(String &reply, NaughtyFilter *checkme);
 };
 
 // IMPLEMENTATION
@@ -86,80 +125,327 @@ int clamdinstance::init(void *args)
 
     archivewarn = cv["archivewarn"] == "on";
 
+    if (cv["scanmode"] == "scan")
+        scanmode = CLAMD_SCAN;
+    else if (cv["scanmode"] == "instream")
+        scanmode = CLAMD_INSTREAM;
+    else
+        scanmode = CLAMD_FILDES;
+    usesession = cv["session"] == "on";
+
+    return DGCS_OK;
+}
+
+int clamdinstance::quit()
+{
+    if (session != NULL) {
+        try {
+            session->writeString("nEND\n");
+        } catch (std::exception &e) {
+        }
+        session->close();
+        delete session;
+        session = NULL;
+    }
     return DGCS_OK;
 }
 
-// no need to replace the inheritied scanMemory() which just calls scanFile()
-// there is no capability to scan memory with clamdscan as we pass it
-// a file name to scan.  So we save the memory to disk and pass that.
-// Then delete the temp file.
+int clamdinstance::scanMemory(HTTPHeader *requestheader, HTTPHeader *docheader, const char *user,
+    int filtergroup, const char *ip, const char *object, unsigned int objectsize, NaughtyFilter *checkme,
+    const String *disposition, const String *mimetype)
+{
+    if (scanmode == CLAMD_SCAN)
+        return CSPlugin::scanMemory(requestheader, docheader, user, filtergroup, ip, object, objectsize,
+            checkme, disposition, mimetype);
+    lastmessage = lastvirusname = "";
+    return runScan(NULL, -1, object, objectsize, checkme);
+}
+
 int clamdinstance::scanFile(HTTPHeader *requestheader, HTTPHeader *docheader, const char *user,
     int filtergroup, const char *ip, const char *filename, NaughtyFilter *checkme,
     const String *disposition, const String *mimetype)
 {
     lastmessage = lastvirusname = "";
-    // mkstemp seems to only set owner permissions, so our AV daemon won't be
-    // able to read the file, unless it's running as the same user as us. that's
-    // not usually very convenient. so instead, just allow group read on the
-    // file, and tell users to make sure the daemongroup option is friendly to
-    // the AV daemon's group membership.
-    // TODO? chmod can error out with EINTR, we may wish to ignore this
-    if (chmod(filename, S_IRGRP | S_IRUSR) != 0) {
-        lastmessage = "Error giving ClamD read access to temp file";
-        syslog(LOG_ERR, "Could not change file ownership to give ClamD read access: %s", strerror(errno));
+    if (scanmode == CLAMD_SCAN) {
+        // mkstemp seems to only set owner permissions, so our AV daemon won't be
+        // able to read the file, unless it's running as the same user as us. that's
+        // not usually very convenient. so instead, just allow group read on the
+        // file, and tell users to make sure the daemongroup option is friendly to
+        // the AV daemon's group membership.
+        // TODO? chmod can error out with EINTR, we may wish to ignore this
+        if (chmod(filename, S_IRGRP | S_IRUSR) != 0) {
+            lastmessage = "Error giving ClamD read access to temp file";
+            syslog(LOG_ERR, "Could not change file ownership to give ClamD read access: %s", strerror(errno));
+            return DGCS_SCANERROR;
+        };
+        return runScan(filename, -1, NULL, 0, checkme);
+    }
+
+    // we already have the file open for reading, ClamD doesn't need permission to it
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        lastmessage = "Error opening file to send to ClamD";
+        syslog(LOG_ERR, "Error opening file to send to ClamD: %s", strerror(errno));
         return DGCS_SCANERROR;
-    };
-    String command("SCAN ");
-    if (pathprefix.length()) {
-        String fname(filename);
-        command += fname.after(pathprefix.toCharArray());
-    } else {
-        command += filename;
     }
-    command += "\r\n";
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        lastmessage = "Error reading file to send to ClamD";
+        syslog(LOG_ERR, "Error reading file to send to ClamD: %s", strerror(errno));
+        close(fd);
+        return DGCS_SCANERROR;
+    }
+    int rc = runScan(NULL, fd, NULL, st.st_size, checkme);
+    close(fd);
+    return rc;
+}
+
+String clamdinstance::getScannerVersion()
+{
+    time_t now = time(NULL);
+    if (now - versionchecked < CLAMD_VERSION_CHECK)
+        return version;
+    versionchecked = now;
+
+    bool reused;
+    UDSocket *sock = getSocket(reused);
+    if (sock == NULL)
+        return version;
+    char buff[1024];
+    try {
+        sock->writeString("nVERSION\n");
+        if (sock == session)
+            sessionid++;
+        if (sock->getLine(buff, sizeof(buff), scanTimeout()) <= 0)
+            throw std::runtime_error("No reply");
+    } catch (std::exception &e) {
+        // keep the last version known - the next scan will find out what's wrong
+        releaseSocket(sock, false);
+        return version;
+    }
+    String reply(buff);
+    reply.removeWhiteSpace();
+    // a reply for some other request in the session is no answer at all - keep
+    // the last version known, and have the next check start a new session
+    bool ok = true;
+    if (sock == session) {
+        if (reply.before(":").toInteger() != (int)sessionid) {
+            syslog(LOG_ERR, "ClamD reply was for request %s, not %u", reply.before(":").toCharArray(), sessionid);
+            ok = false;
+            versionchecked = 0;
+        }
+        reply = reply.after(": ");
+    }
+    releaseSocket(sock, ok);
+    if (ok)
+        version = reply;
 #ifdef DGDEBUG
-    std::cerr << "clamdscan command:" << command << std::endl;
+    std::cout << "ClamD version: " << version << std::endl;
 #endif
-    UDSocket stripedsocks;
-    if (stripedsocks.getFD() < 0) {
+    return version;
+}
+
+// the kept session, unless ClamD has closed it (it does when it has been idle
+// for its IdleTimeout), else a new connection - starting a session on it if wanted
+UDSocket *clamdinstance::getSocket(bool &reused)
+{
+    reused = false;
+    if (session != NULL) {
+        // nothing should be waiting on an idle session; if there is, it's the close
+        if (!session->checkForInput()) {
+            reused = true;
+            return session;
+        }
+        session->close();
+        delete session;
+        session = NULL;
+    }
+
+    UDSocket *sock = new UDSocket;
+    if (sock->getFD() < 0) {
         lastmessage = "Error opening socket to talk to ClamD";
         syslog(LOG_ERR, "Error creating socket for talking to ClamD");
-        return DGCS_SCANERROR;
+        delete sock;
+        return NULL;
     }
-    if (stripedsocks.connect(udspath.toCharArray()) < 0) {
+    if (sock->connect(udspath.toCharArray()) < 0) {
         lastmessage = "Error connecting to ClamD socket";
         syslog(LOG_ERR, "Error connecting to ClamD socket");
-        stripedsocks.close();
-        return DGCS_SCANERROR;
+        sock->close();
+        delete sock;
+        return NULL;
     }
-    try {
-        stripedsocks.writeString(command.toCharArray());
-    } catch (std::exception &e) {
-        stripedsocks.close();
-        lastmessage = "Exception whilst writing to ClamD socket: ";
-        lastmessage += e.what();
-        syslog(LOG_ERR, "Exception whilst writing to ClamD socket: %s", e.what());
-        return DGCS_SCANERROR;
+    if (usesession) {
+        try {
+            sock->writeString("nIDSESSION\n");
+            session = sock;
+            sessionid = 0;
+        } catch (std::exception &e) {
+            syslog(LOG_ERR, "Could not start ClamD session: %s", e.what());
+        }
     }
-    char *buff = new char[4096];
-    int rc;
-    try {
-        rc = stripedsocks.getLine(buff, 4096, o.content_scanner_timeout);
-    } catch (std::exception &e) {
-        delete[] buff;
-        stripedsocks.close();
-        lastmessage = "Exception whist reading ClamD socket: ";
-        lastmessage += e.what();
-        syslog(LOG_ERR, "Exception whilst reading ClamD socket: %s", e.what());
-        return DGCS_SCANERROR;
+    return sock;
+}
+
+void clamdinstance::releaseSocket(UDSocket *sock, bool ok)
+{
+    if (sock == session) {
+        if (ok)
+            return;
+        session = NULL;
     }
-    String reply(buff);
-    delete[] buff;
-    reply.removeWhiteSpace();
+    sock->close();
+    delete sock;
+}
+
+// write one INSTREAM chunk - length in network byte order, then the data
+bool clamdinstance::sendStream(UDSocket &sock, const char *block, int len)
+{
+    uint32_t chunklen = htonl(len);
+    if (!sock.writeToSocket((char *)&chunklen, sizeof(chunklen), 0, scanTimeout()))
+        return false;
+    return (len == 0) || sock.writeToSocket(block, len, 0, scanTimeout());
+}
+
+// send the scan command - SCAN for a named file, FILDES to pass fd over the socket,
+// otherwise stream the memory object or the contents of fd with INSTREAM
+bool clamdinstance::sendScan(UDSocket &sock, const char *filename, int fd, const char *object, off_t objectsize)
+{
+    if (filename != NULL) {
+        String command("nSCAN ");
+        if (pathprefix.length()) {
+            String fname(filename);
+            command += fname.after(pathprefix.toCharArray());
+        } else {
+            command += filename;
+        }
+        command += "\n";
 #ifdef DGDEBUG
-    std::cout << "Got from clamdscan: " << reply << std::endl;
+        std::cerr << "clamdscan command:" << command << std::endl;
 #endif
-    stripedsocks.close();
+        sock.writeString(command.toCharArray());
+        return true;
+    }
+
+    if (fd >= 0 && scanmode == CLAMD_FILDES) {
+        sock.writeString("nFILDES\n");
+        // the descriptor goes as ancillary data alongside a single dummy byte
+        char dummy = 0;
+        struct iovec iov;
+        iov.iov_base = &dummy;
+        iov.iov_len = 1;
+        char control[CMSG_SPACE(sizeof(int))];
+        memset(control, 0, sizeof(control));
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+        int rc;
+        do {
+            rc = sendmsg(sock.getFD(), &msg, 0);
+        } while (rc < 0 && errno == EINTR);
+        return rc == 1;
+    }
+
+    sock.writeString("nINSTREAM\n");
+    if (object != NULL) {
+        for (off_t sent = 0; sent < objectsize; sent += CLAMD_STREAM_CHUNK) {
+            int len = (objectsize - sent > CLAMD_STREAM_CHUNK) ? CLAMD_STREAM_CHUNK : objectsize - sent;
+            if (!sendStream(sock, object + sent, len))
+                return false;
+        }
+    } else {
+        char *block = new char[CLAMD_STREAM_CHUNK];
+        int rc;
+        lseek(fd, 0, SEEK_SET);
+        while ((rc = readEINTR(fd, block, CLAMD_STREAM_CHUNK)) > 0) {
+            if (!sendStream(sock, block, rc)) {
+                delete[] block;
+                return false;
+            }
+        }
+        delete[] block;
+        if (rc < 0)
+            return false;
+    }
+    return sendStream(sock, NULL, 0); // end marker
+}
+
+int clamdinstance::runScan(const char *filename, int fd, const char *object, off_t objectsize, NaughtyFilter *checkme)
+{
+    for (int attempt = 0; attempt < 2; attempt++) {
+        bool reused;
+        UDSocket *sock = getSocket(reused);
+        if (sock == NULL)
+            return DGCS_SCANERROR;
+        setCancellable(sock->getFD());
+        char *buff = new char[4096];
+        int rc = 0;
+        try {
+            if (!sendScan(*sock, filename, fd, object, objectsize))
+                throw std::runtime_error(strerror(errno));
+            if (sock == session)
+                sessionid++;
+            rc = sock->getLine(buff, 4096, scanTimeout());
+        } catch (std::exception &e) {
+            clearCancellable();
+            delete[] buff;
+            releaseSocket(sock, false);
+            // a kept session may have timed out under us - have one more go on a new connection
+            if (reused && !isCancelled())
+                continue;
+            lastmessage = "Exception whilst talking to ClamD: ";
+            lastmessage += e.what();
+            syslog(LOG_ERR, "Exception whilst talking to ClamD: %s", e.what());
+            return DGCS_SCANERROR;
+        }
+        clearCancellable();
+        if (rc <= 0) {
+            delete[] buff;
+            releaseSocket(sock, false);
+            if (reused && !isCancelled())
+                continue;
+            lastmessage = "No reply from ClamD";
+            syslog(LOG_ERR, "No reply from ClamD");
+            return DGCS_SCANERROR;
+        }
+        String reply(buff);
+        delete[] buff;
+        reply.removeWhiteSpace();
+#ifdef DGDEBUG
+        std::cout << "Got from clamdscan: " << reply << std::endl;
+#endif
+        // replies within a session are prefixed with the number of the request -
+        // one for any other request means the session is out of step, and the
+        // reply isn't about this file at all
+        if (sock == session) {
+            if (reply.before(":").toInteger() != (int)sessionid) {
+                releaseSocket(sock, false);
+                if (reused && !isCancelled())
+                    continue;
+                lastmessage = "ClamD session out of step";
+                syslog(LOG_ERR, "ClamD reply was for request %s, not %u", reply.before(":").toCharArray(), sessionid);
+                return DGCS_SCANERROR;
+            }
+            reply = reply.after(": ");
+        }
+        releaseSocket(sock, !reply.endsWith("ERROR") && !isCancelled());
+        return interpretReply(reply, checkme);
+    }
+    lastmessage = "Error talking to ClamD";
+    syslog(LOG_ERR, "Error talking to ClamD after reconnecting");
+    return DGCS_SCANERROR;
+}
+
+int clamdinstance::interpretReply(String &reply, NaughtyFilter *checkme)
+{
     if (reply.endsWith("ERROR")) {
         lastmessage = reply;
         syslog(LOG_ERR, "ClamD error: %s", reply.toCharArray());
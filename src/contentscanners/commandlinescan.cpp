@@ -22,6 +22,8 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include <spawn.h>
+#include <csignal>
 #include <list>
 #include <cstdio>
 #include <cstdlib>
@@ -30,6 +32,7 @@
 
 extern OptionContainer o;
 extern bool is_daemonised;
+extern char **environ;
 
 // IMPLEMENTATION
 
@@ -124,7 +127,7 @@ int commandlineinstance::init(void *args)
     arguments[numarguments + 1] = NULL;
     int count = 0;
     for (std::list<std::string>::iterator i = temparguments.begin(); i != temparguments.end(); i++) {
-        char *newthing = new char[i->length()];
+        char *newthing = new char[i->length() + 1];
         strcpy(newthing, i->c_str());
         arguments[count++] = newthing;
     }
@@ -242,42 +245,63 @@ int commandlineinstance::init(void *args)
 int commandlineinstance::scanFile(HTTPHeader *requestheader, HTTPHeader *docheader, const char *user, int filtergroup,
     const char *ip, const char *filename, NaughtyFilter *checkme, const String *disposition, const String *mimetype)
 {
-    // create socket pairs for child (scanner) process's stdout & stderr
+    // create socket pairs for child (scanner) process's stdout & stderr.
+    // close-on-exec, as with parallelscan another thread may be starting a
+    // scanner of its own, which mustn't inherit these and hold them open
     int scannerstdout[2];
     int scannerstderr[2];
-    if (socketpair(AF_UNIX, SOCK_STREAM, 0, scannerstdout) == -1) {
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, scannerstdout) == -1) {
         lastmessage = "Cannot create sockets for communicating with scanner";
         syslog(LOG_ERR, "Cannot open socket pair for command-line scanner's stdout: %s", strerror(errno));
         return DGCS_SCANERROR;
     }
-    if (socketpair(AF_UNIX, SOCK_STREAM, 0, scannerstderr) == -1) {
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, scannerstderr) == -1) {
         lastmessage = "Cannot create sockets for communicating with scanner";
         syslog(LOG_ERR, "Cannot open socket pair for command-line scanner's stderr: %s", strerror(errno));
+        close(scannerstdout[0]);
+        close(scannerstdout[1]);
         return DGCS_SCANERROR;
     }
-    int f = fork();
-    if (f == 0) {
+    // posix_spawn rather than fork & exec - the child doesn't need a copy of
+    // our page tables (large with big lists loaded) just to replace them.
+    // it gets its own process group, so that anything the scanner starts is
+    // killed with it if the scan is cancelled
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    // bind stdout & stderr - the copies made by dup2 lose close-on-exec
+    posix_spawn_file_actions_adddup2(&actions, scannerstdout[1], 1);
+    posix_spawn_file_actions_adddup2(&actions, scannerstderr[1], 2);
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+    posix_spawnattr_setpgroup(&attr, 0);
+    sigset_t sigs;
+    sigemptyset(&sigs);
+    posix_spawnattr_setsigmask(&attr, &sigs);
+    sigaddset(&sigs, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &sigs);
+
 #ifdef DGDEBUG
-        std::cout << "Running: " << progname.toCharArray() << " " << filename << std::endl;
+    std::cout << "Running: " << progname.toCharArray() << " " << filename << std::endl;
 #endif
-        // close read ends of sockets
+    arguments[numarguments] = (char *)filename;
+    pid_t f;
+    int rc = posix_spawn(&f, arguments[0], &actions, &attr, arguments, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (rc != 0) {
+        lastmessage = "Cannot launch scanner";
+        syslog(LOG_ERR, "Cannot launch command-line scanner (command \"%s %s\"): %s", progname.toCharArray(), filename, strerror(rc));
         close(scannerstdout[0]);
+        close(scannerstdout[1]);
         close(scannerstderr[0]);
-        // bind stdout & stderr
-        dup2(scannerstdout[1], 1);
-        dup2(scannerstderr[1], 2);
-        // execute scanner
-        arguments[numarguments] = (char *)filename;
-        execv(arguments[0], arguments);
-        // if we get here, an error occurred!
-        syslog(LOG_ERR, "Cannot exec command-line scanner (command \"%s %s\"): %s", progname.toCharArray(), filename, strerror(errno));
-        _exit(255);
-    } else if (f == -1) {
-        lastmessage = "Cannot launch scanner";
-        syslog(LOG_ERR, "Cannot fork to launch command-line scanner (command \"%s %s\"): %s", progname.toCharArray(), filename, strerror(errno));
+        close(scannerstderr[1]);
         return DGCS_SCANERROR;
     }
 
+    // a cancelled scan kills the scanner, which also ends its output
+    setCancellable(-1, -f);
+
     // close write ends of sockets
     close(scannerstdout[1]);
     close(scannerstderr[1]);
@@ -299,21 +323,25 @@ int commandlineinstance::scanFile(HTTPHeader *requestheader, HTTPHeader *dochead
 #endif
             result += buff;
     }
+    // (fclose has closed the read ends too - closing them again could close
+    // another scanner's socket, with parallelscan)
     fclose(readme);
 
-    // close read ends too now
-    close(scannerstdout[0]);
-    close(scannerstderr[0]);
-
     // wait for scanner to quit & retrieve exit status
+    // (no longer to be killed - once reaped, its pid could be anyone's)
+    clearCancellable();
     int returncode;
-    returncode = WEXITSTATUS(returncode);
-
     if (waitpid(f, &returncode, 0) == -1) {
         lastmessage = "Cannot get scanner return code";
         syslog(LOG_ERR, "Cannot get command-line scanner return code: %s", strerror(errno));
         return DGCS_SCANERROR;
     }
+    // killed (possibly by a cancelled scan) rather than finished
+    if (!WIFEXITED(returncode)) {
+        lastmessage = "Scanner did not finish";
+        return DGCS_SCANERROR;
+    }
+    returncode = WEXITSTATUS(returncode);
 
 #ifdef DGDEBUG
     std::cout << "Scanner result" << std::endl
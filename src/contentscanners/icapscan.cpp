@@ -22,6 +22,9 @@
 #include <unistd.h>
 #include <netdb.h> // for gethostby
 #include <cstdio>
+#include <cerrno>
+#include <csignal>
+#include <sys/mman.h>
 
 // DEFINES
 
@@ -40,7 +43,11 @@ class icapinstance : public CSPlugin
 {
     public:
     icapinstance(ConfigVar &definition)
-        : CSPlugin(definition), usepreviews(false), previewforce(false), previewsize(0), supportsXIF(false), needsBody(false){};
+        : CSPlugin(definition), usepreviews(false), previewforce(false), previewsize(0), supportsXIF(false), needsBody(false),
+          keepalive(false), probeinterval(0), maxconnections(0), optionsexpiry(0), reusable(false),
+          idlesock(NULL), idlesince(0), connslots(NULL), connslotcount(0), connslot(-1),
+          streaming(false), streamsock(NULL), streamdocheader(NULL), streamcheckme(NULL),
+          streaminpreview(false), streampreviewleft(0), streamverdict(0){};
 
     int willScanRequest(const String &url, const char *user, int filtergroup, const char *ip, bool post,
         bool reconstituted, bool exception, bool bypass);
@@ -52,7 +59,19 @@ class icapinstance : public CSPlugin
         const char *ip, const char *filename, NaughtyFilter *checkme,
         const String *disposition, const String *mimetype);
 
+    bool startStream(HTTPHeader *requestheader, HTTPHeader *docheader, NaughtyFilter *checkme);
+    bool streamBlock(const char *block, int len);
+    int endStream();
+    void abortStream();
+
+    // the service's ISTag, which it changes whenever its results might
+    String getScannerVersion()
+    {
+        return istag;
+    };
+
     int init(void *args);
+    int quit();
 
     private:
     // ICAP server hostname, IP and port
@@ -68,9 +87,55 @@ class icapinstance : public CSPlugin
     // supports X-Infection-Found and/or needs us to look at the whole body
     bool supportsXIF;
     bool needsBody;
+    // ISTag from the last OPTIONS or scan response
+    String istag;
+
+    // persistent connections: whether to keep them, how long one may sit idle
+    // before it gets an OPTIONS probe, and the server's limits from OPTIONS
+    bool keepalive;
+    unsigned int probeinterval;
+    unsigned int maxconnections;
+    time_t optionsexpiry;
+    // whether the last transaction on the connection ended cleanly enough to reuse it
+    bool reusable;
+    // connection kept by this child between scans
+    Socket *idlesock;
+    time_t idlesince;
+    // pids of children holding a kept connection, shared between all children so
+    // that together they stay within Max-Connections; connslot is ours, or -1
+    pid_t *connslots;
+    unsigned int connslotcount;
+    int connslot;
+
+    // streaming scans: the RESPMOD is started once the response headers are in
+    // and body chunks are sent as they are downloaded
+    bool streaming;
+    Socket *streamsock;
+    HTTPHeader *streamdocheader;
+    NaughtyFilter *streamcheckme;
+    bool streaminpreview;
+    unsigned int streampreviewleft;
+    // ICAP_CONTINUE until the server has answered
+    int streamverdict;
+    // start of the body, for servers that need it compared (needsBody)
+    std::string streamhead;
+    void writeChunk(Socket &icapsock, const char *block, unsigned int len);
+
+    // Get a connected socket, reusing the kept connection if it is still healthy
+    Socket *getConnection();
+    // Keep the socket for the next scan if possible, otherwise close it
+    void releaseConnection(Socket *icapsock);
+    bool claimConnSlot();
+    void freeConnSlot();
+    // Send an OPTIONS request and read the server's capabilities
+    bool doOptions(Socket &icapsock);
 
-    // Send ICAP request headers to server
-    bool doHeaders(Socket &icapsock, HTTPHeader *reqheader, HTTPHeader *respheader, unsigned int objectsize);
+    int doScanMemory(Socket &icapsock, HTTPHeader *requestheader, HTTPHeader *docheader,
+        const char *object, unsigned int objectsize, NaughtyFilter *checkme);
+    int doScanFile(Socket &icapsock, HTTPHeader *requestheader, HTTPHeader *docheader,
+        int filefd, NaughtyFilter *checkme);
+    // Send ICAP request headers to server - without the first chunk size if streamed
+    bool doHeaders(Socket &icapsock, HTTPHeader *reqheader, HTTPHeader *respheader, unsigned int objectsize, bool streamed = false);
     // Check data returned from ICAP server and return one of our standard return codes
     int doScan(Socket &icapsock, HTTPHeader *docheader, const char *object, unsigned int objectsize, NaughtyFilter *checkme);
 };
@@ -142,50 +207,28 @@ int icapinstance::init(void *args)
     std::cerr << "ICAP server address:" << icapip << std::endl;
 #endif
 
+    // ICAP/1.0 connections are persistent unless either end says otherwise
+    keepalive = (cv["keepalive"] != "off");
+    streaming = (cv["streaming"] == "on");
+    if (cv["probeinterval"] == "")
+        probeinterval = 30;
+    else
+        probeinterval = cv["probeinterval"].toInteger();
+
     // try to connect to the ICAP server and perform an OPTIONS request
     Socket icapsock;
     try {
         if (icapsock.connect(icapip.toCharArray(), icapport) < 0) {
             throw std::runtime_error("Could not connect to server");
         }
-        String line("OPTIONS " + icapurl + " ICAP/1.0\r\nHost: " + icaphost + "\r\n\r\n");
-        icapsock.writeString(line.toCharArray());
-        // parse the response
-        char buff[8192];
-        // first line - look for 200 OK
-        icapsock.getLine(buff, 8192, o.content_scanner_timeout);
-        line = buff;
-#ifdef DGDEBUG
-        std::cout << "ICAP/1.0 OPTIONS response:" << std::endl
-                  << line << std::endl;
-#endif
-        if (line.after(" ").before(" ") != "200") {
+        if (!doOptions(icapsock)) {
             if (!is_daemonised)
                 std::cerr << "ICAP response not 200 OK" << std::endl;
             syslog(LOG_ERR, "ICAP response not 200 OK");
             return DGCS_WARNING;
             //throw std::runtime_error("Response not 200 OK");
         }
-        while (icapsock.getLine(buff, 8192, o.content_scanner_timeout) > 0) {
-            line = buff;
-#ifdef DGDEBUG
-            std::cout << line << std::endl;
-#endif
-            if (line.startsWith("\r")) {
-                break;
-            } else if (line.startsWith("Preview:")) {
-                usepreviews = true;
-                previewsize = line.after(": ").toInteger();
-            } else if (line.startsWith("Server:")) {
-                if (line.contains("AntiVir-WebGate")) {
-                    needsBody = true;
-                }
-            } else if (line.startsWith("X-Allow-Out:")) {
-                if (line.contains("X-Infection-Found")) {
-                    supportsXIF = true;
-                }
-            }
-        }
+        // not kept - this is the parent, the children make their own
         icapsock.close();
     } catch (std::exception &e) {
         if (!is_daemonised)
@@ -199,9 +242,212 @@ int icapinstance::init(void *args)
     else
         std::cout << "Message previews disabled" << std::endl;
 #endif
+
+    // every child holds at most one kept connection
+    if (keepalive && connslots == NULL) {
+        connslotcount = (o.max_children > 0) ? o.max_children : 1;
+        void *mem = mmap(NULL, connslotcount * sizeof(pid_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            syslog(LOG_ERR, "Unable to allocate shared memory for ICAP connections - not keeping them");
+            keepalive = false;
+            connslotcount = 0;
+        } else {
+            connslots = (pid_t *)mem;
+        }
+    }
     return DGCS_OK;
 }
 
+int icapinstance::quit()
+{
+    abortStream();
+    if (idlesock != NULL) {
+        idlesock->close();
+        delete idlesock;
+        idlesock = NULL;
+    }
+    freeConnSlot();
+    if (connslots != NULL) {
+        munmap(connslots, connslotcount * sizeof(pid_t));
+        connslots = NULL;
+    }
+    return DGCS_OK;
+}
+
+// send OPTIONS down icapsock & read the server's capabilities from the response
+// returns false if it isn't 200 OK; throws if the connection fails
+bool icapinstance::doOptions(Socket &icapsock)
+{
+    String line("OPTIONS " + icapurl + " ICAP/1.0\r\nHost: " + icaphost + "\r\n\r\n");
+    icapsock.writeString(line.toCharArray());
+    // parse the response
+    char buff[8192];
+    // first line - look for 200 OK
+    icapsock.getLine(buff, 8192, scanTimeout());
+    line = buff;
+#ifdef DGDEBUG
+    std::cout << "ICAP/1.0 OPTIONS response:" << std::endl
+              << line << std::endl;
+#endif
+    if (line.after(" ").before(" ") != "200") {
+        reusable = false;
+        return false;
+    }
+    reusable = true;
+    usepreviews = false;
+    maxconnections = 0;
+    unsigned int optionsttl = 0;
+    while (icapsock.getLine(buff, 8192, scanTimeout()) > 0) {
+        line = buff;
+#ifdef DGDEBUG
+        std::cout << line << std::endl;
+#endif
+        if (line.startsWith("\r")) {
+            break;
+        } else if (line.startsWith("Preview:")) {
+            usepreviews = true;
+            previewsize = line.after(": ").toInteger();
+        } else if (line.startsWith("Server:")) {
+            if (line.contains("AntiVir-WebGate")) {
+                needsBody = true;
+            }
+        } else if (line.startsWith("X-Allow-Out:")) {
+            if (line.contains("X-Infection-Found")) {
+                supportsXIF = true;
+            }
+        } else if (line.startsWith("ISTag:")) {
+            istag = line.after(":");
+            istag.removeWhiteSpace();
+        } else if (line.startsWith("Max-Connections:")) {
+            maxconnections = line.after(": ").toInteger();
+        } else if (line.startsWith("Options-TTL:")) {
+            optionsttl = line.after(": ").toInteger();
+        } else if (line.startsWith("Connection:")) {
+            if (line.contains("close")) {
+                reusable = false;
+            }
+        } else if (line.startsWith("Encapsulated:")) {
+            // an options body isn't read, so the connection can't be reused after it
+            if (line.contains("opt-body")) {
+                reusable = false;
+            }
+        }
+    }
+    optionsexpiry = (optionsttl > 0) ? time(NULL) + optionsttl : 0;
+    return true;
+}
+
+// take a slot for a kept connection if there are fewer than Max-Connections
+// kept between all the children. slots held by children that have gone are reused
+bool icapinstance::claimConnSlot()
+{
+    if (connslots == NULL || maxconnections == 0)
+        return true;
+    unsigned int limit = (maxconnections < connslotcount) ? maxconnections : connslotcount;
+    if (connslot >= 0 && (unsigned int)connslot < limit)
+        return true;
+    freeConnSlot();
+    pid_t me = getpid();
+    for (unsigned int i = 0; i < limit; i++) {
+        pid_t holder = connslots[i];
+        if (holder != 0 && !(kill(holder, 0) < 0 && errno == ESRCH))
+            continue;
+        if (__sync_bool_compare_and_swap(&connslots[i], holder, me)) {
+            connslot = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+void icapinstance::freeConnSlot()
+{
+    if (connslots != NULL && connslot >= 0)
+        __sync_bool_compare_and_swap(&connslots[connslot], getpid(), 0);
+    connslot = -1;
+}
+
+// hand out the kept connection if it is still good, otherwise connect afresh.
+// one idle longer than probeinterval, or past the server's Options-TTL, is
+// checked with an OPTIONS request first, which also refreshes our view of the server
+Socket *icapinstance::getConnection()
+{
+    time_t now = time(NULL);
+    bool refresh = (optionsexpiry > 0 && now >= optionsexpiry);
+    Socket *icapsock = idlesock;
+    idlesock = NULL;
+
+    if (icapsock != NULL) {
+        // anything to read on an idle connection means it was closed (or is confused)
+        bool healthy = !icapsock->checkForInput();
+        if (healthy && (refresh || (now - idlesince) >= (time_t)probeinterval)) {
+            try {
+                healthy = doOptions(*icapsock) && reusable;
+            } catch (std::exception &e) {
+                healthy = false;
+            }
+            refresh = false;
+        }
+        if (healthy) {
+#ifdef DGDEBUG
+            std::cout << "Reusing ICAP connection" << std::endl;
+#endif
+            reusable = false;
+            return icapsock;
+        }
+#ifdef DGDEBUG
+        std::cout << "Kept ICAP connection has gone - reconnecting" << std::endl;
+#endif
+        icapsock->close();
+        delete icapsock;
+    }
+
+    icapsock = new Socket;
+    if (icapsock->connect(icapip.toCharArray(), icapport)) {
+#ifdef DGDEBUG
+        std::cerr << "Error connecting to ICAP server" << std::endl;
+#endif
+        lastmessage = "Error connecting to ICAP server";
+        syslog(LOG_ERR, "Error connecting to ICAP server");
+        delete icapsock;
+        return NULL;
+    }
+    if (refresh) {
+        try {
+            doOptions(*icapsock);
+        } catch (std::exception &e) {
+            syslog(LOG_ERR, "ICAP server did not respond to OPTIONS request: %s", e.what());
+        }
+        if (!reusable) {
+            // carry on with a fresh connection for the scan itself
+            icapsock->close();
+            icapsock->reset();
+            if (icapsock->connect(icapip.toCharArray(), icapport)) {
+                lastmessage = "Error connecting to ICAP server";
+                syslog(LOG_ERR, "Error connecting to ICAP server");
+                delete icapsock;
+                return NULL;
+            }
+        }
+    }
+    reusable = false;
+    return icapsock;
+}
+
+// keep the connection if the transaction on it completed & we're allowed another
+void icapinstance::releaseConnection(Socket *icapsock)
+{
+    // a cancelled scan has had its connection shut down under it
+    if (keepalive && reusable && !isCancelled() && claimConnSlot()) {
+        idlesock = icapsock;
+        idlesince = time(NULL);
+        return;
+    }
+    icapsock->close();
+    delete icapsock;
+    freeConnSlot();
+}
+
 // send memory buffer to ICAP server for scanning
 int icapinstance::scanMemory(HTTPHeader *requestheader, HTTPHeader *docheader, const char *user, int filtergroup,
     const char *ip, const char *object, unsigned int objectsize, NaughtyFilter *checkme,
@@ -209,8 +455,19 @@ int icapinstance::scanMemory(HTTPHeader *requestheader, HTTPHeader *docheader, c
 {
     lastvirusname = lastmessage = "";
 
-    Socket icapsock;
+    Socket *icapsock = getConnection();
+    if (icapsock == NULL)
+        return DGCS_SCANERROR;
+    setCancellable(icapsock->getFD());
+    int rc = doScanMemory(*icapsock, requestheader, docheader, object, objectsize, checkme);
+    clearCancellable();
+    releaseConnection(icapsock);
+    return rc;
+}
 
+int icapinstance::doScanMemory(Socket &icapsock, HTTPHeader *requestheader, HTTPHeader *docheader,
+    const char *object, unsigned int objectsize, NaughtyFilter *checkme)
+{
     if (not doHeaders(icapsock, requestheader, docheader, objectsize)) {
         icapsock.close();
         return DGCS_SCANERROR;
@@ -223,7 +480,7 @@ int icapinstance::scanMemory(HTTPHeader *requestheader, HTTPHeader *docheader, c
     unsigned int sent = 0;
     if (usepreviews && ((objectsize > previewsize) || previewforce)) {
         try {
-            if (!icapsock.writeToSocket(object, previewsize, 0, o.content_scanner_timeout)) {
+            if (!icapsock.writeToSocket(object, previewsize, 0, scanTimeout())) {
                 throw std::runtime_error("standard error");
             }
             sent += previewsize;
@@ -234,6 +491,7 @@ int icapinstance::scanMemory(HTTPHeader *requestheader, HTTPHeader *docheader, c
             // some servers send "continue" immediately followed by another response
             if (icapsock.checkForInput()) {
                 int rc = doScan(icapsock, docheader, object, objectsize, checkme);
+                reusable = false;
                 if (rc != ICAP_NODATA)
                     return rc;
             }
@@ -247,6 +505,7 @@ int icapinstance::scanMemory(HTTPHeader *requestheader, HTTPHeader *docheader, c
             // this *might* just be an early response & closed connection
             if (icapsock.checkForInput()) {
                 int rc = doScan(icapsock, docheader, object, objectsize, checkme);
+                reusable = false;
                 if (rc != ICAP_NODATA)
                     return rc;
             }
@@ -257,7 +516,7 @@ int icapinstance::scanMemory(HTTPHeader *requestheader, HTTPHeader *docheader, c
         }
     }
     try {
-        icapsock.writeToSockete(object + sent, objectsize - sent, 0, o.content_scanner_timeout);
+        icapsock.writeToSockete(object + sent, objectsize - sent, 0, scanTimeout());
 #ifdef DGDEBUG
         std::cout << "total sent to icap: " << objectsize << std::endl;
 #endif
@@ -272,6 +531,7 @@ int icapinstance::scanMemory(HTTPHeader *requestheader, HTTPHeader *docheader, c
         // this *might* just be an early response & closed connection
         if (icapsock.checkForInput()) {
             int rc = doScan(icapsock, docheader, object, objectsize, checkme);
+            reusable = false;
             if (rc != ICAP_NODATA)
                 return rc;
         }
@@ -299,10 +559,26 @@ int icapinstance::scanFile(HTTPHeader *requestheader, HTTPHeader *docheader, con
         syslog(LOG_ERR, "Error opening file to send to ICAP: %s", strerror(errno));
         return DGCS_SCANERROR;
     }
+
+    Socket *icapsock = getConnection();
+    if (icapsock == NULL) {
+        close(filefd);
+        return DGCS_SCANERROR;
+    }
+    setCancellable(icapsock->getFD());
+    // closes filefd
+    int rc = doScanFile(*icapsock, requestheader, docheader, filefd, checkme);
+    clearCancellable();
+    releaseConnection(icapsock);
+    return rc;
+}
+
+int icapinstance::doScanFile(Socket &icapsock, HTTPHeader *requestheader, HTTPHeader *docheader,
+    int filefd, NaughtyFilter *checkme)
+{
     lseek(filefd, 0, SEEK_SET);
     unsigned int filesize = lseek(filefd, 0, SEEK_END);
 
-    Socket icapsock;
     if (not doHeaders(icapsock, requestheader, docheader, filesize)) {
         icapsock.close();
         close(filefd);
@@ -330,7 +606,7 @@ int icapinstance::scanFile(HTTPHeader *requestheader, HTTPHeader *docheader, con
                 if (rc == 0) {
                     break; // should never happen
                 }
-                if (!icapsock.writeToSocket(data, rc, 0, o.content_scanner_timeout)) {
+                if (!icapsock.writeToSocket(data, rc, 0, scanTimeout())) {
                     throw std::runtime_error("could not write to socket");
                 }
                 memcpy(object, data, (rc > 100) ? 100 : rc);
@@ -347,6 +623,7 @@ int icapinstance::scanFile(HTTPHeader *requestheader, HTTPHeader *docheader, con
             // some servers send "continue" immediately followed by another response
             if (icapsock.checkForInput()) {
                 int rc = doScan(icapsock, docheader, object, objectsize, checkme);
+                reusable = false;
                 if (rc != ICAP_NODATA) {
                     delete[] data;
                     close(filefd);
@@ -368,6 +645,7 @@ int icapinstance::scanFile(HTTPHeader *requestheader, HTTPHeader *docheader, con
             // this *might* just be an early response & closed connection
             if (icapsock.checkForInput()) {
                 int rc = doScan(icapsock, docheader, object, objectsize, checkme);
+                reusable = false;
                 if (rc != ICAP_NODATA)
                     return rc;
             }
@@ -398,7 +676,7 @@ int icapinstance::scanFile(HTTPHeader *requestheader, HTTPHeader *docheader, con
             }
             memcpy(object + objectsize, data, (rc > (100 - objectsize)) ? (100 - objectsize) : rc);
             objectsize += (rc > (100 - objectsize)) ? (100 - objectsize) : rc;
-            icapsock.writeToSockete(data, rc, 0, o.content_scanner_timeout);
+            icapsock.writeToSockete(data, rc, 0, scanTimeout());
             sent += rc;
         }
 #ifdef DGDEBUG
@@ -419,6 +697,7 @@ int icapinstance::scanFile(HTTPHeader *requestheader, HTTPHeader *docheader, con
         // this *might* just be an early response & closed connection
         if (icapsock.checkForInput()) {
             int rc = doScan(icapsock, docheader, object, objectsize, checkme);
+            reusable = false;
             if (rc != ICAP_NODATA)
                 return rc;
         }
@@ -429,18 +708,136 @@ int icapinstance::scanFile(HTTPHeader *requestheader, HTTPHeader *docheader, con
     return doScan(icapsock, docheader, object, objectsize, checkme);
 }
 
-// send ICAP request headers, returning success or failure
-bool icapinstance::doHeaders(Socket &icapsock, HTTPHeader *reqheader, HTTPHeader *respheader, unsigned int objectsize)
+// open a RESPMOD for a response whose body is about to be downloaded
+bool icapinstance::startStream(HTTPHeader *requestheader, HTTPHeader *docheader, NaughtyFilter *checkme)
+{
+    if (!streaming)
+        return false;
+    abortStream();
+    lastvirusname = lastmessage = "";
+
+    streamsock = getConnection();
+    if (streamsock == NULL)
+        return false;
+    if (!doHeaders(*streamsock, requestheader, docheader, 0, true)) {
+        abortStream();
+        return false;
+    }
+    streamdocheader = docheader;
+    streamcheckme = checkme;
+    streaminpreview = usepreviews;
+    streampreviewleft = previewsize;
+    streamverdict = ICAP_CONTINUE;
+    streamhead.clear();
+    return true;
+}
+
+void icapinstance::writeChunk(Socket &icapsock, const char *block, unsigned int len)
+{
+    if (len == 0)
+        return;
+    char chunksizehex[32];
+    snprintf(chunksizehex, sizeof(chunksizehex), "%x\r\n", len);
+    icapsock.writeString(chunksizehex);
+    icapsock.writeToSockete(block, len, 0, scanTimeout());
+    icapsock.writeString("\r\n");
+}
+
+// send the next block of the body. once the preview is complete the server's
+// answer is waited for - a 204 then means the rest needn't be sent at all
+bool icapinstance::streamBlock(const char *block, int len)
 {
-    int rc = icapsock.connect(icapip.toCharArray(), icapport);
-    if (rc) {
+    if (streamsock == NULL || streamverdict != ICAP_CONTINUE)
+        return false;
+    try {
+        if (streamhead.length() < 100)
+            streamhead.append(block, (len < (int)(100 - streamhead.length())) ? len : 100 - streamhead.length());
+        if (streaminpreview) {
+            unsigned int n = ((unsigned int)len < streampreviewleft) ? len : streampreviewleft;
+            writeChunk(*streamsock, block, n);
+            streampreviewleft -= n;
+            block += n;
+            len -= n;
+            if (streampreviewleft > 0)
+                return true;
+            streamsock->writeString("0\r\n\r\n");
+            streaminpreview = false;
+            int rc = doScan(*streamsock, streamdocheader, streamhead.data(), streamhead.length(), streamcheckme);
+            if (rc != ICAP_CONTINUE) {
 #ifdef DGDEBUG
-        std::cerr << "Error connecting to ICAP server" << std::endl;
+                std::cout << "ICAP answered the streamed preview: " << rc << std::endl;
 #endif
-        lastmessage = "Error connecting to ICAP server";
-        syslog(LOG_ERR, "Error connecting to ICAP server");
+                streamverdict = rc;
+                return false;
+            }
+        }
+        writeChunk(*streamsock, block, len);
+        // the server may answer before the end (or straight after a 100)
+        if (streamsock->checkForInput()) {
+            streamverdict = doScan(*streamsock, streamdocheader, streamhead.data(), streamhead.length(), streamcheckme);
+            reusable = false;
+            if (streamverdict == ICAP_NODATA) {
+                lastmessage = "ICAP server closed the connection";
+                streamverdict = DGCS_SCANERROR;
+            }
+            return false;
+        }
+    } catch (std::exception &e) {
+#ifdef DGDEBUG
+        std::cerr << "Exception streaming data to ICAP: " << e.what() << std::endl;
+#endif
+        lastmessage = "Exception streaming data to ICAP";
+        syslog(LOG_ERR, "Exception streaming data to ICAP: %s", e.what());
+        reusable = false;
+        streamverdict = DGCS_SCANERROR;
         return false;
     }
+    return true;
+}
+
+// the body is complete - finish the RESPMOD & return the verdict
+int icapinstance::endStream()
+{
+    if (streamsock == NULL)
+        return DGCS_SCANERROR;
+    int rc = streamverdict;
+    if (rc == ICAP_CONTINUE) {
+        try {
+            // if it all fitted in the preview, ieof tells the server there's no more to come
+            streamsock->writeString(streaminpreview ? "0; ieof\r\n\r\n" : "0\r\n\r\n");
+            rc = doScan(*streamsock, streamdocheader, streamhead.data(), streamhead.length(), streamcheckme);
+        } catch (std::exception &e) {
+            syslog(LOG_ERR, "Exception streaming data to ICAP: %s", e.what());
+            rc = DGCS_SCANERROR;
+        }
+        if (rc == ICAP_CONTINUE || rc == ICAP_NODATA) {
+            lastmessage = "ICAP server gave no verdict on streamed data";
+            syslog(LOG_ERR, "ICAP server gave no verdict on streamed data");
+            reusable = false;
+            rc = DGCS_SCANERROR;
+        }
+    }
+    releaseConnection(streamsock);
+    streamsock = NULL;
+    return rc;
+}
+
+void icapinstance::abortStream()
+{
+    if (streamsock == NULL)
+        return;
+    // the server is part way through a transaction we won't finish
+    streamsock->close();
+    delete streamsock;
+    streamsock = NULL;
+    freeConnSlot();
+}
+
+// send ICAP request headers, returning success or failure
+bool icapinstance::doHeaders(Socket &icapsock, HTTPHeader *reqheader, HTTPHeader *respheader, unsigned int objectsize, bool streamed)
+{
+    // the size of a streamed body isn't known yet, so it always starts with a preview
+    bool preview = usepreviews && (streamed || (objectsize > previewsize) || previewforce);
     char objectsizehex[32];
     // encapsulated HTTP request header:
     // use a dummy unless it proves absolutely necessary to do otherwise,
@@ -448,7 +845,7 @@ bool icapinstance::doHeaders(Socket &icapsock, HTTPHeader *reqheader, HTTPHeader
     // leakage over the network.
     String encapsulatedheader("GET " + reqheader->getUrl() + " HTTP/1.0\r\n\r\n");
     // body chunk size in hex - either full body, or just preview
-    if (usepreviews && ((objectsize > previewsize) || previewforce)) {
+    if (preview) {
         snprintf(objectsizehex, sizeof(objectsizehex), "%x\r\n", previewsize);
     } else {
         snprintf(objectsizehex, sizeof(objectsizehex), "%x\r\n", objectsize);
@@ -461,9 +858,13 @@ bool icapinstance::doHeaders(Socket &icapsock, HTTPHeader *reqheader, HTTPHeader
 	}
 	httpresponseheader += "\r\n";*/
     String httpresponseheader("HTTP/1.0 200 OK\r\n\r\n");
+    // streamed bodies go as they came from the server, so say how they're encoded
+    if (streamed && respheader->isCompressed()) {
+        httpresponseheader = "HTTP/1.0 200 OK\r\nContent-Encoding: " + respheader->contentEncoding() + "\r\n\r\n";
+    }
     // ICAP header itself
     String icapheader("RESPMOD " + icapurl + " ICAP/1.0\r\nHost: " + icaphost + "\r\nAllow: 204\r\nEncapsulated: req-hdr=0, res-hdr=" + String(encapsulatedheader.length()) + ", res-body=" + String(httpresponseheader.length() + encapsulatedheader.length()));
-    if (usepreviews && ((objectsize > previewsize) || previewforce)) {
+    if (preview) {
         icapheader += "\r\nPreview: " + String(previewsize);
    }
     icapheader += "\r\n\r\n";
@@ -475,7 +876,8 @@ bool icapinstance::doHeaders(Socket &icapsock, HTTPHeader *reqheader, HTTPHeader
         icapsock.writeString(icapheader.toCharArray());
         icapsock.writeString(encapsulatedheader.toCharArray());
         icapsock.writeString(httpresponseheader.toCharArray());
-        icapsock.writeString(objectsizehex);
+        if (!streamed)
+            icapsock.writeString(objectsizehex);
     } catch (std::exception &e) {
 #ifdef DGDEBUG
         std::cerr << "Exception sending headers to ICAP: " << e.what() << std::endl;
@@ -493,7 +895,7 @@ int icapinstance::doScan(Socket &icapsock, HTTPHeader *docheader, const char *ob
     char *data = new char[8192];
     try {
         String line;
-        int rc = icapsock.getLine(data, 8192, o.content_scanner_timeout);
+        int rc = icapsock.getLine(data, 8192, scanTimeout());
         if (rc == 0)
             return ICAP_NODATA;
         line = data;
@@ -509,6 +911,19 @@ int icapinstance::doScan(Socket &icapsock, HTTPHeader *docheader, const char *ob
 #ifdef DGDEBUG
             std::cerr << "ICAP says clean!" << std::endl;
 #endif
+            // read to the end of the headers so the connection can carry the next request
+            reusable = true;
+            while (icapsock.getLine(data, 8192, scanTimeout()) > 0) {
+                if (data[0] == 13)
+                    break;
+                line = data;
+                if (line.startsWith("Connection:") && line.contains("close"))
+                    reusable = false;
+                else if (line.startsWith("ISTag:")) {
+                    istag = line.after(":");
+                    istag.removeWhiteSpace();
+                }
+            }
             delete[] data;
             return DGCS_CLEAN;
         } else if (returncode == "100") {
@@ -520,7 +935,7 @@ int icapinstance::doScan(Socket &icapsock, HTTPHeader *docheader, const char *ob
             // call doScan() again later, because people like Symantec seem
             // to think sending code 100 then code 204 one after the other
             // is not an abuse of the ICAP specification.
-            while (icapsock.getLine(data, 8192, o.content_scanner_timeout) > 0) {
+            while (icapsock.getLine(data, 8192, scanTimeout()) > 0) {
                 if (data[0] == 13)
                     break;
             }
@@ -530,10 +945,14 @@ int icapinstance::doScan(Socket &icapsock, HTTPHeader *docheader, const char *ob
 #ifdef DGDEBUG
             std::cerr << "ICAP says maybe not clean!" << std::endl;
 #endif
-            while (icapsock.getLine(data, 8192, o.content_scanner_timeout) > 0) {
+            while (icapsock.getLine(data, 8192, scanTimeout()) > 0) {
                 if (data[0] == 13) // end marker
                     break;
                 line = data;
+                if (line.startsWith("ISTag:")) {
+                    istag = line.after(":");
+                    istag.removeWhiteSpace();
+                }
                 // Symantec's engine gives us the virus name in the ICAP headers
                 if (supportsXIF && line.startsWith("X-Infection-Found")) {
 #ifdef DGDEBUG
@@ -552,7 +971,7 @@ int icapinstance::doScan(Socket &icapsock, HTTPHeader *docheader, const char *ob
             if (needsBody) {
                 // grab & compare the HTTP return code from modified response
                 // if it's been modified, assume there's an infection
-                icapsock.getLine(data, 8192, o.content_scanner_timeout);
+                icapsock.getLine(data, 8192, scanTimeout());
                 line = data;
 #ifdef DGDEBUG
                 std::cout << "Comparing original return code to modified:" << std::endl
@@ -572,7 +991,7 @@ int icapinstance::doScan(Socket &icapsock, HTTPHeader *docheader, const char *ob
                 }
                 // ok - headers were identical, so look at encapsulated body
                 // discard the rest of the encapsulated headers
-                while (icapsock.getLine(data, 8192, o.content_scanner_timeout) > 0) {
+                while (icapsock.getLine(data, 8192, scanTimeout()) > 0) {
                     if (data[0] == 13)
                         break;
                 }
@@ -580,7 +999,7 @@ int icapinstance::doScan(Socket &icapsock, HTTPHeader *docheader, const char *ob
 #ifdef DGDEBUG
                 std::cout << "Comparing original body data to modified" << std::endl;
 #endif
-                icapsock.getLine(data, 8192, o.content_scanner_timeout);
+                icapsock.getLine(data, 8192, scanTimeout());
                 line = data;
                 int bodysize = line.hexToInteger();
                 // get, say, the first 100 bytes and compare them to what we
@@ -588,7 +1007,7 @@ int icapinstance::doScan(Socket &icapsock, HTTPHeader *docheader, const char *ob
                 unsigned int chunksize = (bodysize < 100) ? bodysize : 100;
                 if (chunksize > objectsize)
                     chunksize = objectsize;
-                icapsock.readFromSocket(data, chunksize, 0, o.content_scanner_timeout);
+                icapsock.readFromSocket(data, chunksize, 0, scanTimeout());
                 if (memcmp(data, object, chunksize) == 0) {
 #ifdef DGDEBUG
                     std::cerr << "ICAP says clean!" << std::endl;
@@ -120,16 +120,18 @@ int kavdinstance::scanFile(HTTPHeader *requestheader, HTTPHeader *docheader, con
         stripedsocks.close();
         return DGCS_SCANERROR;
     }
+    setCancellable(stripedsocks.getFD());
     char *buff = new char[4096];
     memset(buff, 0, 4096);
     int rc;
     try {
         // read kaspersky kavdscan (AV Enging Server) - format: 2xx greeting
-        rc = stripedsocks.getLine(buff, 4096, o.content_scanner_timeout);
+        rc = stripedsocks.getLine(buff, 4096, scanTimeout());
     } catch (std::exception &e) {
     }
     if (buff[0] != '2') {
         delete[] buff;
+        clearCancellable();
         stripedsocks.close();
         syslog(LOG_ERR, "%s", "kavdscan did not return ok");
         return DGCS_SCANERROR;
@@ -138,14 +140,16 @@ int kavdinstance::scanFile(HTTPHeader *requestheader, HTTPHeader *docheader, con
         stripedsocks.writeString(command.toCharArray());
     } catch (std::exception &e) {
         delete[] buff;
+        clearCancellable();
         stripedsocks.close();
         syslog(LOG_ERR, "%s", "unable to write to kavdscan");
         return DGCS_SCANERROR;
     }
     try {
-        rc = stripedsocks.getLine(buff, 4096, o.content_scanner_timeout);
+        rc = stripedsocks.getLine(buff, 4096, scanTimeout());
     } catch (std::exception &e) {
         delete[] buff;
+        clearCancellable();
         stripedsocks.close();
         syslog(LOG_ERR, "%s", "Error reading kavdscan socket");
         return DGCS_SCANERROR;
@@ -159,6 +163,7 @@ int kavdinstance::scanFile(HTTPHeader *requestheader, HTTPHeader *docheader, con
         std::cerr << "kavdscan - clean" << std::endl;
 #endif
         delete[] buff;
+        clearCancellable();
         stripedsocks.close();
         return DGCS_CLEAN;
     }
@@ -169,9 +174,10 @@ int kavdinstance::scanFile(HTTPHeader *requestheader, HTTPHeader *docheader, con
             reply.removeWhiteSpace();
             lastvirusname = lastvirusname + " " + reply.after("322-").before(" ");
             try {
-                rc = stripedsocks.getLine(buff, 4096, o.content_scanner_timeout);
+                rc = stripedsocks.getLine(buff, 4096, scanTimeout());
             } catch (std::exception &e) {
                 delete[] buff;
+                clearCancellable();
                 stripedsocks.close();
                 syslog(LOG_ERR, "%s", "Error reading kavdscan socket");
                 return DGCS_SCANERROR;
@@ -183,6 +189,7 @@ int kavdinstance::scanFile(HTTPHeader *requestheader, HTTPHeader *docheader, con
         }
         std::cout << "lastvirusname: " << lastvirusname << std::endl;
         delete[] buff;
+        clearCancellable();
         stripedsocks.close();
 
         // format: 322 nastyvirus blah
@@ -190,6 +197,7 @@ int kavdinstance::scanFile(HTTPHeader *requestheader, HTTPHeader *docheader, con
         return DGCS_INFECTED;
     }
     delete[] buff;
+    clearCancellable();
     stripedsocks.close();
     // must be an error then
     lastmessage = reply;
@@ -96,9 +96,7 @@ int dminstance::in(DataBuffer *d, Socket *sock, Socket *peersock, class HTTPHead
     if ((bytesremaining < 0) && !(docheader->isPersistent()))
         geteverything = true;
 
-    char *block = NULL; // buffer for storing a grabbed block from the
-    // imput stream
-    char *temp = NULL;
+    char *block = NULL; // where the next block from the input stream goes
 
     bool swappedtodisk = false;
     bool doneinitialdelay = false;
@@ -118,6 +116,13 @@ int dminstance::in(DataBuffer *d, Socket *sock, Socket *peersock, class HTTPHead
     std::cout << "blocksize: " << blocksize << std::endl;
 #endif
 
+    // if we know how big the body is and it will fit in RAM, allocate for it up front
+    if (!geteverything && (bytesremaining > 0) && (bytesremaining <= (wantall ? o.max_content_ramcache_scan_size : o.max_content_filter_size)))
+        d->reserveSpace(bytesremaining);
+
+    // compressed bodies are decompressed block by block as they arrive
+    d->startDecompression();
+
     while ((bytesremaining > 0) || geteverything) {
         // send x-header keep-alive here
         if (o.trickle_delay > 0) {
@@ -158,6 +163,7 @@ int dminstance::in(DataBuffer *d, Socket *sock, Socket *peersock, class HTTPHead
                     writeEINTR(d->tempfilefd, d->data, d->buffer_length);
                     swappedtodisk = true;
                     d->tempfilesize = d->buffer_length;
+                    d->abortDecompression(); // won't deflate stuff swapped to disk
                 }
             } else if (d->tempfilesize > o.max_content_filecache_scan_size) {
 // if swapped to disk and file too large for that too, then give up
@@ -190,14 +196,13 @@ int dminstance::in(DataBuffer *d, Socket *sock, Socket *peersock, class HTTPHead
             // if not getting everything until connection close, grab only what is left
             if (!geteverything && (newsize > bytesremaining))
                 newsize = bytesremaining;
-            delete[] block;
-            block = new char[newsize];
             try {
                 sock->checkForInput(d->timeout);
             } catch (std::exception &e) {
                 break;
             }
-            // improved more efficient socket read which uses the buffer better
+            // read straight onto the end of the body, which grows geometrically
+            block = d->reserveSpace(newsize);
             rc = d->bufferReadFromSocket(sock, block, newsize, d->timeout);
             // grab a block of input, doubled each time
 
@@ -206,16 +211,9 @@ int dminstance::in(DataBuffer *d, Socket *sock, Socket *peersock, class HTTPHead
                 // or none received so pipe is closed
             } else {
                 bytesremaining -= rc;
-                /*if (d->data != temp)
-					delete[] temp;*/
-                temp = new char[d->buffer_length + rc + 1]; // replacement store
-                temp[d->buffer_length + rc] = '\0';
-                memcpy(temp, d->data, d->buffer_length); // copy the current data
-                memcpy(temp + d->buffer_length, block, rc); // copy the new data
-                delete[] d->data; // delete the current data block
-                d->data = temp;
-                temp = NULL;
-                d->buffer_length += rc; // update data size counter
+                // decompress as we go, rather than all at the end
+                d->decompressBlock(block, rc);
+                d->commitSpace(rc); // update data size counter
             }
         } else {
             try {
@@ -241,24 +239,13 @@ int dminstance::in(DataBuffer *d, Socket *sock, Socket *peersock, class HTTPHead
     }
 
     if (!(*toobig) && !swappedtodisk) { // won't deflate stuff swapped to disk
-        if (d->decompress.contains("deflate")) {
-#ifdef DGDEBUG
-            std::cout << "zlib format" << std::endl;
-#endif
-            d->zlibinflate(false); // incoming stream was zlib compressed
-        } else if (d->decompress.contains("gzip")) {
-#ifdef DGDEBUG
-            std::cout << "gzip format" << std::endl;
-#endif
-            d->zlibinflate(true); // incoming stream was gzip compressed
-        }
+        d->finishDecompression();
+    } else {
+        d->abortDecompression();
     }
     d->bytesalreadysent = 0;
 #ifdef DGDEBUG
     std::cout << "Leaving default download manager plugin" << std::endl;
 #endif
-    delete[] block;
-    /*if (d->data != temp)
-		delete[] temp;*/
     return 0;
 }
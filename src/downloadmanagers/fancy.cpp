@@ -168,8 +168,7 @@ int fancydm::in(DataBuffer *d, Socket *sock, Socket *peersock, class HTTPHeader
 
     String message, jsmessage;
 
-    char *block = NULL; // buffer for storing a grabbed block from the input stream
-    char *temp = NULL;
+    char *block = NULL; // where the next block from the input stream goes
 
     bool swappedtodisk = false;
 
@@ -205,6 +204,13 @@ int fancydm::in(DataBuffer *d, Socket *sock, Socket *peersock, class HTTPHeader
             filename = filename.after("/");
     }
 
+    // if we know how big the body is and it will fit in RAM, allocate for it up front
+    if (!geteverything && (expectedsize > 0) && (expectedsize <= (wantall ? o.max_content_ramcache_scan_size : o.max_content_filter_size)))
+        d->reserveSpace(expectedsize);
+
+    // compressed bodies are decompressed block by block as they arrive
+    d->startDecompression();
+
     while ((bytesgot < expectedsize) || geteverything) {
         // send text header to show status
         if (o.trickle_delay > 0) {
@@ -291,6 +297,7 @@ int fancydm::in(DataBuffer *d, Socket *sock, Socket *peersock, class HTTPHeader
                     writeEINTR(d->tempfilefd, d->data, d->buffer_length);
                     swappedtodisk = true;
                     d->tempfilesize = d->buffer_length;
+                    d->abortDecompression(); // won't deflate stuff swapped to disk
                 }
             } else if (bytesgot > o.max_content_filecache_scan_size) {
                 (*toobig) = true;
@@ -363,14 +370,13 @@ int fancydm::in(DataBuffer *d, Socket *sock, Socket *peersock, class HTTPHeader
             // if not getting everything until connection close, grab only what is left
             if (!geteverything && (newsize > (expectedsize - bytesgot)))
                 newsize = expectedsize - bytesgot;
-            delete[] block;
-            block = new char[newsize];
             try {
                 sock->checkForInput(d->timeout);
             } catch (std::exception &e) {
                 break;
             }
-            // improved more efficient socket read which uses the buffer better
+            // read straight onto the end of the body, which grows geometrically
+            block = d->reserveSpace(newsize);
             rc = d->bufferReadFromSocket(sock, block, newsize, d->timeout, o.trickle_delay);
             // grab a block of input, doubled each time
 
@@ -378,16 +384,9 @@ int fancydm::in(DataBuffer *d, Socket *sock, Socket *peersock, class HTTPHeader
                 break; // an error occurred so end the while()
                 // or none received so pipe is closed
             } else {
-                /*if (d->data != temp)
-					delete[] temp;*/
-                temp = new char[d->buffer_length + rc + 1]; // replacement store
-                temp[d->buffer_length + rc] = '\0';
-                memcpy(temp, d->data, d->buffer_length); // copy the current data
-                memcpy(temp + d->buffer_length, block, rc); // copy the new data
-                delete[] d->data; // delete the current data block
-                d->data = temp;
-                temp = NULL;
-                d->buffer_length += rc; // update data size counter
+                // decompress as we go, rather than all at the end
+                d->decompressBlock(block, rc);
+                d->commitSpace(rc); // update data size counter
             }
         } else {
             try {
@@ -457,22 +456,11 @@ int fancydm::in(DataBuffer *d, Socket *sock, Socket *peersock, class HTTPHeader
     }
 
     if (!(*toobig) && !swappedtodisk) { // won't deflate stuff swapped to disk
-        if (d->decompress.contains("deflate")) {
-#ifdef DGDEBUG
-            std::cout << "zlib format" << std::endl;
-#endif
-            d->zlibinflate(false); // incoming stream was zlib compressed
-        } else if (d->decompress.contains("gzip")) {
-#ifdef DGDEBUG
-            std::cout << "gzip format" << std::endl;
-#endif
-            d->zlibinflate(true); // incoming stream was gzip compressed
-        }
+        d->finishDecompression();
+    } else {
+        d->abortDecompression();
     }
     d->bytesalreadysent = 0;
-    /*if (d->data != temp)
-		delete[] temp;*/
-    delete[] block;
     return 0;
 }
 